@@ -0,0 +1,90 @@
+#include "adaptive.h"
+#include "log.h"
+
+/* Length (s) of a control period */
+static const time_t period = 10;
+
+/* Weight of the latest period in the arrival rate */
+static const double rate_weight = 0.25;
+
+void
+al_init (struct adaptive *al, uint32_t floor, uint32_t ceiling,
+         int low, int high, time_t now)
+{
+  al->floor = floor < ceiling ? floor : ceiling;
+  al->ceiling = ceiling;
+  al->low = low;
+  al->high = high;
+  al->lease_time = ceiling;
+  al->period_start = now;
+  al->last_change = now;
+  al->arrivals = 0;
+  al->rate = 0;
+  al->nshortened = 0;
+  al->nlengthened = 0;
+}
+
+void
+al_arrival (struct adaptive *al)
+{
+  al->arrivals++;
+}
+
+/* Adjust the lease time at the end of a period */
+static void
+al_update (struct adaptive *al, struct addr_space *as, time_t now)
+{
+  time_t elapsed = now - al->period_start;
+  double rate = (double) al->arrivals / elapsed;
+
+  /* Idle periods without any message count as no arrivals */
+  if (elapsed >= 4 * period)
+    al->rate = rate;
+  else
+    al->rate += rate_weight * (rate - al->rate);
+
+  al->period_start = now;
+  al->arrivals = 0;
+
+  size_t size = as_size (as);
+  size_t used = as_used (as);
+  int utilization = 100 * used / size;
+
+  /* Time until the free addresses run out at the current rate */
+  double exhaustion = al->rate > 0 ? (size - used) / al->rate : 1e9;
+
+  uint32_t lease_time = al->lease_time;
+  if (utilization >= al->high || exhaustion < al->lease_time) {
+    lease_time /= 2;
+    if (lease_time < al->floor)
+      lease_time = al->floor;
+  } else if (utilization < al->low && exhaustion >= 2.0 * al->lease_time
+             && now - al->last_change >= al->lease_time) {
+    lease_time = lease_time > al->ceiling / 2 ? al->ceiling : lease_time * 2;
+  }
+
+  if (lease_time == al->lease_time)
+    return;
+
+  log_info ("Lease time %us -> %us (utilization %d%%, %.2f arrivals/s)",
+            al->lease_time, lease_time, utilization, al->rate);
+
+  al->last_change = now;
+  if (lease_time < al->lease_time)
+    al->nshortened++;
+  else
+    al->nlengthened++;
+  al->lease_time = lease_time;
+}
+
+uint32_t
+al_lease_time (struct adaptive *al, struct addr_space *as, time_t now)
+{
+  if (al->floor == 0)
+    return al->ceiling;
+
+  if (now - al->period_start >= period)
+    al_update (al, as, now);
+
+  return al->lease_time;
+}
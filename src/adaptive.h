@@ -0,0 +1,67 @@
+#ifndef ADAPTIVE_H_INCLUDED
+#define ADAPTIVE_H_INCLUDED
+
+/* Adaptive lease time
+ *
+ * Shortens the lease time handed out from a pool as it fills up,
+ * so that addresses of departed clients come back before the pool
+ * runs out, and lengthens it again once the pool has room, so that
+ * leases are not kept short for good. Once per period the pool is
+ * considered under pressure if its utilization reaches the high
+ * watermark, or if arrivals at the recent rate would use up the
+ * free addresses before a lease of the current time expires. Under
+ * pressure the lease time is halved down to the floor. Below the
+ * low watermark, with arrivals that would take at least twice the
+ * lease time to use up the pool, it is doubled up to the ceiling,
+ * but only once leases of the current time have had time to be
+ * handed out to all clients.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "addr_space.h"
+
+struct adaptive {
+  /* Lease time bounds, a floor of 0 disables adaptation */
+  uint32_t floor;
+  uint32_t ceiling;
+
+  /* Utilization watermarks, in percent */
+  int low;
+  int high;
+
+  /* Current lease time */
+  uint32_t lease_time;
+
+  /* Start of the current period */
+  time_t period_start;
+
+  /* Time of the last change of the lease time */
+  time_t last_change;
+
+  /* New bindings in the current period */
+  size_t arrivals;
+
+  /* Smoothed arrival rate, in bindings per second */
+  double rate;
+
+  /* Number of times the lease time was shortened or lengthened */
+  size_t nshortened;
+  size_t nlengthened;
+};
+
+/* Initialize controller, lease times stay at ceiling if floor
+ * is 0 */
+void al_init (struct adaptive *al, uint32_t floor, uint32_t ceiling,
+              int low, int high, time_t now);
+
+/* Count a new binding */
+void al_arrival (struct adaptive *al);
+
+/* Lease time to hand out from the pool */
+uint32_t al_lease_time (struct adaptive *al, struct addr_space *as,
+                        time_t now);
+
+#endif
@@ -3,6 +3,17 @@
 
 #include "addr_space.h"
 
+#define BIT_GET(set, i) (((set)[(i) / 64] >> ((i) % 64)) & 1)
+#define BIT_SET(set, i) ((set)[(i) / 64] |= (uint64_t) 1 << ((i) % 64))
+#define BIT_CLEAR(set, i) ((set)[(i) / 64] &= ~((uint64_t) 1 << ((i) % 64)))
+
+/* Offset of an address from the start of the address space */
+static uint32_t
+as_offset (struct addr_space *as, in_addr_t addr)
+{
+  return ntohl (addr) - ntohl (as->lo);
+}
+
 void
 as_init (struct addr_space *as, in_addr_t lo, in_addr_t hi)
 {
@@ -13,44 +24,96 @@ as_init (struct addr_space *as, in_addr_t lo, in_addr_t hi)
   as->hi = hi;
   as->lo = lo;
   as->next = lo;
-  as->free = NULL;
+
+  size_t size = as_size (as);
+  as->queue = malloc (sizeof (*as->queue) * size);
+  as->queue_head = 0;
+  as->queue_len = 0;
+  as->free_bits = calloc ((size + 63) / 64, sizeof (*as->free_bits));
+  as->queued_bits = calloc ((size + 63) / 64, sizeof (*as->queued_bits));
   as->nfree = 0;
 }
 
 int
 as_alloc (struct addr_space *as, in_addr_t *addr)
 {
-  if (as->nfree > 0) {
-    *addr = as->free[as->nfree - 1];
-    as->nfree--;
+  if (ntohl (as->next) <= ntohl (as->hi)) {
+    *addr = as->next;
+    as->next = htonl (ntohl (as->next) + 1);
     return 0;
   }
 
-  if (ntohl (as->next) > ntohl (as->hi))
+  size_t size = as_size (as);
+  while (as->queue_len > 0) {
+    uint32_t off = as->queue[as->queue_head];
+    as->queue_head = (as->queue_head + 1) % size;
+    as->queue_len--;
+    BIT_CLEAR (as->queued_bits, off);
+
+    if (BIT_GET (as->free_bits, off)) {
+      BIT_CLEAR (as->free_bits, off);
+      as->nfree--;
+      *addr = htonl (ntohl (as->lo) + off);
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+int
+as_claim (struct addr_space *as, in_addr_t addr)
+{
+  uint32_t off = as_offset (as, addr);
+
+  if (off >= as_offset (as, as->next) || !BIT_GET (as->free_bits, off))
     return -1;
 
-  *addr = as->next;
-  as->next = htonl (ntohl (as->next) + 1);
+  /* The queue entry, if any, is skipped when it is reached */
+  BIT_CLEAR (as->free_bits, off);
+  as->nfree--;
 
   return 0;
 }
 
+size_t
+as_size (struct addr_space *as)
+{
+  return (size_t) ntohl (as->hi) - ntohl (as->lo) + 1;
+}
+
+size_t
+as_used (struct addr_space *as)
+{
+  return as_offset (as, as->next) - as->nfree;
+}
+
 void
 as_free (struct addr_space *as, in_addr_t addr)
 {
-  if (ntohl (addr) == ntohl (as->next) - 1) {
-    as->next = htonl (ntohl (as->next) - 1);
+  uint32_t off = as_offset (as, addr);
+
+  /* Not allocated from this address space */
+  if (off >= as_offset (as, as->next) || BIT_GET (as->free_bits, off))
     return;
-  }
 
+  BIT_SET (as->free_bits, off);
   as->nfree++;
-  as->free = realloc (as->free, sizeof (*as->free) * as->nfree);
 
-  as->free[as->nfree - 1] = addr;
+  /* Still queued from an earlier free, keep its place */
+  if (BIT_GET (as->queued_bits, off))
+    return;
+
+  size_t size = as_size (as);
+  as->queue[(as->queue_head + as->queue_len) % size] = off;
+  as->queue_len++;
+  BIT_SET (as->queued_bits, off);
 }
 
 void
 as_deinit (struct addr_space *as)
 {
-  free (as->free);
+  free (as->queue);
+  free (as->free_bits);
+  free (as->queued_bits);
 }
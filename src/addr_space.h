@@ -3,8 +3,13 @@
 
 /* Address allocation */
 
+#include <stdint.h>
 #include <netinet/in.h>
 
+/* Addresses that have never been allocated are handed out first,
+ * after that freed addresses are reused in the order they were
+ * freed, so that an address stays unused for as long as possible
+ * and can be given back to its previous owner. */
 struct addr_space {
   /* Lowest address that may be allocated */
   in_addr_t lo;
@@ -12,13 +17,23 @@ struct addr_space {
   /* Highest address that may be allocated */
   in_addr_t hi;
 
-  /* The next address to be allocated if free list is empty */
+  /* The next address that has never been allocated */
   in_addr_t next;
 
-  /* List of free addresses */
-  in_addr_t *free;
+  /* Queue of freed addresses, as offsets from lo. Addresses
+   * that have been claimed since they were queued are skipped
+   * when they reach the head. */
+  uint32_t *queue;
+  size_t queue_head;
+  size_t queue_len;
 
-  /* Length of free list */
+  /* Bit set of free addresses below next */
+  uint64_t *free_bits;
+
+  /* Bit set of addresses present in queue */
+  uint64_t *queued_bits;
+
+  /* Number of free addresses below next */
   size_t nfree;
 };
 
@@ -28,6 +43,15 @@ void as_init (struct addr_space *as, in_addr_t lo, in_addr_t hi);
 /* Allocate a new address */
 int as_alloc (struct addr_space *as, in_addr_t *addr);
 
+/* Allocate a specific address, returns -1 if it is not free */
+int as_claim (struct addr_space *as, in_addr_t addr);
+
+/* Number of addresses in address space */
+size_t as_size (struct addr_space *as);
+
+/* Number of allocated addresses */
+size_t as_used (struct addr_space *as);
+
 /* Free an allocated address */
 void as_free (struct addr_space *as, in_addr_t addr);
 
@@ -0,0 +1,75 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "affinity.h"
+#include "hash.h"
+
+static size_t
+af_slot (struct affinity *af, const struct ether_addr *ether)
+{
+  return hash_ether (ether) & (af->size - 1);
+}
+
+void
+af_init (struct affinity *af, size_t size)
+{
+  af->size = 0;
+  af->bindings = NULL;
+  af->nlookups = 0;
+  af->nhits = 0;
+
+  if (size == 0)
+    return;
+
+  af->size = 1;
+  while (af->size < size)
+    af->size *= 2;
+
+  af->bindings = calloc (af->size, sizeof (*af->bindings));
+}
+
+void
+af_put (struct affinity *af, const struct ether_addr *ether,
+        in_addr_t addr)
+{
+  static const struct ether_addr null_ether;
+
+  /* Quarantined addresses have no owner to remember */
+  if (af->size == 0 || memcmp (ether, &null_ether, sizeof (*ether)) == 0)
+    return;
+
+  struct binding *binding = &af->bindings[af_slot (af, ether)];
+  binding->ether_addr = *ether;
+  binding->in_addr = addr;
+}
+
+int
+af_claim (struct affinity *af, const struct ether_addr *ether,
+          struct addr_space *as, in_addr_t *addr)
+{
+  if (af->size == 0)
+    return -1;
+
+  af->nlookups++;
+
+  struct binding *binding = &af->bindings[af_slot (af, ether)];
+  if (binding->in_addr == 0
+      || memcmp (&binding->ether_addr, ether, sizeof (*ether)) != 0)
+    return -1;
+
+  in_addr_t in_addr = binding->in_addr;
+  binding->in_addr = 0;
+
+  if (as_claim (as, in_addr) < 0)
+    return -1;
+
+  af->nhits++;
+  *addr = in_addr;
+  return 0;
+}
+
+void
+af_deinit (struct affinity *af)
+{
+  free (af->bindings);
+}
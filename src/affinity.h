@@ -0,0 +1,55 @@
+#ifndef AFFINITY_H_INCLUDED
+#define AFFINITY_H_INCLUDED
+
+/* Cache of expired bindings
+ *
+ * Remembers the address a hardware address held when its lease
+ * expired, so that a returning client can be given the same address
+ * again if it is still free. The cache is a direct-mapped table, a
+ * newer binding simply replaces whatever occupied its slot.
+ */
+
+#include <stddef.h>
+#include <netinet/in.h>
+#include <netinet/ether.h>
+
+#include "addr_space.h"
+
+struct binding {
+  /* Hardware address */
+  struct ether_addr ether_addr;
+
+  /* Address last held by the hardware address */
+  in_addr_t in_addr;
+};
+
+struct affinity {
+  /* Table of bindings, empty slots have a zero address */
+  struct binding *bindings;
+
+  /* Number of slots, a power of two */
+  size_t size;
+
+  /* Number of lookups */
+  size_t nlookups;
+
+  /* Number of lookups that gave back the previous address */
+  size_t nhits;
+};
+
+/* Initialize cache with at least size slots, 0 disables it */
+void af_init (struct affinity *af, size_t size);
+
+/* Remember an expired binding */
+void af_put (struct affinity *af, const struct ether_addr *ether,
+             in_addr_t addr);
+
+/* Claim the previous address of a hardware address from the
+ * address space, returns -1 if it is unknown or no longer free */
+int af_claim (struct affinity *af, const struct ether_addr *ether,
+              struct addr_space *as, in_addr_t *addr);
+
+/* Dispose of cache */
+void af_deinit (struct affinity *af);
+
+#endif
@@ -0,0 +1,58 @@
+#include <stdlib.h>
+
+#include "alloc.h"
+
+#ifdef DHCP_ALLOC_COUNT
+
+void *__libc_malloc (size_t size);
+void *__libc_calloc (size_t n, size_t size);
+void *__libc_realloc (void *ptr, size_t size);
+void __libc_free (void *ptr);
+
+static long ncalls;
+
+void *
+malloc (size_t size)
+{
+  ncalls++;
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t n, size_t size)
+{
+  ncalls++;
+  return __libc_calloc (n, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+  ncalls++;
+  return __libc_realloc (ptr, size);
+}
+
+void
+free (void *ptr)
+{
+  /* free (NULL) is a common way to do nothing */
+  if (ptr)
+    ncalls++;
+  __libc_free (ptr);
+}
+
+long
+alloc_calls (void)
+{
+  return ncalls;
+}
+
+#else
+
+long
+alloc_calls (void)
+{
+  return -1;
+}
+
+#endif
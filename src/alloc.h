@@ -0,0 +1,18 @@
+#ifndef ALLOC_H_INCLUDED
+#define ALLOC_H_INCLUDED
+
+/* Heap call accounting
+ *
+ * Built with DHCP_ALLOC_COUNT defined, malloc, calloc, realloc and
+ * free are wrapped and every call in the process is counted, so that
+ * the simulator and benchmarks can check that handling a message in
+ * the steady state never touches the heap. Otherwise nothing is
+ * wrapped and nothing is counted.
+ */
+
+#include <stddef.h>
+
+/* Heap calls made so far, -1 if they are not counted */
+long alloc_calls (void);
+
+#endif
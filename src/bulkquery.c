@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include "bulkquery.h"
+#include "clock.h"
+#include "log.h"
+
+/* Records encoded per event loop iteration */
+static const size_t chunk_records = 1024;
+
+static void
+put16 (uint8_t *p, uint16_t x)
+{
+  x = htons (x);
+  memcpy (p, &x, 2);
+}
+
+static void
+put32 (uint8_t *p, uint32_t x)
+{
+  x = htonl (x);
+  memcpy (p, &x, 4);
+}
+
+static void
+put64 (uint8_t *p, uint64_t x)
+{
+  put32 (p, x >> 32);
+  put32 (p + 4, x & 0xffffffff);
+}
+
+static void
+bq_close (struct bulkquery *bq, struct bq_session *s)
+{
+  epoll_ctl (bq->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+  close (s->fd);
+
+  for (size_t i = 0; i < s->nsegments; i++)
+    lq_snapshot_end (s->segments[i].lq, &s->segments[i].snap);
+
+  free (s->buf);
+  memset (s, 0, sizeof (*s));
+  s->fd = -1;
+}
+
+/* Start a point-in-time snapshot of a lease queue */
+static int
+bq_snapshot (struct bq_segment *seg, struct lease_queue *lq)
+{
+  seg->lq = lq;
+  seg->base = lq->base;
+  seg->wall_epoch = clock_wall (lq->epoch);
+
+  return lq_snapshot_begin (lq, &seg->snap);
+}
+
+static void
+bq_accept (struct bulkquery *bq, struct lease_queue *const *lqs,
+           size_t nlqs)
+{
+  int fd = accept (bq->listenfd, NULL, NULL);
+  if (fd < 0) {
+    log_errno ("Failed to accept bulk query client");
+    return;
+  }
+
+  fcntl (fd, F_SETFL, O_NONBLOCK);
+
+  int index = -1;
+  for (int i = 0; i < BQ_MAX_SESSIONS; i++)
+    if (bq->sessions[i].fd < 0) {
+      index = i;
+      break;
+    }
+
+  if (index < 0) {
+    log_error ("Too many bulk query clients");
+    close (fd);
+    return;
+  }
+
+  struct bq_session *s = &bq->sessions[index];
+  struct epoll_event ev = {
+    .events = EPOLLOUT,
+    .data.u64 = bq->tag + 1 + index,
+  };
+
+  if (epoll_ctl (bq->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    log_errno ("Failed to watch bulk query client");
+    close (fd);
+    return;
+  }
+
+  s->fd = fd;
+  s->buf = malloc (BQ_HEADER_SIZE + BQ_RECORD_SIZE * chunk_records);
+
+  size_t count = 0;
+  for (size_t i = 0; i < nlqs; i++) {
+    if (s->buf == NULL || bq_snapshot (&s->segments[i], lqs[i]) < 0) {
+      log_error ("Out of memory for bulk query snapshot");
+      bq_close (bq, s);
+      return;
+    }
+    s->nsegments++;
+    count += s->segments[i].snap.count;
+  }
+
+  memcpy (s->buf, "DHLQ", 4);
+  put16 (s->buf + 4, 1);
+  put16 (s->buf + 6, 0);
+  put32 (s->buf + 8, count);
+  put64 (s->buf + 12, time (NULL));
+  s->buf_len = BQ_HEADER_SIZE;
+  s->buf_off = 0;
+}
+
+/* Encode the next chunk of records, returns -1 if there are
+ * no records left */
+static int
+bq_encode (struct bq_session *s)
+{
+  uint8_t *p = s->buf;
+  size_t n = 0;
+
+  while (n < chunk_records && s->segment < s->nsegments) {
+    struct bq_segment *seg = &s->segments[s->segment];
+    struct lq_snapshot *snap = &seg->snap;
+
+    if (s->record == snap->count) {
+      s->segment++;
+      s->record = 0;
+      continue;
+    }
+
+    /* Copy the snapshot as far as this chunk goes */
+    if (s->record == snap->copied)
+      lq_snapshot_step (seg->lq, snap, chunk_records);
+
+    size_t i = s->record++;
+    in_addr_t addr = htonl (ntohl (seg->base) + snap->offsets[i]);
+    memcpy (p, &addr, 4);
+    memcpy (p + 4, &snap->ethers[i], 6);
+    put32 (p + 10, seg->wall_epoch + snap->expires[i]);
+    p += BQ_RECORD_SIZE;
+    n++;
+  }
+
+  s->buf_len = p - s->buf;
+  s->buf_off = 0;
+
+  return n > 0 ? 0 : -1;
+}
+
+/* Write one chunk, returns -1 when the session is done */
+static int
+bq_continue (struct bulkquery *bq, struct bq_session *s)
+{
+  if (s->buf_off == s->buf_len && bq_encode (s) < 0) {
+    bq->nexports++;
+    return -1;
+  }
+
+  /* A client that goes away must not raise SIGPIPE */
+  ssize_t n = send (s->fd, s->buf + s->buf_off, s->buf_len - s->buf_off,
+                    MSG_NOSIGNAL);
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    log_errno ("Bulk query client lost");
+    return -1;
+  }
+
+  s->buf_off += n;
+  return 0;
+}
+
+int
+bq_init (struct bulkquery *bq, const char *path, size_t nlqs, int epfd,
+         uint64_t tag)
+{
+  memset (bq, 0, sizeof (*bq));
+  bq->listenfd = -1;
+  bq->epfd = epfd;
+  bq->tag = tag;
+  for (int i = 0; i < BQ_MAX_SESSIONS; i++)
+    bq->sessions[i].fd = -1;
+
+  if (path == NULL)
+    return 0;
+
+  if (nlqs > BQ_MAX_SEGMENTS) {
+    log_error ("Bulk query supports at most %d interfaces",
+               BQ_MAX_SEGMENTS);
+    return -1;
+  }
+
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+
+  if (strlen (path) >= sizeof (addr.sun_path)) {
+    log_error ("Bulk query socket path too long: %s", path);
+    return -1;
+  }
+  strcpy (addr.sun_path, path);
+
+  if ((bq->listenfd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK
+                              | SOCK_CLOEXEC, 0)) < 0) {
+    log_errno ("Failed to open bulk query socket");
+    return -1;
+  }
+
+  unlink (path);
+  if (bind (bq->listenfd, (struct sockaddr *) &addr, sizeof (addr)) < 0
+      || listen (bq->listenfd, BQ_MAX_SESSIONS) < 0) {
+    log_errno ("Failed to listen on %s", path);
+    close (bq->listenfd);
+    bq->listenfd = -1;
+    return -1;
+  }
+
+  struct epoll_event ev = { .events = EPOLLIN, .data.u64 = tag };
+  if (epoll_ctl (epfd, EPOLL_CTL_ADD, bq->listenfd, &ev) < 0) {
+    log_errno ("Failed to watch bulk query socket");
+    return -1;
+  }
+
+  return 0;
+}
+
+void
+bq_event (struct bulkquery *bq, uint32_t index, uint32_t events,
+          struct lease_queue *const *lqs, size_t nlqs)
+{
+  if (index == 0) {
+    bq_accept (bq, lqs, nlqs);
+    return;
+  }
+
+  struct bq_session *s = &bq->sessions[index - 1];
+  if (s->fd < 0)
+    return;
+
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    bq_close (bq, s);
+    return;
+  }
+
+  if (bq_continue (bq, s) < 0)
+    bq_close (bq, s);
+}
+
+void
+bq_deinit (struct bulkquery *bq)
+{
+  for (int i = 0; i < BQ_MAX_SESSIONS; i++)
+    if (bq->sessions[i].fd >= 0)
+      bq_close (bq, &bq->sessions[i]);
+
+  if (bq->listenfd >= 0)
+    close (bq->listenfd);
+}
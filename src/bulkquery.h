@@ -0,0 +1,98 @@
+#ifndef BULKQUERY_H_INCLUDED
+#define BULKQUERY_H_INCLUDED
+
+/* Bulk lease query
+ *
+ * Clients connecting to a Unix socket receive every lease in the
+ * lease queues at the time of connecting. Each lease queue is
+ * snapshotted copy-on-write: the snapshot is copied a chunk at a time
+ * as records are streamed, a bounded number per event loop iteration,
+ * and the queue saves leases the snapshot has yet to reach before
+ * changing them. Packet processing continues during the export, and
+ * never waits for a whole table to be copied.
+ *
+ * The stream starts with a header
+ *
+ *   magic    4 bytes  "DHLQ"
+ *   version  2 bytes  1
+ *   reserved 2 bytes
+ *   count    4 bytes  number of records
+ *   time     8 bytes  wall clock time of the snapshot
+ *
+ * followed by count records
+ *
+ *   address  4 bytes
+ *   hwaddr   6 bytes
+ *   expire   4 bytes  wall clock expiration time
+ *
+ * All integers are in network byte order.
+ */
+
+#include <stdint.h>
+
+#include "lease_queue.h"
+
+#define BQ_MAX_SESSIONS 4
+#define BQ_MAX_SEGMENTS 16
+#define BQ_HEADER_SIZE 20
+#define BQ_RECORD_SIZE 14
+
+/* Snapshot of one lease queue */
+struct bq_segment {
+  struct lease_queue *lq;
+  struct lq_snapshot snap;
+  in_addr_t base;
+
+  /* Wall clock time of the lease queue epoch */
+  time_t wall_epoch;
+};
+
+struct bq_session {
+  /* Client socket, -1 if unused */
+  int fd;
+
+  /* Snapshot of the lease queues */
+  struct bq_segment segments[BQ_MAX_SEGMENTS];
+  size_t nsegments;
+
+  /* Position of the next record to encode */
+  size_t segment;
+  size_t record;
+
+  /* Encoded data not yet written */
+  uint8_t *buf;
+  size_t buf_len;
+  size_t buf_off;
+};
+
+struct bulkquery {
+  /* Listening socket, -1 if disabled */
+  int listenfd;
+
+  /* Event loop the sockets are registered with, and tag that
+   * identifies them. Events carry the tag plus 0 for the
+   * listening socket, or plus 1 + i for session i. */
+  int epfd;
+  uint64_t tag;
+
+  /* Connected clients */
+  struct bq_session sessions[BQ_MAX_SESSIONS];
+
+  /* Number of completed exports */
+  size_t nexports;
+};
+
+/* Listen on a Unix socket for exports of nlqs lease queues, a NULL
+ * path disables bulk queries */
+int bq_init (struct bulkquery *bq, const char *path, size_t nlqs,
+             int epfd, uint64_t tag);
+
+/* Handle an event on socket index, exporting from the given
+ * lease queues when a client connects */
+void bq_event (struct bulkquery *bq, uint32_t index, uint32_t events,
+               struct lease_queue *const *lqs, size_t nlqs);
+
+/* Dispose of bulk query state */
+void bq_deinit (struct bulkquery *bq);
+
+#endif
@@ -0,0 +1,180 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "classify.h"
+#include "hash.h"
+
+static size_t
+table_size (size_t n)
+{
+  /* Keep the load factor at or below one half */
+  size_t size = 1;
+  while (size < 2 * n)
+    size *= 2;
+  return size;
+}
+
+static uint32_t
+exact_hash (enum class_key key, const uint8_t *data, size_t len)
+{
+  return hash_bytes (data, len) ^ (key * 0x9e3779b9u);
+}
+
+static uint32_t
+edge_hash (uint64_t key)
+{
+  return (uint32_t) ((key * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+static ssize_t
+edge_find (const struct classifier *cl, uint64_t key)
+{
+  size_t mask = cl->edges_size - 1;
+
+  for (size_t i = edge_hash (key) & mask;; i = (i + 1) & mask) {
+    if (cl->edges[i].key == key)
+      return i;
+    if (cl->edges[i].key == 0)
+      return -(ssize_t) i - 1;
+  }
+}
+
+static void
+add_exact (struct classifier *cl, const struct class_rule *rule,
+           uint32_t class)
+{
+  size_t mask = cl->exact_size - 1;
+  size_t i = exact_hash (rule->key, rule->data, rule->len) & mask;
+
+  for (;; i = (i + 1) & mask) {
+    struct cl_exact *e = &cl->exact[i];
+
+    if (e->data == NULL) {
+      e->data = rule->data;
+      e->class = class;
+      e->key = rule->key;
+      e->len = rule->len;
+      return;
+    }
+
+    if (e->key == rule->key && e->len == rule->len
+        && memcmp (e->data, rule->data, rule->len) == 0) {
+      if (class < e->class)
+        e->class = class;
+      return;
+    }
+  }
+}
+
+static void
+add_prefix (struct classifier *cl, const struct class_rule *rule,
+            uint32_t class)
+{
+  uint32_t node = rule->key;
+
+  for (size_t i = 0; i < rule->len; i++) {
+    uint64_t key = (((uint64_t) node << 8) | rule->data[i]) + 1;
+    ssize_t slot = edge_find (cl, key);
+
+    if (slot < 0) {
+      slot = -slot - 1;
+      cl->edges[slot].key = key;
+      cl->edges[slot].child = cl->nnodes;
+      cl->node_class[cl->nnodes++] = CL_NO_CLASS;
+    }
+
+    node = cl->edges[slot].child;
+  }
+
+  if (class < cl->node_class[node])
+    cl->node_class[node] = class;
+}
+
+int
+cl_init (struct classifier *cl, const struct conf *conf,
+         const uint32_t *map)
+{
+  memset (cl, 0, sizeof (*cl));
+
+  /* Size the tables for the rules that are kept */
+  size_t nexact = 0;
+  size_t nbytes = 0;
+  for (size_t i = 0; i < conf->nclass_rules; i++) {
+    const struct class_rule *rule = &conf->class_rules[i];
+    if (map[rule->class] == CL_NO_CLASS)
+      continue;
+    if (rule->prefix)
+      nbytes += rule->len;
+    else
+      nexact++;
+  }
+
+  cl->exact_size = table_size (nexact);
+  cl->edges_size = table_size (nbytes);
+  cl->exact = calloc (cl->exact_size, sizeof (*cl->exact));
+  cl->edges = calloc (cl->edges_size, sizeof (*cl->edges));
+  cl->node_class = malloc (sizeof (*cl->node_class)
+                           * (CLASS_NKEYS + nbytes));
+  if (cl->exact == NULL || cl->edges == NULL || cl->node_class == NULL) {
+    cl_deinit (cl);
+    return -1;
+  }
+
+  for (cl->nnodes = 0; cl->nnodes < CLASS_NKEYS; cl->nnodes++)
+    cl->node_class[cl->nnodes] = CL_NO_CLASS;
+
+  for (size_t i = 0; i < conf->nclass_rules; i++) {
+    const struct class_rule *rule = &conf->class_rules[i];
+    uint32_t class = map[rule->class];
+
+    if (class == CL_NO_CLASS)
+      continue;
+    if (rule->prefix)
+      add_prefix (cl, rule, class);
+    else
+      add_exact (cl, rule, class);
+  }
+
+  return 0;
+}
+
+uint32_t
+cl_match (const struct classifier *cl, enum class_key key,
+          const uint8_t *data, size_t len)
+{
+  uint32_t class = CL_NO_CLASS;
+
+  /* Exact value */
+  size_t mask = cl->exact_size - 1;
+  for (size_t i = exact_hash (key, data, len) & mask;
+       cl->exact[i].data != NULL; i = (i + 1) & mask) {
+    const struct cl_exact *e = &cl->exact[i];
+    if (e->key == key && e->len == len && memcmp (e->data, data, len) == 0) {
+      class = e->class;
+      break;
+    }
+  }
+
+  /* Every prefix on the way down the trie */
+  uint32_t node = key;
+  for (size_t i = 0; i < len; i++) {
+    ssize_t slot = edge_find (cl, (((uint64_t) node << 8) | data[i]) + 1);
+    if (slot < 0)
+      break;
+
+    node = cl->edges[slot].child;
+    if (cl->node_class[node] < class)
+      class = cl->node_class[node];
+  }
+
+  return class;
+}
+
+void
+cl_deinit (struct classifier *cl)
+{
+  free (cl->exact);
+  free (cl->edges);
+  free (cl->node_class);
+}
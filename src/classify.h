@@ -0,0 +1,63 @@
+#ifndef CLASSIFY_H_INCLUDED
+#define CLASSIFY_H_INCLUDED
+
+/* Client classification
+ *
+ * The class rules of an interface are compiled once into a hash
+ * table of exact values and a byte trie of prefixes, one trie root
+ * per kind of value. Matching a value costs one hash lookup and a
+ * walk down the trie as deep as the value is long, however many
+ * rules there are.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "conf.h"
+
+#define CL_NO_CLASS UINT32_MAX
+
+/* Exact value, data points into the rule it was compiled from */
+struct cl_exact {
+  const uint8_t *data;
+  uint32_t class;
+  uint8_t key;
+  uint8_t len;
+};
+
+/* Trie edge, key is ((parent << 8) | byte) + 1, 0 if empty */
+struct cl_edge {
+  uint64_t key;
+  uint32_t child;
+};
+
+struct classifier {
+  /* Open addressing table of exact values, empty slots have
+   * a NULL data pointer */
+  struct cl_exact *exact;
+  size_t exact_size;
+
+  /* Open addressing table of trie edges */
+  struct cl_edge *edges;
+  size_t edges_size;
+
+  /* Class of the prefix ending at each trie node, CL_NO_CLASS
+   * if none. Nodes below CLASS_NKEYS are the roots. */
+  uint32_t *node_class;
+  size_t nnodes;
+};
+
+/* Compile the rules of conf into a classifier. map gives the class
+ * of each class of conf, CL_NO_CLASS to leave its rules out. Where
+ * several rules match, the lowest class wins. */
+int cl_init (struct classifier *cl, const struct conf *conf,
+             const uint32_t *map);
+
+/* Class of a value, CL_NO_CLASS if no rule matches it */
+uint32_t cl_match (const struct classifier *cl, enum class_key key,
+                   const uint8_t *data, size_t len);
+
+/* Dispose of classifier */
+void cl_deinit (struct classifier *cl);
+
+#endif
@@ -0,0 +1,35 @@
+#include "clock.h"
+
+static int64_t now_ms;
+
+void
+clock_update (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  now_ms = (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void
+clock_set (int64_t ms)
+{
+  now_ms = ms;
+}
+
+int64_t
+clock_ms (void)
+{
+  return now_ms;
+}
+
+time_t
+clock_now (void)
+{
+  return now_ms / 1000;
+}
+
+time_t
+clock_wall (time_t t)
+{
+  return time (NULL) + (t - clock_now ());
+}
@@ -0,0 +1,31 @@
+#ifndef CLOCK_H_INCLUDED
+#define CLOCK_H_INCLUDED
+
+/* Monotonic time
+ *
+ * The clock is read once per event loop iteration and the cached
+ * reading is used for everything done during that iteration. All
+ * deadlines are in monotonic time, so they are not affected when the
+ * wall clock is changed.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+/* Read the clock */
+void clock_update (void);
+
+/* Set the cached time (ms) instead of reading the clock, for
+ * running on virtual time */
+void clock_set (int64_t ms);
+
+/* Cached time in milliseconds */
+int64_t clock_ms (void);
+
+/* Cached time in seconds */
+time_t clock_now (void);
+
+/* Convert a time in seconds to wall clock time */
+time_t clock_wall (time_t t);
+
+#endif
@@ -1,12 +1,66 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <limits.h>
 
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 
 #include "conf.h"
+#include "hash.h"
 #include "log.h"
 
+#define IMAGE_MAGIC "DHCB"
+#define IMAGE_VERSION 12
+#define IMAGE_ALIGN 8
+
+/* Header of a binary configuration image */
+struct image_header {
+  char magic[4];
+  uint32_t version;
+
+  /* Layout of this build, images from other builds are rejected */
+  uint32_t conf_size;
+  uint32_t static_conf_size;
+  uint32_t class_conf_size;
+  uint32_t class_rule_size;
+
+  /* Identity of the source configuration: modification time (ns),
+   * size, inode and device. An edit changes at least one of them,
+   * even within the second of the previous one. */
+  int64_t source_mtime_ns;
+  uint64_t source_size;
+  uint64_t source_ino;
+  uint64_t source_dev;
+
+  /* Offsets of the sections that follow the header */
+  uint64_t conf_off;
+  uint64_t static_confs_off;
+  uint64_t static_index_off;
+  uint64_t classes_off;
+  uint64_t class_rules_off;
+  uint64_t strings_off;
+  uint64_t size;
+};
+
+/* String members of struct conf, stored as offsets in images */
+static const size_t string_fields[] = {
+  offsetof (struct conf, leasequery_socket),
+  offsetof (struct conf, ddns_zone),
+  offsetof (struct conf, trace_file),
+  offsetof (struct conf, history_dir),
+  offsetof (struct conf, mac_allow),
+  offsetof (struct conf, mac_deny),
+  offsetof (struct conf, reservation_socket),
+  offsetof (struct conf, reservation_journal),
+};
+
+#define NSTRING_FIELDS (sizeof (string_fields) / sizeof (string_fields[0]))
+
 static int
 check_subnet_mask (in_addr_t addr)
 {
@@ -20,13 +74,13 @@ check_subnet_mask (in_addr_t addr)
   return addr ? -1 : 0;
 }
 
-static int
-parse_time (const char *str)
+static long
+parse_time_ms (const char *str)
 {
-  int tot = 0;
+  long tot = 0;
 
   while (*str) {
-    int x = 0;
+    long x = 0;
 
     while (isdigit (*str)) {
       x *= 10;
@@ -38,12 +92,17 @@ parse_time (const char *str)
     case '\0':
       return -1;
     case 'h':
-      x *= 3600;
+      x *= 3600 * 1000;
       break;
     case 'm':
-      x *= 60;
+      if (str[1] == 's') {
+        str++;
+        break;
+      }
+      x *= 60 * 1000;
       break;
     case 's':
+      x *= 1000;
       break;
     default:
       return -1;
@@ -56,6 +115,41 @@ parse_time (const char *str)
   return tot;
 }
 
+int
+conf_parse_time (const char *str)
+{
+  long ms = parse_time_ms (str);
+
+  if (ms < 0 || ms % 1000)
+    return -1;
+
+  return ms / 1000;
+}
+
+static int
+parse_count (const char *str)
+{
+  char *end;
+  long x = strtol (str, &end, 10);
+
+  if (*str == '\0' || *end != '\0' || x < 0 || x > INT_MAX)
+    return -1;
+
+  return x;
+}
+
+static int
+parse_bool (const char *str)
+{
+  if (strcmp (str, "yes") == 0 || strcmp (str, "on") == 0)
+    return 1;
+
+  if (strcmp (str, "no") == 0 || strcmp (str, "off") == 0)
+    return 0;
+
+  return -1;
+}
+
 static void
 strip_comment (char *line)
 {
@@ -66,6 +160,328 @@ strip_comment (char *line)
     }
 }
 
+/* Fill in unset interface settings from the top level
+ * configuration */
+static void
+resolve_ifaces (struct conf *conf)
+{
+  if (conf->nifaces == 0) {
+    memset (&conf->ifaces[0], 0, sizeof (conf->ifaces[0]));
+    strcpy (conf->ifaces[0].name, "eth0");
+    conf->ifaces[0].rapid_commit = -1;
+    conf->nifaces = 1;
+  }
+
+  for (size_t i = 0; i < conf->nifaces; i++) {
+    struct iface_conf *iface = &conf->ifaces[i];
+
+    if (iface->subnet_mask == 0)
+      iface->subnet_mask = conf->subnet_mask;
+    if (iface->lease_time == 0)
+      iface->lease_time = conf->lease_time;
+    if (iface->range_lo == 0) {
+      iface->range_lo = conf->range_lo;
+      iface->range_hi = conf->range_hi;
+    }
+    if (iface->rapid_commit < 0)
+      iface->rapid_commit = conf->rapid_commit;
+  }
+}
+
+/* Find a class by name, returns -1 if there is none */
+static ssize_t
+find_class (const struct conf *conf, const char *name)
+{
+  for (size_t i = 0; i < conf->nclasses; i++)
+    if (strcmp (conf->classes[i].name, name) == 0)
+      return i;
+
+  return -1;
+}
+
+/* Parse the rest of "class <name> range <lo> <hi> [lease-time <time>]
+ * [next-server <addr>] [boot-file <path>]" */
+static int
+parse_class (struct conf *conf, const char *path, int lineno)
+{
+  const char *const delims = " \t\n";
+  struct in_addr addr_buf;
+
+  char *name = strtok (NULL, delims);
+  if (name == NULL) {
+    log_error ("%s:%d: Missing class name", path, lineno);
+    return -1;
+  }
+
+  if (strlen (name) >= sizeof (conf->classes->name)) {
+    log_error ("%s:%d: Class name too long: %s", path, lineno, name);
+    return -1;
+  }
+
+  if (find_class (conf, name) >= 0) {
+    log_error ("%s:%d: Duplicate class %s", path, lineno, name);
+    return -1;
+  }
+
+  struct class_conf *classes = realloc (conf->classes,
+                                        sizeof (*classes) * (conf->nclasses + 1));
+  if (classes == NULL) {
+    log_error ("Out of memory");
+    return -1;
+  }
+  conf->classes = classes;
+
+  /* Classes belong to the interface they are defined under */
+  struct class_conf *cc = &conf->classes[conf->nclasses];
+  memset (cc, 0, sizeof (*cc));
+  strcpy (cc->name, name);
+  cc->iface = conf->nifaces > 0 ? conf->nifaces - 1 : 0;
+
+  char *key;
+  while ((key = strtok (NULL, delims)) != NULL) {
+    char *str = strtok (NULL, delims);
+    if (str == NULL) {
+      log_error ("%s:%d: Missing value for %s", path, lineno, key);
+      return -1;
+    }
+
+    if (strcmp (key, "range") == 0) {
+      if (inet_pton (AF_INET, str, &addr_buf) != 1) {
+        log_error ("%s:%d: Invalid IPv4 address: %s", path, lineno, str);
+        return -1;
+      }
+      cc->range_lo = addr_buf.s_addr;
+
+      str = strtok (NULL, delims);
+      if (str == NULL || inet_pton (AF_INET, str, &addr_buf) != 1
+          || ntohl (addr_buf.s_addr) < ntohl (cc->range_lo)) {
+        log_error ("%s:%d: Invalid range of class %s", path, lineno, name);
+        return -1;
+      }
+      cc->range_hi = addr_buf.s_addr;
+    } else if (strcmp (key, "lease-time") == 0) {
+      int time = conf_parse_time (str);
+      if (time <= 0) {
+        log_error ("%s:%d: Invalid lease time: %s", path, lineno, str);
+        return -1;
+      }
+      cc->lease_time = time;
+    } else if (strcmp (key, "next-server") == 0) {
+      if (inet_pton (AF_INET, str, &addr_buf) != 1) {
+        log_error ("%s:%d: Invalid IPv4 address: %s", path, lineno, str);
+        return -1;
+      }
+      cc->next_server = addr_buf.s_addr;
+    } else if (strcmp (key, "boot-file") == 0) {
+      if (strlen (str) >= sizeof (cc->boot_file)) {
+        log_error ("%s:%d: Boot file name too long: %s", path, lineno, str);
+        return -1;
+      }
+      strcpy (cc->boot_file, str);
+    } else {
+      log_error ("%s:%d: Unknown class setting '%s'", path, lineno, key);
+      return -1;
+    }
+  }
+
+  if (cc->range_lo == 0) {
+    log_error ("%s:%d: Missing range of class %s", path, lineno, name);
+    return -1;
+  }
+
+  conf->nclasses++;
+  return 0;
+}
+
+/* Parse a hardware address or a prefix of one, returns the number
+ * of octets or -1 */
+static int
+parse_mac_prefix (const char *str, uint8_t *octets)
+{
+  int n = 0;
+
+  while (n < ETHER_ADDR_LEN) {
+    char *end;
+    long x = strtol (str, &end, 16);
+
+    if (end == str || end - str > 2 || x < 0 || x > 0xff)
+      return -1;
+    octets[n++] = x;
+
+    if (*end == '\0')
+      return n;
+    if (*end != ':')
+      return -1;
+    str = end + 1;
+  }
+
+  return -1;
+}
+
+/* Parse the rest of "match <class> vendor-class <value>[*]",
+ * "match <class> user-class <value>[*]" or
+ * "match <class> mac <address or prefix>[*]". Class identifiers
+ * take the rest of the line, a trailing * matches any value that
+ * starts with what comes before it. */
+static int
+parse_match (struct conf *conf, const char *path, int lineno)
+{
+  const char *const delims = " \t\n";
+  struct class_rule rule;
+  memset (&rule, 0, sizeof (rule));
+
+  char *name = strtok (NULL, delims);
+  char *key = strtok (NULL, delims);
+  if (name == NULL || key == NULL) {
+    log_error ("%s:%d: Missing class or value to match", path, lineno);
+    return -1;
+  }
+
+  ssize_t class = find_class (conf, name);
+  if (class < 0) {
+    log_error ("%s:%d: Unknown class %s", path, lineno, name);
+    return -1;
+  }
+  rule.class = class;
+
+  if (strcmp (key, "vendor-class") == 0)
+    rule.key = CLASS_KEY_VENDOR_CLASS;
+  else if (strcmp (key, "user-class") == 0)
+    rule.key = CLASS_KEY_USER_CLASS;
+  else if (strcmp (key, "mac") == 0)
+    rule.key = CLASS_KEY_MAC;
+  else {
+    log_error ("%s:%d: Unknown value to match: %s", path, lineno, key);
+    return -1;
+  }
+
+  char *str = strtok (NULL, rule.key == CLASS_KEY_MAC ? delims : "\n");
+  if (str != NULL) {
+    str += strspn (str, " \t");
+    size_t len = strlen (str);
+    while (len > 0 && isspace ((unsigned char) str[len - 1]))
+      str[--len] = '\0';
+  }
+
+  if (str == NULL || *str == '\0') {
+    log_error ("%s:%d: Missing value to match", path, lineno);
+    return -1;
+  }
+
+  size_t len = strlen (str);
+  if (str[len - 1] == '*') {
+    rule.prefix = 1;
+    str[--len] = '\0';
+  }
+
+  if (rule.key == CLASS_KEY_MAC) {
+    int n = parse_mac_prefix (str, rule.data);
+    if (n < 0) {
+      log_error ("%s:%d: Invalid hardware address: %s", path, lineno, str);
+      return -1;
+    }
+    rule.len = n;
+    if (n < ETHER_ADDR_LEN)
+      rule.prefix = 1;
+  } else {
+    if (len == 0 || len > sizeof (rule.data)) {
+      log_error ("%s:%d: Invalid value to match: %s", path, lineno, str);
+      return -1;
+    }
+    memcpy (rule.data, str, len);
+    rule.len = len;
+  }
+
+  struct class_rule *rules = realloc (conf->class_rules,
+                                      sizeof (*rules) * (conf->nclass_rules + 1));
+  if (rules == NULL) {
+    log_error ("Out of memory");
+    return -1;
+  }
+  conf->class_rules = rules;
+  conf->class_rules[conf->nclass_rules++] = rule;
+
+  return 0;
+}
+
+/* Check that class ranges do not overlap each other or the range
+ * of their interface */
+static int
+check_classes (const struct conf *conf)
+{
+  for (size_t i = 0; i < conf->nclasses; i++) {
+    const struct class_conf *cc = &conf->classes[i];
+    const struct iface_conf *ic = &conf->ifaces[cc->iface];
+
+    if (ntohl (cc->range_lo) <= ntohl (ic->range_hi)
+        && ntohl (ic->range_lo) <= ntohl (cc->range_hi)) {
+      log_error ("Range of class %s overlaps that of %s", cc->name, ic->name);
+      return -1;
+    }
+
+    for (size_t j = 0; j < i; j++) {
+      const struct class_conf *other = &conf->classes[j];
+      if (other->iface == cc->iface
+          && ntohl (cc->range_lo) <= ntohl (other->range_hi)
+          && ntohl (other->range_lo) <= ntohl (cc->range_hi)) {
+        log_error ("Range of class %s overlaps that of class %s",
+                   cc->name, other->name);
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* Build hash index of static configurations. The first
+ * configuration of a hardware address takes precedence. */
+static void
+index_static_confs (struct conf *conf)
+{
+  size_t size = 16;
+  while (size < 2 * conf->nstatic_confs)
+    size *= 2;
+
+  free (conf->static_index);
+  conf->static_index = calloc (size, sizeof (*conf->static_index));
+  conf->static_index_size = size;
+
+  for (size_t i = 0; i < conf->nstatic_confs; i++) {
+    const struct ether_addr *ether = &conf->static_confs[i].ether_addr;
+    size_t slot = hash_ether (ether) & (size - 1);
+
+    while (conf->static_index[slot] != 0) {
+      uint32_t j = conf->static_index[slot] - 1;
+      if (memcmp (&conf->static_confs[j].ether_addr, ether, sizeof (*ether)) == 0)
+        break;
+      slot = (slot + 1) & (size - 1);
+    }
+
+    if (conf->static_index[slot] == 0)
+      conf->static_index[slot] = i + 1;
+  }
+}
+
+void
+conf_defaults (struct conf *conf)
+{
+  memset (conf, 0, sizeof (*conf));
+  conf->subnet_mask = htonl (0xffffff00); /* 255.255.255.0 */
+  conf->lease_time = 24 * 3600;           /* 24h */
+  conf->range_lo = htonl (0xc0a8001);     /* 192.168.0.1 */
+  conf->range_hi = htonl (0xc0a80fe);     /* 192.168.0.254 */
+  conf->request_window = 1;               /* 1s */
+  conf->probe_timeout = 500;              /* 500ms */
+  conf->affinity_cache = 4096;
+  conf->retransmit_cache = 256;
+  conf->adaptive_low = 70;
+  conf->adaptive_high = 90;
+  conf->ddns_port = 53;
+  conf->ddns_ttl = 300;                   /* 5m */
+  conf->cpu = -1;
+}
+
 int
 conf_parse (const char *path, struct conf *conf)
 {
@@ -80,6 +496,8 @@ conf_parse (const char *path, struct conf *conf)
 
   char *line = NULL;
   size_t size;
+  size_t static_capac = conf->nstatic_confs;
+  struct iface_conf *iface = NULL;
   int lineno = 0;
   struct in_addr addr_buf;
   struct ether_addr *ether_ptr;
@@ -101,7 +519,22 @@ conf_parse (const char *path, struct conf *conf)
         ret = -1;
         goto done;
       }
-      conf->interface = strdup (name);
+      if (conf->nifaces == CONF_MAX_IFACES) {
+        log_error ("%s:%d: Too many interfaces", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      if (strlen (name) >= IFNAMSIZ) {
+        log_error ("%s:%d: Interface name too long: %s", path, lineno, name);
+        ret = -1;
+        goto done;
+      }
+
+      iface = &conf->ifaces[conf->nifaces++];
+      memset (iface, 0, sizeof (*iface));
+      strcpy (iface->name, name);
+      iface->rapid_commit = -1;
       continue;
     }
 
@@ -120,7 +553,10 @@ conf_parse (const char *path, struct conf *conf)
         goto done;
       }
 
-      conf->subnet_mask = addr_buf.s_addr;
+      if (iface)
+        iface->subnet_mask = addr_buf.s_addr;
+      else
+        conf->subnet_mask = addr_buf.s_addr;
       continue;
     }
 
@@ -132,14 +568,39 @@ conf_parse (const char *path, struct conf *conf)
         goto done;
       }
 
-      int time = parse_time (str);
+      int time = conf_parse_time (str);
       if (time < 0) {
         log_error ("%s:%d: Invalid lease time: %s", path, lineno, str);
         ret = -1;
         goto done;
       }
 
-      conf->lease_time = time;
+      if (iface)
+        iface->lease_time = time;
+      else
+        conf->lease_time = time;
+      continue;
+    }
+
+    if (strcmp (option, "rapid-commit") == 0) {
+      char *str = strtok (NULL, delims);
+      if (str == NULL) {
+        log_error ("%s:%d: Missing value for rapid-commit", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      int value = parse_bool (str);
+      if (value < 0) {
+        log_error ("%s:%d: Invalid value for rapid-commit: %s", path, lineno, str);
+        ret = -1;
+        goto done;
+      }
+
+      if (iface)
+        iface->rapid_commit = value;
+      else
+        conf->rapid_commit = value;
       continue;
     }
 
@@ -151,7 +612,7 @@ conf_parse (const char *path, struct conf *conf)
         goto done;
       }
 
-      int time = parse_time (str);
+      int time = conf_parse_time (str);
       if (time < 0) {
         log_error ("%s:%d: Invalid request window: %s", path, lineno, str);
         ret = -1;
@@ -176,7 +637,7 @@ conf_parse (const char *path, struct conf *conf)
         goto done;
       }
 
-      conf->range_lo = addr_buf.s_addr;
+      in_addr_t range_lo = addr_buf.s_addr;
 
       str = strtok (NULL, delims);
       if (str == NULL) {
@@ -191,72 +652,808 @@ conf_parse (const char *path, struct conf *conf)
         goto done;
       }
 
-      conf->range_hi = addr_buf.s_addr;
+      if (ntohl (range_lo) > ntohl (addr_buf.s_addr)) {
+        log_error ("%s:%d: Range is empty", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      if (iface) {
+        iface->range_lo = range_lo;
+        iface->range_hi = addr_buf.s_addr;
+      } else {
+        conf->range_lo = range_lo;
+        conf->range_hi = addr_buf.s_addr;
+      }
       continue;
     }
 
-    if (strcmp (option, "static") == 0) {
-      conf->nstatic_confs++;
-      conf->static_confs = realloc (conf->static_confs,
-                                    sizeof (struct static_conf) * conf->nstatic_confs);
-      struct static_conf *static_conf = &conf->static_confs[conf->nstatic_confs - 1];
+    if (strcmp (option, "huge-pages") == 0) {
+      char *str = strtok (NULL, delims);
+      if (str == NULL) {
+        log_error ("%s:%d: Missing value for huge-pages", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      int value = parse_bool (str);
+      if (value < 0) {
+        log_error ("%s:%d: Invalid value for huge-pages: %s", path, lineno, str);
+        ret = -1;
+        goto done;
+      }
+
+      conf->huge_pages = value;
+      continue;
+    }
 
+    if (strcmp (option, "probe-depth") == 0) {
       char *str = strtok (NULL, delims);
       if (str == NULL) {
-        log_error ("%s:%d: Missing hardware address", path, lineno);
+        log_error ("%s:%d: Missing probe depth", path, lineno);
         ret = -1;
         goto done;
       }
 
-      ether_ptr = ether_aton (str);
+      int depth = parse_count (str);
+      if (depth < 0) {
+        log_error ("%s:%d: Invalid probe depth: %s", path, lineno, str);
+        ret = -1;
+        goto done;
+      }
 
-      if (ether_ptr == NULL) {
-        log_error ("%s:%d: Invalid hardware address: %s", path, lineno, str);
+      conf->probe_depth = depth;
+      continue;
+    }
+
+    if (strcmp (option, "probe-timeout") == 0) {
+      char *str = strtok (NULL, delims);
+      if (str == NULL) {
+        log_error ("%s:%d: Missing probe timeout", path, lineno);
         ret = -1;
         goto done;
       }
 
-      memcpy (&static_conf->ether_addr, ether_ptr, sizeof (struct ether_addr));
+      long time = parse_time_ms (str);
+      if (time <= 0) {
+        log_error ("%s:%d: Invalid probe timeout: %s", path, lineno, str);
+        ret = -1;
+        goto done;
+      }
 
-      str = strtok (NULL, delims);
+      conf->probe_timeout = time;
+      continue;
+    }
+
+    if (strcmp (option, "retransmit-cache") == 0) {
+      char *str = strtok (NULL, delims);
       if (str == NULL) {
-        log_error ("%s:%d: Missing IPv4 address", path, lineno);
+        log_error ("%s:%d: Missing retransmit cache size", path, lineno);
         ret = -1;
         goto done;
       }
 
-      if (inet_pton (AF_INET, str, &addr_buf) != 1) {
-        log_error ("%s:%d: Invalid IPv4 address: %s", path, lineno, str);
+      int size = parse_count (str);
+      if (size < 0) {
+        log_error ("%s:%d: Invalid retransmit cache size: %s", path, lineno, str);
         ret = -1;
         goto done;
       }
 
-      static_conf->in_addr = addr_buf.s_addr;
+      conf->retransmit_cache = size;
+      continue;
+    }
 
-      str = strtok (NULL, delims);
+    if (strcmp (option, "affinity-cache") == 0) {
+      char *str = strtok (NULL, delims);
       if (str == NULL) {
-        /* Default lease time is 24h */
-        static_conf->lease_time = 24 * 3600;
-        continue;
+        log_error ("%s:%d: Missing affinity cache size", path, lineno);
+        ret = -1;
+        goto done;
       }
 
-      int time = parse_time (str);
-      if (time < 0) {
-        log_error ("%s:%d: Invalid lease time: %s", path, lineno, str);
+      int size = parse_count (str);
+      if (size < 0) {
+        log_error ("%s:%d: Invalid affinity cache size: %s", path, lineno, str);
         ret = -1;
         goto done;
       }
 
-      static_conf->lease_time = time;
+      conf->affinity_cache = size;
       continue;
     }
 
-    log_error ("%s:%d: Unknown configuration option '%s'", path, lineno, option);
-    ret = -1;
-    goto done;
-  }
+    if (strcmp (option, "adaptive-lease") == 0) {
+      char *str = strtok (NULL, delims);
+      int floor = str ? conf_parse_time (str) : -1;
+      str = strtok (NULL, delims);
+      int ceiling = str ? conf_parse_time (str) : 0;
 
-done:
-  fclose (f);
-  return ret;
+      if (floor <= 0 || ceiling < 0 || (ceiling > 0 && ceiling < floor)) {
+        log_error ("%s:%d: Expected lease time floor and optional ceiling", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      conf->adaptive_floor = floor;
+      conf->adaptive_ceiling = ceiling;
+      continue;
+    }
+
+    if (strcmp (option, "adaptive-watermarks") == 0) {
+      char *str = strtok (NULL, delims);
+      int low = str ? parse_count (str) : -1;
+      str = strtok (NULL, delims);
+      int high = str ? parse_count (str) : -1;
+
+      if (low < 0 || high < 0 || low >= high || high > 100) {
+        log_error ("%s:%d: Expected low and high utilization in percent", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      conf->adaptive_low = low;
+      conf->adaptive_high = high;
+      continue;
+    }
+
+    if (strcmp (option, "load-balance") == 0) {
+      char *str = strtok (NULL, delims);
+      int index = str ? parse_count (str) : -1;
+      str = strtok (NULL, delims);
+      int count = str ? parse_count (str) : -1;
+
+      if (index < 0 || count <= 0 || index >= count || count > LB_NBUCKETS) {
+        log_error ("%s:%d: Expected server index and number of servers", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      conf->lb_index = index;
+      conf->lb_count = count;
+      continue;
+    }
+
+    if (strcmp (option, "lb-buckets") == 0) {
+      char *str = strtok (NULL, delims);
+      if (str == NULL) {
+        log_error ("%s:%d: Missing bucket set", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      if (lb_parse_buckets (str, conf->lb_buckets) < 0) {
+        log_error ("%s:%d: Invalid bucket set: %s", path, lineno, str);
+        ret = -1;
+        goto done;
+      }
+
+      conf->have_lb_buckets = 1;
+      continue;
+    }
+
+    if (strcmp (option, "leasequery-socket") == 0) {
+      char *str = strtok (NULL, delims);
+      if (str == NULL) {
+        log_error ("%s:%d: Missing socket path", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      free (conf->leasequery_socket);
+      conf->leasequery_socket = strdup (str);
+      continue;
+    }
+
+    if (strcmp (option, "history-dir") == 0) {
+      char *str = strtok (NULL, delims);
+      if (str == NULL) {
+        log_error ("%s:%d: Missing history directory", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      free (conf->history_dir);
+      conf->history_dir = strdup (str);
+      continue;
+    }
+
+    if (strcmp (option, "mac-allow") == 0
+        || strcmp (option, "mac-deny") == 0) {
+      char *str = strtok (NULL, delims);
+      if (str == NULL) {
+        log_error ("%s:%d: Missing hardware address list", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      char **field = strcmp (option, "mac-allow") == 0 ? &conf->mac_allow
+                                                        : &conf->mac_deny;
+      free (*field);
+      *field = strdup (str);
+      continue;
+    }
+
+    if (strcmp (option, "reservation-socket") == 0
+        || strcmp (option, "reservation-journal") == 0) {
+      char *str = strtok (NULL, delims);
+      if (str == NULL) {
+        log_error ("%s:%d: Missing path", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      char **field = strcmp (option, "reservation-socket") == 0
+                     ? &conf->reservation_socket
+                     : &conf->reservation_journal;
+      free (*field);
+      *field = strdup (str);
+      continue;
+    }
+
+    if (strcmp (option, "ddns-server") == 0) {
+      char *str = strtok (NULL, delims);
+      if (str == NULL) {
+        log_error ("%s:%d: Missing DNS server address", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      if (inet_pton (AF_INET, str, &addr_buf) != 1) {
+        log_error ("%s:%d: Invalid DNS server address: %s", path, lineno, str);
+        ret = -1;
+        goto done;
+      }
+
+      conf->ddns_server = addr_buf.s_addr;
+
+      str = strtok (NULL, delims);
+      if (str == NULL)
+        continue;
+
+      int port = parse_count (str);
+      if (port <= 0 || port > 65535) {
+        log_error ("%s:%d: Invalid DNS server port: %s", path, lineno, str);
+        ret = -1;
+        goto done;
+      }
+
+      conf->ddns_port = port;
+      continue;
+    }
+
+    if (strcmp (option, "ddns-zone") == 0) {
+      char *str = strtok (NULL, delims);
+      if (str == NULL) {
+        log_error ("%s:%d: Missing DNS zone", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      free (conf->ddns_zone);
+      conf->ddns_zone = strdup (str);
+      continue;
+    }
+
+    if (strcmp (option, "ddns-ttl") == 0) {
+      char *str = strtok (NULL, delims);
+      if (str == NULL) {
+        log_error ("%s:%d: Missing DNS record TTL", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      int time = conf_parse_time (str);
+      if (time < 0) {
+        log_error ("%s:%d: Invalid DNS record TTL: %s", path, lineno, str);
+        ret = -1;
+        goto done;
+      }
+
+      conf->ddns_ttl = time;
+      continue;
+    }
+
+    if (strcmp (option, "timestamping") == 0) {
+      char *str = strtok (NULL, delims);
+      if (str == NULL) {
+        log_error ("%s:%d: Missing value for timestamping", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      int value = parse_bool (str);
+      if (value < 0) {
+        log_error ("%s:%d: Invalid value for timestamping: %s", path, lineno, str);
+        ret = -1;
+        goto done;
+      }
+
+      conf->timestamping = value;
+      continue;
+    }
+
+    if (strcmp (option, "busy-poll") == 0) {
+      char *str = strtok (NULL, delims);
+      if (str == NULL) {
+        log_error ("%s:%d: Missing busy poll time", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      int time = parse_count (str);
+      if (time < 0) {
+        log_error ("%s:%d: Invalid busy poll time: %s", path, lineno, str);
+        ret = -1;
+        goto done;
+      }
+
+      conf->busy_poll = time;
+      continue;
+    }
+
+    if (strcmp (option, "cpu") == 0) {
+      char *str = strtok (NULL, delims);
+      if (str == NULL) {
+        log_error ("%s:%d: Missing CPU", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      int cpu = parse_count (str);
+      if (cpu < 0) {
+        log_error ("%s:%d: Invalid CPU: %s", path, lineno, str);
+        ret = -1;
+        goto done;
+      }
+
+      conf->cpu = cpu;
+      continue;
+    }
+
+    if (strcmp (option, "xdp") == 0) {
+      char *str = strtok (NULL, delims);
+      if (str == NULL) {
+        log_error ("%s:%d: Missing XDP mode", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      if (strcmp (str, "off") == 0)
+        conf->xdp = CONF_XDP_OFF;
+      else if (strcmp (str, "generic") == 0)
+        conf->xdp = CONF_XDP_GENERIC;
+      else if (strcmp (str, "native") == 0)
+        conf->xdp = CONF_XDP_NATIVE;
+      else {
+        log_error ("%s:%d: Invalid XDP mode: %s", path, lineno, str);
+        ret = -1;
+        goto done;
+      }
+      continue;
+    }
+
+    if (strcmp (option, "trace-file") == 0) {
+      char *str = strtok (NULL, delims);
+      if (str == NULL) {
+        log_error ("%s:%d: Missing trace file path", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      free (conf->trace_file);
+      conf->trace_file = strdup (str);
+
+      str = strtok (NULL, delims);
+      if (str == NULL)
+        continue;
+
+      int sample = parse_count (str);
+      if (sample <= 0) {
+        log_error ("%s:%d: Invalid trace sampling rate: %s", path, lineno, str);
+        ret = -1;
+        goto done;
+      }
+
+      conf->trace_sample = sample;
+      continue;
+    }
+
+    if (strcmp (option, "class") == 0) {
+      if (parse_class (conf, path, lineno) < 0) {
+        ret = -1;
+        goto done;
+      }
+      continue;
+    }
+
+    if (strcmp (option, "match") == 0) {
+      if (parse_match (conf, path, lineno) < 0) {
+        ret = -1;
+        goto done;
+      }
+      continue;
+    }
+
+    if (strcmp (option, "static") == 0) {
+      if (conf->nstatic_confs == static_capac) {
+        static_capac = static_capac ? static_capac * 2 : 16;
+        conf->static_confs = realloc (conf->static_confs,
+                                      sizeof (struct static_conf) * static_capac);
+      }
+      conf->nstatic_confs++;
+      struct static_conf *static_conf = &conf->static_confs[conf->nstatic_confs - 1];
+
+      char *str = strtok (NULL, delims);
+      if (str == NULL) {
+        log_error ("%s:%d: Missing hardware address", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      ether_ptr = ether_aton (str);
+
+      if (ether_ptr == NULL) {
+        log_error ("%s:%d: Invalid hardware address: %s", path, lineno, str);
+        ret = -1;
+        goto done;
+      }
+
+      memcpy (&static_conf->ether_addr, ether_ptr, sizeof (struct ether_addr));
+
+      str = strtok (NULL, delims);
+      if (str == NULL) {
+        log_error ("%s:%d: Missing IPv4 address", path, lineno);
+        ret = -1;
+        goto done;
+      }
+
+      if (inet_pton (AF_INET, str, &addr_buf) != 1) {
+        log_error ("%s:%d: Invalid IPv4 address: %s", path, lineno, str);
+        ret = -1;
+        goto done;
+      }
+
+      static_conf->in_addr = addr_buf.s_addr;
+
+      str = strtok (NULL, delims);
+      if (str == NULL) {
+        /* Default lease time is 24h */
+        static_conf->lease_time = 24 * 3600;
+        continue;
+      }
+
+      int time = conf_parse_time (str);
+      if (time < 0) {
+        log_error ("%s:%d: Invalid lease time: %s", path, lineno, str);
+        ret = -1;
+        goto done;
+      }
+
+      static_conf->lease_time = time;
+      continue;
+    }
+
+    log_error ("%s:%d: Unknown configuration option '%s'", path, lineno, option);
+    ret = -1;
+    goto done;
+  }
+
+done:
+  free (line);
+  fclose (f);
+
+  if (ret == 0) {
+    resolve_ifaces (conf);
+    index_static_confs (conf);
+    ret = check_classes (conf);
+  }
+
+  return ret;
+}
+
+void
+conf_deinit (struct conf *conf)
+{
+  if (conf->image) {
+    munmap (conf->image, conf->image_size);
+    return;
+  }
+
+  free (conf->static_confs);
+  free (conf->static_index);
+  free (conf->classes);
+  free (conf->class_rules);
+  free (conf->leasequery_socket);
+  free (conf->ddns_zone);
+  free (conf->trace_file);
+  free (conf->history_dir);
+  free (conf->mac_allow);
+  free (conf->mac_deny);
+  free (conf->reservation_socket);
+  free (conf->reservation_journal);
+}
+
+const struct static_conf *
+conf_find_static (const struct conf *conf, const struct ether_addr *ether)
+{
+  if (conf->static_index_size == 0)
+    return NULL;
+
+  size_t mask = conf->static_index_size - 1;
+  size_t slot = hash_ether (ether) & mask;
+
+  while (conf->static_index[slot] != 0) {
+    const struct static_conf *sconf =
+      &conf->static_confs[conf->static_index[slot] - 1];
+    if (memcmp (&sconf->ether_addr, ether, sizeof (*ether)) == 0)
+      return sconf;
+    slot = (slot + 1) & mask;
+  }
+
+  return NULL;
+}
+
+static size_t
+align (size_t off)
+{
+  return (off + IMAGE_ALIGN - 1) & ~(size_t) (IMAGE_ALIGN - 1);
+}
+
+static int64_t
+mtime_ns (const struct stat *st)
+{
+  return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/* Whether an image was compiled from the source file as it is now */
+static int
+source_matches (const struct image_header *hdr, const struct stat *st)
+{
+  return hdr->source_mtime_ns == mtime_ns (st)
+         && hdr->source_size == (uint64_t) st->st_size
+         && hdr->source_ino == (uint64_t) st->st_ino
+         && hdr->source_dev == (uint64_t) st->st_dev;
+}
+
+int
+conf_compile (const struct conf *conf, const char *path,
+              const char *image_path)
+{
+  struct stat st;
+  if (stat (path, &st) < 0) {
+    log_errno ("Failed to stat %s", path);
+    return -1;
+  }
+
+  /* Lay out sections */
+  struct image_header hdr;
+  memset (&hdr, 0, sizeof (hdr));
+  memcpy (hdr.magic, IMAGE_MAGIC, sizeof (hdr.magic));
+  hdr.version = IMAGE_VERSION;
+  hdr.conf_size = sizeof (struct conf);
+  hdr.static_conf_size = sizeof (struct static_conf);
+  hdr.class_conf_size = sizeof (struct class_conf);
+  hdr.class_rule_size = sizeof (struct class_rule);
+  hdr.source_mtime_ns = mtime_ns (&st);
+  hdr.source_size = st.st_size;
+  hdr.source_ino = st.st_ino;
+  hdr.source_dev = st.st_dev;
+  hdr.conf_off = align (sizeof (hdr));
+  hdr.static_confs_off = align (hdr.conf_off + sizeof (struct conf));
+  hdr.static_index_off = align (hdr.static_confs_off
+                                + sizeof (struct static_conf) * conf->nstatic_confs);
+  hdr.classes_off = align (hdr.static_index_off
+                           + sizeof (uint32_t) * conf->static_index_size);
+  hdr.class_rules_off = align (hdr.classes_off
+                               + sizeof (struct class_conf) * conf->nclasses);
+  hdr.strings_off = align (hdr.class_rules_off
+                           + sizeof (struct class_rule) * conf->nclass_rules);
+
+  size_t strings_len = 0;
+  for (size_t i = 0; i < NSTRING_FIELDS; i++) {
+    char *str = *(char **) ((char *) conf + string_fields[i]);
+    if (str)
+      strings_len += strlen (str) + 1;
+  }
+  hdr.size = hdr.strings_off + strings_len;
+
+  uint8_t *buf = calloc (1, hdr.size);
+  if (buf == NULL) {
+    log_error ("Out of memory");
+    return -1;
+  }
+
+  /* Pointers are replaced by offsets into the image plus one,
+   * so that NULL stays zero */
+  struct conf image_conf = *conf;
+  image_conf.static_confs = NULL;
+  image_conf.static_index = NULL;
+  image_conf.classes = NULL;
+  image_conf.class_rules = NULL;
+  image_conf.image = NULL;
+  image_conf.image_size = 0;
+
+  size_t str_off = hdr.strings_off;
+  for (size_t i = 0; i < NSTRING_FIELDS; i++) {
+    char **field = (char **) ((char *) &image_conf + string_fields[i]);
+    if (*field == NULL)
+      continue;
+    size_t len = strlen (*field) + 1;
+    memcpy (buf + str_off, *field, len);
+    *field = (char *) (uintptr_t) (str_off + 1);
+    str_off += len;
+  }
+
+  memcpy (buf, &hdr, sizeof (hdr));
+  memcpy (buf + hdr.conf_off, &image_conf, sizeof (image_conf));
+  memcpy (buf + hdr.static_confs_off, conf->static_confs,
+          sizeof (struct static_conf) * conf->nstatic_confs);
+  memcpy (buf + hdr.static_index_off, conf->static_index,
+          sizeof (uint32_t) * conf->static_index_size);
+  if (conf->nclasses > 0)
+    memcpy (buf + hdr.classes_off, conf->classes,
+            sizeof (struct class_conf) * conf->nclasses);
+  if (conf->nclass_rules > 0)
+    memcpy (buf + hdr.class_rules_off, conf->class_rules,
+            sizeof (struct class_rule) * conf->nclass_rules);
+
+  /* Write to a temporary file and rename, so that a running
+   * server never maps a partially written image */
+  size_t tmp_len = strlen (image_path) + 5;
+  char *tmp_path = malloc (tmp_len);
+  snprintf (tmp_path, tmp_len, "%s.tmp", image_path);
+
+  int ret = 0;
+  FILE *f = fopen (tmp_path, "w");
+  if (f == NULL || fwrite (buf, 1, hdr.size, f) != hdr.size
+      || fclose (f) != 0 || rename (tmp_path, image_path) < 0) {
+    log_errno ("Failed to write %s", image_path);
+    unlink (tmp_path);
+    ret = -1;
+  }
+
+  free (tmp_path);
+  free (buf);
+  return ret;
+}
+
+/* Whether a section of n elements of the given size at off lies
+ * within an image of image_size bytes */
+static int
+section_fits (uint64_t off, uint64_t n, size_t size, uint64_t image_size)
+{
+  return off % IMAGE_ALIGN == 0 && off <= image_size
+         && n <= (image_size - off) / size;
+}
+
+/* Whether the sections of an image, and the offsets and indexes held
+ * in them, stay within the image. A damaged image of the right size
+ * would otherwise be read out of bounds. */
+static int
+image_fits (const uint8_t *image, const struct image_header *hdr)
+{
+  uint64_t size = hdr->size;
+
+  if (!section_fits (hdr->conf_off, 1, sizeof (struct conf), size))
+    return 0;
+
+  const struct conf *conf = (const struct conf *) (image + hdr->conf_off);
+  if (conf->nifaces > CONF_MAX_IFACES
+      || !section_fits (hdr->static_confs_off, conf->nstatic_confs,
+                        sizeof (struct static_conf), size)
+      || !section_fits (hdr->static_index_off, conf->static_index_size,
+                        sizeof (uint32_t), size)
+      || !section_fits (hdr->classes_off, conf->nclasses,
+                        sizeof (struct class_conf), size)
+      || !section_fits (hdr->class_rules_off, conf->nclass_rules,
+                        sizeof (struct class_rule), size))
+    return 0;
+
+  for (size_t i = 0; i < conf->nifaces; i++)
+    if (memchr (conf->ifaces[i].name, '\0', IFNAMSIZ) == NULL)
+      return 0;
+
+  /* Every probe of the index has to end at an empty slot */
+  size_t index_size = conf->static_index_size;
+  if ((index_size & (index_size - 1)) != 0
+      || (index_size > 0 && conf->nstatic_confs >= index_size))
+    return 0;
+
+  const uint32_t *index = (const uint32_t *) (image + hdr->static_index_off);
+  for (size_t i = 0; i < index_size; i++)
+    if (index[i] > conf->nstatic_confs)
+      return 0;
+
+  const struct class_conf *classes =
+    (const struct class_conf *) (image + hdr->classes_off);
+  for (size_t i = 0; i < conf->nclasses; i++)
+    if (classes[i].iface >= conf->nifaces
+        || memchr (classes[i].name, '\0', sizeof (classes[i].name)) == NULL
+        || memchr (classes[i].boot_file, '\0',
+                   sizeof (classes[i].boot_file)) == NULL)
+      return 0;
+
+  const struct class_rule *rules =
+    (const struct class_rule *) (image + hdr->class_rules_off);
+  for (size_t i = 0; i < conf->nclass_rules; i++)
+    if (rules[i].class >= conf->nclasses)
+      return 0;
+
+  /* Strings are offsets plus one, and end within the image */
+  for (size_t i = 0; i < NSTRING_FIELDS; i++) {
+    char *field;
+    memcpy (&field, (const char *) conf + string_fields[i], sizeof (field));
+
+    uint64_t off = (uintptr_t) field;
+    if (off == 0)
+      continue;
+    if (off - 1 >= size
+        || memchr (image + off - 1, '\0', size - (off - 1)) == NULL)
+      return 0;
+  }
+
+  return 1;
+}
+
+int
+conf_load_image (const char *image_path, const char *path,
+                 struct conf *conf)
+{
+  struct stat st, image_st;
+
+  if (stat (path, &st) < 0 || stat (image_path, &image_st) < 0)
+    return -1;
+
+  if ((size_t) image_st.st_size < sizeof (struct image_header))
+    return -1;
+
+  int fd = open (image_path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  uint8_t *image = mmap (NULL, image_st.st_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (image == MAP_FAILED)
+    return -1;
+
+  struct image_header hdr;
+  memcpy (&hdr, image, sizeof (hdr));
+
+  if (memcmp (hdr.magic, IMAGE_MAGIC, sizeof (hdr.magic)) != 0
+      || hdr.version != IMAGE_VERSION
+      || hdr.conf_size != sizeof (struct conf)
+      || hdr.static_conf_size != sizeof (struct static_conf)
+      || hdr.class_conf_size != sizeof (struct class_conf)
+      || hdr.class_rule_size != sizeof (struct class_rule)
+      || !source_matches (&hdr, &st)
+      || hdr.size != (uint64_t) image_st.st_size) {
+    log_info ("Ignoring stale or incompatible image %s", image_path);
+    munmap (image, image_st.st_size);
+    return -1;
+  }
+
+  if (!image_fits (image, &hdr)) {
+    log_error ("Ignoring damaged image %s", image_path);
+    munmap (image, image_st.st_size);
+    return -1;
+  }
+
+  memcpy (conf, image + hdr.conf_off, sizeof (*conf));
+
+  for (size_t i = 0; i < NSTRING_FIELDS; i++) {
+    char **field = (char **) ((char *) conf + string_fields[i]);
+    if (*field)
+      *field = (char *) image + (uintptr_t) *field - 1;
+  }
+
+  conf->static_confs = (struct static_conf *) (image + hdr.static_confs_off);
+  conf->static_index = (uint32_t *) (image + hdr.static_index_off);
+  conf->classes = (struct class_conf *) (image + hdr.classes_off);
+  conf->class_rules = (struct class_rule *) (image + hdr.class_rules_off);
+  conf->image = image;
+  conf->image_size = image_st.st_size;
+
+  return 0;
 }
@@ -4,9 +4,12 @@
 /* Configuration parsing */
 
 #include <stdio.h>
+#include <net/if.h>
 #include <netinet/in.h>
 #include <netinet/ether.h>
 
+#include "loadbal.h"
+
 /* Static configuration */
 struct static_conf {
   /* IPv4 address */
@@ -19,6 +22,81 @@ struct static_conf {
   time_t lease_time;
 };
 
+#define CONF_MAX_IFACES 16
+
+/* Modes of the AF_XDP datapath */
+enum conf_xdp {
+  CONF_XDP_OFF,
+  CONF_XDP_GENERIC,
+  CONF_XDP_NATIVE,
+};
+
+/* Client class. Leases of clients in the class come from its own
+ * range, with its own lease time and boot settings. */
+struct class_conf {
+  char name[32];
+
+  /* Interface the class belongs to, index into ifaces */
+  size_t iface;
+
+  /* Address range */
+  in_addr_t range_lo;
+  in_addr_t range_hi;
+
+  /* Lease time, 0 for that of the interface */
+  time_t lease_time;
+
+  /* Boot server and file for network booting, empty if not set */
+  in_addr_t next_server;
+  char boot_file[128];
+};
+
+/* Values that class rules match on */
+enum class_key {
+  CLASS_KEY_VENDOR_CLASS,
+  CLASS_KEY_USER_CLASS,
+  CLASS_KEY_MAC,
+  CLASS_NKEYS,
+};
+
+/* Rule putting clients in a class */
+struct class_rule {
+  /* Index into classes */
+  uint32_t class;
+
+  /* Value matched, enum class_key */
+  uint8_t key;
+
+  /* Match values that start with data instead of equal ones */
+  uint8_t prefix;
+
+  uint8_t len;
+  uint8_t data[255];
+};
+
+/* Interface configuration. Fields that are not set for the
+ * interface are taken from the top level configuration. */
+struct iface_conf {
+  /* Interface name */
+  char name[IFNAMSIZ];
+
+  /* Subnet mask */
+  in_addr_t subnet_mask;
+
+  /* Lease time */
+  time_t lease_time;
+
+  /* Address range, lowest address */
+  in_addr_t range_lo;
+
+  /* Address range, highest address */
+  in_addr_t range_hi;
+
+  /* Answer DHCPDISCOVER with Rapid Commit (RFC 4039) with a
+   * DHCPACK, -1 if not set */
+  int rapid_commit;
+};
+
 /* Parsed configuration */
 struct conf {
   /* Static configurations */
@@ -27,8 +105,24 @@ struct conf {
   /* Number of static configurations */
   size_t nstatic_confs;
 
-  /* Interface name */
-  char *interface;
+  /* Hash index of static configurations by hardware address.
+   * Slots hold an index into static_confs plus one, or 0 if
+   * empty. */
+  uint32_t *static_index;
+
+  /* Number of slots in the index, a power of two */
+  size_t static_index_size;
+
+  /* Served interfaces */
+  struct iface_conf ifaces[CONF_MAX_IFACES];
+  size_t nifaces;
+
+  /* Client classes and the rules that select them. Where rules
+   * of several classes match, the class defined first wins. */
+  struct class_conf *classes;
+  size_t nclasses;
+  struct class_rule *class_rules;
+  size_t nclass_rules;
 
   /* Subnet mask */
   in_addr_t subnet_mask;
@@ -37,6 +131,9 @@ struct conf {
    * waiting for a request. */
   time_t request_window;
 
+  /* Default for interfaces that don't set rapid-commit */
+  int rapid_commit;
+
   /* Lease time */
   time_t lease_time;
 
@@ -45,8 +142,114 @@ struct conf {
 
   /* Address range, highest address */
   in_addr_t range_hi;
+
+  /* Back the lease table with huge pages */
+  int huge_pages;
+
+  /* Number of addresses to probe for conflicts ahead
+   * of demand, 0 disables probing */
+  size_t probe_depth;
+
+  /* Time to wait for a probe reply, in ms */
+  long probe_timeout;
+
+  /* Number of expired bindings to remember, 0 disables */
+  size_t affinity_cache;
+
+  /* Number of replies to keep for retransmissions, 0 disables */
+  size_t retransmit_cache;
+
+  /* Adaptive lease time bounds, a floor of 0 disables adaptation
+   * and a ceiling of 0 means the lease time of each interface */
+  time_t adaptive_floor;
+  time_t adaptive_ceiling;
+
+  /* Pool utilization watermarks of adaptive lease time, in percent */
+  int adaptive_low;
+  int adaptive_high;
+
+  /* Position of this server among cooperating servers, and
+   * number of servers. A count of 0 disables load balancing. */
+  int lb_index;
+  int lb_count;
+
+  /* Explicitly assigned load balancing buckets */
+  uint8_t lb_buckets[LB_NBUCKETS / 8];
+  int have_lb_buckets;
+
+  /* Path of bulk lease query socket, NULL disables */
+  char *leasequery_socket;
+
+  /* Directory of the lease history, NULL disables */
+  char *history_dir;
+
+  /* Files of hardware addresses to serve exclusively and to never
+   * serve, NULL if none */
+  char *mac_allow;
+  char *mac_deny;
+
+  /* Socket to accept reservation changes on and journal to keep them
+   * in, NULL if none */
+  char *reservation_socket;
+  char *reservation_journal;
+
+  /* DNS server to send updates to, 0 disables updates */
+  in_addr_t ddns_server;
+  uint16_t ddns_port;
+
+  /* Zone to register host names in */
+  char *ddns_zone;
+
+  /* TTL of registered records */
+  time_t ddns_ttl;
+
+  /* Record per-stage latency with kernel timestamps */
+  int timestamping;
+
+  /* Spin on the sockets instead of sleeping while traffic arrives,
+   * busy polling the device for this many us per receive. 0 sleeps
+   * in the event loop. */
+  int busy_poll;
+
+  /* CPU to pin the server to, -1 for none */
+  int cpu;
+
+  /* Receive and send DHCP frames through AF_XDP sockets, attaching
+   * the XDP program in generic or driver mode, enum conf_xdp */
+  int xdp;
+
+  /* File to write sampled transactions to, NULL disables */
+  char *trace_file;
+
+  /* Write 1 in trace_sample transactions to the trace file */
+  unsigned trace_sample;
+
+  /* Mapped binary image backing this configuration, if any */
+  void *image;
+  size_t image_size;
 };
 
+/* Reset a configuration to the defaults */
+void conf_defaults (struct conf *conf);
+
 int conf_parse (const char *path, struct conf *conf);
 
+/* Write a parsed configuration to a binary image */
+int conf_compile (const struct conf *conf, const char *path,
+                  const char *image_path);
+
+/* Map a binary image, fails if it was not compiled from the
+ * current version of the source configuration at path */
+int conf_load_image (const char *image_path, const char *path,
+                     struct conf *conf);
+
+/* Parse a time such as 1h30m, in seconds, -1 if invalid */
+int conf_parse_time (const char *str);
+
+/* Find the static configuration of a hardware address */
+const struct static_conf *conf_find_static (const struct conf *conf,
+                                            const struct ether_addr *ether);
+
+void conf_deinit (struct conf *conf);
+
 #endif
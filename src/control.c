@@ -0,0 +1,851 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include "control.h"
+#include "core.h"
+#include "clock.h"
+#include "log.h"
+
+/* Journal size past which it is rewritten, on top of twice its size
+ * when it was last rewritten */
+static const size_t compact_slack = 1 << 20;
+
+/* Most a change takes in the journal */
+#define LINE_MAX_LEN 64
+
+/* Batch encoded for the journal */
+static char journal_buf[CTL_MAX_BATCH * LINE_MAX_LEN + 16];
+
+static const char *
+parse_op (char *line, struct rv_op *op)
+{
+  char *save;
+  char *verb = strtok_r (line, " \t\r", &save);
+  char *str;
+
+  memset (op, 0, sizeof (*op));
+
+  if (verb == NULL)
+    return "empty change";
+  else if (strcmp (verb, "add") == 0)
+    op->type = RV_ADD;
+  else if (strcmp (verb, "modify") == 0)
+    op->type = RV_MODIFY;
+  else if (strcmp (verb, "remove") == 0)
+    op->type = RV_REMOVE;
+  else
+    return "unknown change";
+
+  if ((str = strtok_r (NULL, " \t\r", &save)) == NULL
+      || ether_aton_r (str, &op->host.ether_addr) == NULL)
+    return "invalid hardware address";
+
+  if (op->type != RV_REMOVE) {
+    if ((str = strtok_r (NULL, " \t\r", &save)) == NULL
+        || inet_pton (AF_INET, str, &op->host.in_addr) != 1)
+      return "invalid address";
+
+    /* Default lease time is 24h, as for static hosts */
+    op->host.lease_time = 24 * 3600;
+    if ((str = strtok_r (NULL, " \t\r", &save)) != NULL
+        && (op->host.lease_time = conf_parse_time (str)) < 0)
+      return "invalid lease time";
+  }
+
+  if (strtok_r (NULL, " \t\r", &save) != NULL)
+    return "trailing garbage";
+
+  return NULL;
+}
+
+static int
+format_op (char *buf, const char *verb, const struct static_conf *host)
+{
+  char ether[18], addr[INET_ADDRSTRLEN];
+
+  ether_ntoa_r (&host->ether_addr, ether);
+  if (strcmp (verb, "remove") == 0)
+    return sprintf (buf, "remove %s\n", ether);
+
+  inet_ntop (AF_INET, &host->in_addr, addr, sizeof (addr));
+  return sprintf (buf, "%s %s %s %lds\n", verb, ether, addr,
+                  (long) host->lease_time);
+}
+
+static const char *
+verb_of (uint8_t type)
+{
+  return type == RV_ADD ? "add" : type == RV_MODIFY ? "modify" : "remove";
+}
+
+/* Write the difference between the reservations and the static
+ * hosts of the configuration as a new journal beside the current one,
+ * synced, and return it open for appending, -1 on failure. Removals
+ * come first, and changed hosts are removed and added again, so that
+ * no change depends on the order of the others. */
+static int
+write_snapshot (const struct control *ctl, const struct reserv *rv,
+                size_t *sizep)
+{
+  char tmp_path[4096], line[LINE_MAX_LEN];
+  const struct conf *conf = ctl->conf;
+  size_t size = 0, n = 0;
+
+  snprintf (tmp_path, sizeof (tmp_path), "%s.tmp", ctl->journal_path);
+  FILE *f = fopen (tmp_path, "w");
+  if (f == NULL) {
+    log_errno ("Failed to write %s", tmp_path);
+    return -1;
+  }
+
+  for (size_t i = 0; i < conf->nstatic_confs; i++) {
+    const struct static_conf *sconf = &conf->static_confs[i];
+    if (conf_find_static (conf, &sconf->ether_addr) != sconf)
+      continue;
+
+    const struct static_conf *host = rv_find (rv, &sconf->ether_addr);
+    if (host && host->in_addr == sconf->in_addr
+        && host->lease_time == sconf->lease_time)
+      continue;
+
+    size += fwrite (line, 1, format_op (line, "remove", sconf), f);
+    if (++n % CTL_MAX_BATCH == 0)
+      size += fwrite ("commit\n", 1, 7, f);
+  }
+
+  for (size_t i = 0; i < rv->nhosts; i++) {
+    const struct static_conf *host = &rv->hosts[i];
+    const struct static_conf *sconf =
+      conf_find_static (conf, &host->ether_addr);
+    if (sconf && host->in_addr == sconf->in_addr
+        && host->lease_time == sconf->lease_time)
+      continue;
+
+    size += fwrite (line, 1, format_op (line, "add", host), f);
+    if (++n % CTL_MAX_BATCH == 0)
+      size += fwrite ("commit\n", 1, 7, f);
+  }
+
+  if (n % CTL_MAX_BATCH != 0)
+    size += fwrite ("commit\n", 1, 7, f);
+
+  if (fflush (f) != 0 || ferror (f) || fdatasync (fileno (f)) < 0) {
+    log_errno ("Failed to write %s", tmp_path);
+    fclose (f);
+    return -1;
+  }
+  fclose (f);
+
+  int fd = open (tmp_path, O_WRONLY | O_APPEND | O_CLOEXEC);
+  if (fd < 0) {
+    log_errno ("Failed to open %s", tmp_path);
+    return -1;
+  }
+
+  *sizep = size;
+  return fd;
+}
+
+/* Move a new journal into place. Its directory is synced as well, or
+ * the rename might not outlive a crash. */
+static int
+install_journal (const char *path)
+{
+  char tmp_path[4096], dir[4096];
+
+  snprintf (tmp_path, sizeof (tmp_path), "%s.tmp", path);
+  if (rename (tmp_path, path) < 0) {
+    log_errno ("Failed to replace %s", path);
+    return -1;
+  }
+
+  snprintf (dir, sizeof (dir), "%s", path);
+  int fd = open (dirname (dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0 || fsync (fd) < 0) {
+    log_errno ("Failed to sync the directory of %s", path);
+    if (fd >= 0)
+      close (fd);
+    return -1;
+  }
+
+  close (fd);
+  return 0;
+}
+
+/* Sync the journal whenever batches were written to it since the last
+ * sync, and rewrite it when asked to */
+static void *
+sync_journal (void *arg)
+{
+  struct control *ctl = arg;
+  const uint64_t one = 1;
+
+  pthread_mutex_lock (&ctl->lock);
+  for (;;) {
+    while (!ctl->stopping && ctl->synced == ctl->written
+           && !ctl->rename_pending && ctl->rewrite == NULL)
+      pthread_cond_wait (&ctl->wake, &ctl->lock);
+
+    if (ctl->rewrite && !ctl->rename_pending && !ctl->stopping) {
+      struct reserv *copy = ctl->rewrite;
+      ctl->rewrite = NULL;
+      pthread_mutex_unlock (&ctl->lock);
+
+      size_t size = 0;
+      int fd = write_snapshot (ctl, copy, &size);
+      rv_deinit (copy);
+      free (copy);
+
+      pthread_mutex_lock (&ctl->lock);
+      ctl->rewritten_fd = fd;
+      ctl->rewritten_size = size;
+      ctl->rewrite_done = 1;
+    } else if (ctl->synced != ctl->written || ctl->rename_pending) {
+      int fd = ctl->sync_fd;
+      int retire = ctl->retire_fd;
+      int install = ctl->rename_pending;
+      int lost = ctl->lost;
+      uint64_t target = ctl->written;
+      ctl->retire_fd = -1;
+      pthread_mutex_unlock (&ctl->lock);
+
+      /* Once a sync failed, the kernel may have dropped pages that a
+       * later sync would not report, so nothing written since counts
+       * as synced. A rewrite takes the place of the journal only once
+       * it holds every batch the journal did. */
+      int ret = -1;
+      if (!lost && (ret = fdatasync (fd)) < 0)
+        log_errno ("Failed to sync %s", ctl->journal_path);
+      else if (!lost && install)
+        ret = install_journal (ctl->journal_path);
+      if (retire >= 0)
+        close (retire);
+
+      pthread_mutex_lock (&ctl->lock);
+      ctl->synced = target;
+      ctl->rename_pending = 0;
+      if (ret < 0) {
+        ctl->failed = target;
+        ctl->lost = 1;
+      }
+    } else {
+      break;
+    }
+
+    if (write (ctl->donefd, &one, sizeof (one)) < 0)
+      log_errno ("Failed to wake the event loop");
+  }
+  pthread_mutex_unlock (&ctl->lock);
+
+  return NULL;
+}
+
+static int
+start_syncer (struct control *ctl)
+{
+  struct epoll_event ev = {
+    .events = EPOLLIN,
+    .data.u64 = ctl->tag + 1 + CTL_MAX_SESSIONS,
+  };
+
+  ctl->donefd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (ctl->donefd < 0
+      || epoll_ctl (ctl->epfd, EPOLL_CTL_ADD, ctl->donefd, &ev) < 0) {
+    log_errno ("Failed to watch journal syncs");
+    return -1;
+  }
+  ctl->sync_fd = ctl->journal_fd;
+
+  /* Signals are left to the event loop */
+  sigset_t all, old;
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+  int err = pthread_create (&ctl->syncer, NULL, sync_journal, ctl);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+
+  if (err != 0) {
+    log_error ("Failed to start syncing %s: %s", ctl->journal_path,
+               strerror (err));
+    close (ctl->donefd);
+    ctl->donefd = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Have the syncer rewrite the journal from a copy of the reservations
+ * as they are now */
+static void
+start_rewrite (struct control *ctl)
+{
+  struct reserv *copy = malloc (sizeof (*copy));
+
+  if (copy == NULL || rv_copy (copy, ctl->rv) < 0) {
+    log_error ("Out of memory to rewrite %s", ctl->journal_path);
+    free (copy);
+
+    /* Try again once the journal has grown as much again */
+    ctl->snapshot_size = ctl->journal_size;
+    return;
+  }
+
+  pthread_mutex_lock (&ctl->lock);
+  ctl->rewrite = copy;
+  pthread_cond_signal (&ctl->wake);
+  pthread_mutex_unlock (&ctl->lock);
+
+  ctl->rewriting = 1;
+  ctl->tail_len = 0;
+  ctl->tail_failed = 0;
+}
+
+/* Switch to the rewritten journal, once the batches written since the
+ * copy are appended to it. The syncer syncs it and moves it into
+ * place before any of those batches is answered. */
+static void
+finish_rewrite (struct control *ctl, int fd, size_t size)
+{
+  ctl->rewriting = 0;
+
+  if (fd >= 0 && ctl->journal_fd >= 0 && !ctl->tail_failed
+      && write (fd, ctl->tail, ctl->tail_len) == (ssize_t) ctl->tail_len) {
+    pthread_mutex_lock (&ctl->lock);
+    ctl->retire_fd = ctl->sync_fd;
+    ctl->sync_fd = fd;
+    ctl->rename_pending = 1;
+    pthread_cond_signal (&ctl->wake);
+    pthread_mutex_unlock (&ctl->lock);
+
+    ctl->journal_fd = fd;
+    ctl->journal_size = size + ctl->tail_len;
+    ctl->snapshot_size = size;
+    return;
+  }
+
+  if (fd >= 0) {
+    log_error ("Failed to rewrite %s", ctl->journal_path);
+    close (fd);
+  }
+  ctl->snapshot_size = ctl->journal_size;
+}
+
+/* Apply a batch read back from the journal. A batch that is refused
+ * as a whole, as can happen when the configuration has changed since
+ * it was written, is applied one change at a time. */
+static void
+replay_batch (struct control *ctl, const struct rv_op *ops, size_t nops,
+              struct dhcp_core *const *cores, size_t ncores)
+{
+  char err[128];
+
+  if (rv_apply (ctl->rv, ops, nops, cores, ncores, err, sizeof (err)) == 0) {
+    rv_commit (ctl->rv, cores, ncores, clock_now ());
+    return;
+  }
+
+  for (size_t i = 0; i < nops; i++) {
+    if (rv_apply (ctl->rv, &ops[i], 1, cores, ncores, err,
+                  sizeof (err)) == 0) {
+      rv_commit (ctl->rv, cores, ncores, clock_now ());
+      continue;
+    }
+
+    char line[LINE_MAX_LEN];
+    format_op (line, verb_of (ops[i].type), &ops[i].host);
+    line[strlen (line) - 1] = '\0';
+    log_error ("%s: Dropping '%s': %s", ctl->journal_path, line,
+               strchr (err, ' ') + 1);
+  }
+}
+
+static int
+replay (struct control *ctl, struct dhcp_core *const *cores, size_t ncores)
+{
+  static struct rv_op ops[CTL_MAX_BATCH];
+  size_t nops = 0, nbatches = 0;
+  char *line = NULL;
+  size_t line_size = 0;
+  int lineno = 0;
+  ssize_t len;
+
+  FILE *f = fopen (ctl->journal_path, "r");
+  if (f == NULL)
+    return errno == ENOENT ? 0 : -1;
+
+  while ((len = getline (&line, &line_size, f)) >= 0) {
+    lineno++;
+
+    /* The last line was cut short */
+    if (line[len - 1] != '\n') {
+      nops++;
+      break;
+    }
+    line[len - 1] = '\0';
+
+    if (strcmp (line, "commit") == 0) {
+      replay_batch (ctl, ops, nops, cores, ncores);
+      nbatches++;
+      nops = 0;
+      continue;
+    }
+
+    const char *reason = nops < CTL_MAX_BATCH
+                         ? parse_op (line, &ops[nops])
+                         : "too many changes in batch";
+    if (reason) {
+      log_error ("%s:%d: %s", ctl->journal_path, lineno, reason);
+      continue;
+    }
+    nops++;
+  }
+
+  /* A batch without its commit was cut short while being written,
+   * and was never acknowledged */
+  if (nops > 0)
+    log_error ("%s: Dropping %zu uncommitted changes", ctl->journal_path,
+               nops);
+
+  log_info ("Replayed %zu reservation batches from %s, %zu hosts reserved",
+            nbatches, ctl->journal_path, ctl->rv->nhosts);
+
+  free (line);
+  fclose (f);
+  return 0;
+}
+
+/* Append a batch to the journal. A batch that does not make it in
+ * full is cut off again, so that replay does not take it for part of
+ * the next; if even that fails the journal is given up. */
+static int
+journal_append (struct control *ctl, const struct rv_op *ops, size_t nops)
+{
+  char *p = journal_buf;
+
+  if (ctl->journal_fd < 0)
+    return -1;
+
+  for (size_t i = 0; i < nops; i++)
+    p += format_op (p, verb_of (ops[i].type), &ops[i].host);
+  p += sprintf (p, "commit\n");
+
+  size_t len = p - journal_buf;
+  ssize_t n = write (ctl->journal_fd, journal_buf, len);
+  if (n != (ssize_t) len) {
+    if (n >= 0)
+      errno = ENOSPC;
+    log_errno ("Failed to write %s", ctl->journal_path);
+
+    /* The descriptor is left open for the syncer */
+    if (ftruncate (ctl->journal_fd, ctl->journal_size) < 0) {
+      log_errno ("Failed to truncate %s, refusing further changes",
+                 ctl->journal_path);
+      ctl->journal_fd = -1;
+    }
+    return -1;
+  }
+
+  ctl->journal_size += len;
+
+  /* The rewrite in progress started from a copy without this batch */
+  if (ctl->rewriting && !ctl->tail_failed) {
+    if (ctl->tail_len + len > ctl->tail_size) {
+      size_t tail_size = 2 * (ctl->tail_len + len);
+      char *tail = realloc (ctl->tail, tail_size);
+      if (tail == NULL) {
+        ctl->tail_failed = 1;
+      } else {
+        ctl->tail = tail;
+        ctl->tail_size = tail_size;
+      }
+    }
+    if (!ctl->tail_failed) {
+      memcpy (ctl->tail + ctl->tail_len, journal_buf, len);
+      ctl->tail_len += len;
+    }
+  }
+
+  pthread_mutex_lock (&ctl->lock);
+  ctl->written++;
+  pthread_cond_signal (&ctl->wake);
+  pthread_mutex_unlock (&ctl->lock);
+
+  if (!ctl->rewriting
+      && ctl->journal_size > 2 * ctl->snapshot_size + compact_slack)
+    start_rewrite (ctl);
+  return 0;
+}
+
+static void
+ctl_close (struct control *ctl, struct ctl_session *s)
+{
+  epoll_ctl (ctl->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+  close (s->fd);
+  free (s->ops);
+  s->ops = NULL;
+  s->fd = -1;
+  s->len = 0;
+  s->nops = 0;
+  s->bad = 0;
+  s->wait = 0;
+}
+
+/* Set the events to watch a client for */
+static int
+watch_session (struct control *ctl, struct ctl_session *s, uint32_t events)
+{
+  struct epoll_event ev = {
+    .events = events,
+    .data.u64 = ctl->tag + 1 + (s - ctl->sessions),
+  };
+
+  return epoll_ctl (ctl->epfd, EPOLL_CTL_MOD, s->fd, &ev);
+}
+
+static void
+ctl_accept (struct control *ctl)
+{
+  int fd = accept4 (ctl->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0) {
+    log_errno ("Failed to accept control client");
+    return;
+  }
+
+  struct ctl_session *s = NULL;
+  int index;
+  for (index = 0; index < CTL_MAX_SESSIONS; index++)
+    if (ctl->sessions[index].fd < 0) {
+      s = &ctl->sessions[index];
+      break;
+    }
+
+  if (s == NULL) {
+    log_error ("Too many control clients");
+    close (fd);
+    return;
+  }
+
+  struct epoll_event ev = {
+    .events = EPOLLIN,
+    .data.u64 = ctl->tag + 1 + index,
+  };
+
+  s->ops = malloc (sizeof (*s->ops) * CTL_MAX_BATCH);
+  if (s->ops == NULL || epoll_ctl (ctl->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    log_errno ("Failed to watch control client");
+    free (s->ops);
+    s->ops = NULL;
+    close (fd);
+    return;
+  }
+
+  s->fd = fd;
+}
+
+/* Answer a client, returns -1 if it does not keep up */
+static int
+reply (struct ctl_session *s, const char *fmt, ...)
+{
+  char buf[256];
+  va_list ap;
+
+  va_start (ap, fmt);
+  int len = vsnprintf (buf, sizeof (buf), fmt, ap);
+  va_end (ap);
+
+  /* A client that hung up gets EPIPE rather than a SIGPIPE */
+  return send (s->fd, buf, len, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+static int
+commit (struct control *ctl, struct ctl_session *s,
+        struct dhcp_core *const *cores, size_t ncores)
+{
+  char err[128];
+  int ret;
+
+  if (s->bad) {
+    ctl->rv->nrejected++;
+    ret = reply (s, "error %zu: %s\n", s->bad, s->bad_reason);
+  } else if (rv_apply (ctl->rv, s->ops, s->nops, cores, ncores,
+                       err, sizeof (err)) < 0) {
+    ret = reply (s, "error %s\n", err);
+  } else if (ctl->journal_path && journal_append (ctl, s->ops, s->nops) < 0) {
+    /* A batch that is not in the journal would be lost on restart */
+    rv_rollback (ctl->rv);
+    ret = reply (s, "error 0: failed to write journal\n");
+  } else if (ctl->journal_path) {
+    /* Answered once the journal is synced, reading no further
+     * until then */
+    rv_commit (ctl->rv, cores, ncores, clock_now ());
+    s->wait = ctl->written;
+    s->wait_nops = s->nops;
+    ret = watch_session (ctl, s, 0);
+  } else {
+    rv_commit (ctl->rv, cores, ncores, clock_now ());
+    ret = reply (s, "ok %zu\n", s->nops);
+  }
+
+  s->nops = 0;
+  s->bad = 0;
+  return ret;
+}
+
+/* Handle the complete lines read from a client */
+static int
+handle_lines (struct control *ctl, struct ctl_session *s,
+              struct dhcp_core *const *cores, size_t ncores)
+{
+  char *line = s->buf;
+  char *end;
+
+  while (s->wait == 0
+         && (end = memchr (line, '\n', s->buf + s->len - line)) != NULL) {
+    *end = '\0';
+    char *str = line + strspn (line, " \t\r");
+    line = end + 1;
+
+    if (*str == '\0' || *str == '#')
+      continue;
+
+    str[strcspn (str, "\r")] = '\0';
+    if (strcmp (str, "commit") == 0) {
+      if (commit (ctl, s, cores, ncores) < 0)
+        return -1;
+      continue;
+    }
+
+    /* Keep counting the changes of a batch that is refused already */
+    s->nops++;
+    if (s->bad)
+      continue;
+
+    if (s->nops > CTL_MAX_BATCH)
+      s->bad_reason = "too many changes in batch";
+    else
+      s->bad_reason = parse_op (str, &s->ops[s->nops - 1]);
+
+    if (s->bad_reason)
+      s->bad = s->nops;
+  }
+
+  s->len -= line - s->buf;
+  memmove (s->buf, line, s->len);
+
+  /* Lines can never fill the buffer */
+  return s->len < sizeof (s->buf) ? 0 : -1;
+}
+
+/* Take in what the syncer did, and answer the batches it synced */
+static void
+ctl_synced (struct control *ctl, struct dhcp_core *const *cores,
+            size_t ncores)
+{
+  uint64_t n;
+  if (read (ctl->donefd, &n, sizeof (n)) < 0)
+    return;
+
+  pthread_mutex_lock (&ctl->lock);
+  uint64_t synced = ctl->synced;
+  uint64_t failed = ctl->failed;
+  int lost = ctl->lost;
+  int rewrite_done = ctl->rewrite_done;
+  int rewritten_fd = ctl->rewritten_fd;
+  size_t rewritten_size = ctl->rewritten_size;
+  ctl->rewrite_done = 0;
+  pthread_mutex_unlock (&ctl->lock);
+
+  /* The descriptor is left open for the syncer */
+  if (lost && ctl->journal_fd >= 0) {
+    log_error ("Lost %s, refusing further changes", ctl->journal_path);
+    ctl->journal_fd = -1;
+  }
+
+  if (rewrite_done)
+    finish_rewrite (ctl, rewritten_fd, rewritten_size);
+
+  for (int i = 0; i < CTL_MAX_SESSIONS; i++) {
+    struct ctl_session *s = &ctl->sessions[i];
+    if (s->fd < 0 || s->wait == 0 || s->wait > synced)
+      continue;
+
+    int ret = s->wait <= failed
+              ? reply (s, "applied %zu: failed to sync journal\n",
+                       s->wait_nops)
+              : reply (s, "ok %zu\n", s->wait_nops);
+    s->wait = 0;
+
+    /* Go on with the lines that came after the commit */
+    if (ret < 0 || watch_session (ctl, s, EPOLLIN) < 0
+        || handle_lines (ctl, s, cores, ncores) < 0)
+      ctl_close (ctl, s);
+  }
+}
+
+int
+ctl_init (struct control *ctl, const struct conf *conf, struct reserv *rv,
+          struct dhcp_core *const *cores, size_t ncores, int epfd,
+          uint64_t tag)
+{
+  memset (ctl, 0, sizeof (*ctl));
+  ctl->listenfd = -1;
+  ctl->journal_fd = -1;
+  ctl->epfd = epfd;
+  ctl->tag = tag;
+  ctl->conf = conf;
+  ctl->rv = rv;
+  ctl->journal_path = conf->reservation_journal;
+  ctl->donefd = -1;
+  ctl->sync_fd = -1;
+  ctl->retire_fd = -1;
+  ctl->rewritten_fd = -1;
+  pthread_mutex_init (&ctl->lock, NULL);
+  pthread_cond_init (&ctl->wake, NULL);
+  for (int i = 0; i < CTL_MAX_SESSIONS; i++)
+    ctl->sessions[i].fd = -1;
+
+  if (ctl->journal_path) {
+    if (replay (ctl, cores, ncores) < 0) {
+      log_errno ("Failed to read %s", ctl->journal_path);
+      return -1;
+    }
+
+    size_t size = 0;
+    ctl->journal_fd = write_snapshot (ctl, rv, &size);
+    if (ctl->journal_fd < 0 || install_journal (ctl->journal_path) < 0)
+      return -1;
+    ctl->journal_size = size;
+    ctl->snapshot_size = size;
+
+    if (start_syncer (ctl) < 0)
+      return -1;
+  }
+
+  const char *path = conf->reservation_socket;
+  if (path == NULL)
+    return 0;
+
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+
+  if (strlen (path) >= sizeof (addr.sun_path)) {
+    log_error ("Control socket path too long: %s", path);
+    return -1;
+  }
+  strcpy (addr.sun_path, path);
+
+  if ((ctl->listenfd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK
+                               | SOCK_CLOEXEC, 0)) < 0) {
+    log_errno ("Failed to open control socket");
+    return -1;
+  }
+
+  unlink (path);
+  if (bind (ctl->listenfd, (struct sockaddr *) &addr, sizeof (addr)) < 0
+      || listen (ctl->listenfd, CTL_MAX_SESSIONS) < 0) {
+    log_errno ("Failed to listen on %s", path);
+    close (ctl->listenfd);
+    ctl->listenfd = -1;
+    return -1;
+  }
+
+  struct epoll_event ev = { .events = EPOLLIN, .data.u64 = tag };
+  if (epoll_ctl (epfd, EPOLL_CTL_ADD, ctl->listenfd, &ev) < 0) {
+    log_errno ("Failed to watch control socket");
+    return -1;
+  }
+
+  return 0;
+}
+
+void
+ctl_event (struct control *ctl, uint32_t index, uint32_t events,
+           struct dhcp_core *const *cores, size_t ncores)
+{
+  if (index == 0) {
+    ctl_accept (ctl);
+    return;
+  }
+
+  if (index == 1 + CTL_MAX_SESSIONS) {
+    ctl_synced (ctl, cores, ncores);
+    return;
+  }
+
+  struct ctl_session *s = &ctl->sessions[index - 1];
+  if (s->fd < 0)
+    return;
+
+  if (events & EPOLLERR) {
+    ctl_close (ctl, s);
+    return;
+  }
+
+  /* One read per event, so that a busy client takes turns with the
+   * traffic */
+  ssize_t n = read (s->fd, s->buf + s->len, sizeof (s->buf) - s->len);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+
+  if (n <= 0) {
+    ctl_close (ctl, s);
+    return;
+  }
+
+  s->len += n;
+  if (handle_lines (ctl, s, cores, ncores) < 0)
+    ctl_close (ctl, s);
+}
+
+void
+ctl_deinit (struct control *ctl)
+{
+  for (int i = 0; i < CTL_MAX_SESSIONS; i++)
+    if (ctl->sessions[i].fd >= 0)
+      ctl_close (ctl, &ctl->sessions[i]);
+
+  if (ctl->listenfd >= 0)
+    close (ctl->listenfd);
+
+  /* The syncer syncs what is left before it stops */
+  if (ctl->donefd >= 0) {
+    pthread_mutex_lock (&ctl->lock);
+    ctl->stopping = 1;
+    pthread_cond_signal (&ctl->wake);
+    pthread_mutex_unlock (&ctl->lock);
+    pthread_join (ctl->syncer, NULL);
+
+    close (ctl->donefd);
+    close (ctl->sync_fd);
+    if (ctl->retire_fd >= 0)
+      close (ctl->retire_fd);
+    if (ctl->rewrite_done && ctl->rewritten_fd >= 0)
+      close (ctl->rewritten_fd);
+    if (ctl->rewrite) {
+      rv_deinit (ctl->rewrite);
+      free (ctl->rewrite);
+    }
+  } else if (ctl->journal_fd >= 0) {
+    close (ctl->journal_fd);
+  }
+
+  free (ctl->tail);
+  pthread_cond_destroy (&ctl->wake);
+  pthread_mutex_destroy (&ctl->lock);
+}
@@ -0,0 +1,154 @@
+#ifndef CONTROL_H_INCLUDED
+#define CONTROL_H_INCLUDED
+
+/* Reservation control
+ *
+ * Provisioning systems connect to a Unix socket and send changes to
+ * the reservations as lines of text:
+ *
+ *   add <hwaddr> <address> [lease-time]
+ *   modify <hwaddr> <address> [lease-time]
+ *   remove <hwaddr>
+ *   commit
+ *
+ * Each commit applies the changes sent since the previous one as a
+ * batch, all of them or none, and is answered with "ok <count>" or
+ * "error <n>: <reason>", n being the number of the change in the
+ * batch that was refused, or 0 if the batch could not be written to
+ * the journal. Batches are applied from the event loop,
+ * between two rounds of messages, so no message is ever handled
+ * against half a batch.
+ *
+ * Applied batches are appended to a journal in the same form, which
+ * is replayed on startup on top of the static hosts of the
+ * configuration, and answered once the journal is synced. Should the
+ * sync fail, the batch is answered "applied <count>: <reason>": it is
+ * in effect, but may not survive a restart, and further changes are
+ * refused as the journal can no longer be trusted. The journal is rewritten as the difference
+ * between the reservations and the configuration on startup and
+ * whenever it has grown well past that.
+ *
+ * Syncs and rewrites run on a thread of their own, the event loop
+ * only ever writes to the page cache. Batches written while a sync is
+ * going are synced together by the next one.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "conf.h"
+#include "reserv.h"
+
+#define CTL_MAX_SESSIONS 8
+#define CTL_MAX_BATCH 4096
+#define CTL_BUF_SIZE 65536
+
+struct ctl_session {
+  /* Client socket, -1 if unused */
+  int fd;
+
+  /* Input not yet handled */
+  char buf[CTL_BUF_SIZE];
+  size_t len;
+
+  /* Changes of the current batch */
+  struct rv_op *ops;
+  size_t nops;
+
+  /* Number of the first change that could not be parsed and why,
+   * 0 if there is none */
+  size_t bad;
+  const char *bad_reason;
+
+  /* Journal sequence number of the batch waiting to be synced before
+   * it is answered, 0 if none, and its number of changes. Input is
+   * left unread while waiting. */
+  uint64_t wait;
+  size_t wait_nops;
+};
+
+struct control {
+  /* Listening socket, -1 if disabled */
+  int listenfd;
+
+  /* Event loop the sockets are registered with, and tag that
+   * identifies them. Events carry the tag plus 0 for the
+   * listening socket, plus 1 + i for session i, or plus
+   * 1 + CTL_MAX_SESSIONS for the syncer. */
+  int epfd;
+  uint64_t tag;
+
+  /* Connected clients */
+  struct ctl_session sessions[CTL_MAX_SESSIONS];
+
+  /* Configuration and the reservations that stand in for its
+   * static hosts */
+  const struct conf *conf;
+  struct reserv *rv;
+
+  /* Journal, -1 if none or given up, its size and its size when it
+   * was last rewritten */
+  const char *journal_path;
+  int journal_fd;
+  size_t journal_size;
+  size_t snapshot_size;
+
+  /* Whether the journal is being rewritten, and the batches written
+   * since, to append to the rewritten journal */
+  int rewriting;
+  char *tail;
+  size_t tail_len;
+  size_t tail_size;
+  int tail_failed;
+
+  /* Thread syncing and rewriting the journal, and eventfd it wakes
+   * the event loop with, -1 if not running */
+  pthread_t syncer;
+  int donefd;
+
+  /* State shared with the syncer, under lock */
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int stopping;
+
+  /* Batches written to the journal, the last one synced and the last
+   * one whose sync failed */
+  uint64_t written;
+  uint64_t synced;
+  uint64_t failed;
+
+  /* Journal to sync, and one it replaced that is left to close */
+  int sync_fd;
+  int retire_fd;
+
+  /* Whether the journal to sync is a rewrite still to be moved into
+   * place, and whether a sync or that move failed, after which the
+   * journal is given up */
+  int rename_pending;
+  int lost;
+
+  /* Copy of the reservations to rewrite the journal from, NULL if
+   * none, and once done the rewritten journal, -1 if that failed, and
+   * its size */
+  struct reserv *rewrite;
+  int rewrite_done;
+  int rewritten_fd;
+  size_t rewritten_size;
+};
+
+/* Replay the journal of a configuration into reservations and listen
+ * on its control socket */
+int ctl_init (struct control *ctl, const struct conf *conf,
+              struct reserv *rv, struct dhcp_core *const *cores,
+              size_t ncores, int epfd, uint64_t tag);
+
+/* Handle an event on socket index, applying batches to the
+ * reservations of the given engines */
+void ctl_event (struct control *ctl, uint32_t index, uint32_t events,
+                struct dhcp_core *const *cores, size_t ncores);
+
+/* Dispose of control state */
+void ctl_deinit (struct control *ctl);
+
+#endif
@@ -0,0 +1,824 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <arpa/inet.h>
+
+#include "core.h"
+#include "log.h"
+
+/* Size of a formatted hardware address */
+#define ETHER_STRLEN 18
+
+#ifdef DHCP_SERVER_DEBUG
+#define debug(...) log_info("[DEBUG] " __VA_ARGS__)
+#else
+#define debug(...)
+#endif
+
+static void process_discover (struct dhcp_core *core,
+                              const struct dhcp_msg *msg, int64_t now_ms,
+                              int rapid_commit, struct core_class *cls,
+                              struct core_reply *reply);
+static void process_request (struct dhcp_core *core,
+                             const struct dhcp_msg *msg, time_t now,
+                             struct core_class *cls,
+                             struct core_reply *reply);
+static int process_renew (struct dhcp_core *core,
+                          const struct dhcp_msg *msg, time_t now,
+                          struct core_class *cls,
+                          struct core_reply *reply);
+static char *inet_str (in_addr_t in_addr, char *buf);
+
+/* Set up the pools of the classes of an interface and compile the
+ * rules that select them */
+static int
+init_classes (struct dhcp_core *core)
+{
+  const struct conf *conf = core->conf;
+  size_t iface = core->iface - conf->ifaces;
+
+  if (conf->nclasses == 0)
+    return 0;
+
+  uint32_t *map = malloc (sizeof (*map) * conf->nclasses);
+  core->classes = calloc (conf->nclasses, sizeof (*core->classes));
+  if (map == NULL || core->classes == NULL) {
+    free (map);
+    return -1;
+  }
+
+  for (size_t i = 0; i < conf->nclasses; i++) {
+    const struct class_conf *cc = &conf->classes[i];
+
+    map[i] = CL_NO_CLASS;
+    if (cc->iface != iface)
+      continue;
+
+    struct core_class *cls = &core->classes[core->nclasses];
+    cls->conf = cc;
+    as_init (&cls->aspace, cc->range_lo, cc->range_hi);
+    map[i] = core->nclasses++;
+  }
+
+  int ret = cl_init (&core->classifier, conf, map);
+  free (map);
+  return ret;
+}
+
+/* Address space an address is allocated from */
+static struct addr_space *
+pool_of (struct dhcp_core *core, in_addr_t addr)
+{
+  for (size_t i = 0; i < core->nclasses; i++) {
+    const struct class_conf *cc = core->classes[i].conf;
+    if (ntohl (addr) >= ntohl (cc->range_lo)
+        && ntohl (addr) <= ntohl (cc->range_hi))
+      return &core->classes[i].aspace;
+  }
+
+  return &core->aspace;
+}
+
+/* Lease time of a client in a class, NULL for the dynamic pool */
+static uint32_t
+lease_time_of (struct dhcp_core *core, const struct core_class *cls,
+               time_t now)
+{
+  if (cls == NULL)
+    return al_lease_time (&core->adaptive, &core->aspace, now);
+
+  return cls->conf->lease_time ? cls->conf->lease_time
+                               : core->iface->lease_time;
+}
+
+/* Fill in the boot fields of a reply to a client in a class */
+static void
+set_class_fields (struct dhcp_msg *rmsg, const struct core_class *cls)
+{
+  if (cls == NULL)
+    return;
+
+  rmsg->siaddr = cls->conf->next_server;
+  memcpy (rmsg->file, cls->conf->boot_file, sizeof (rmsg->file) - 1);
+}
+
+/* Record a lease event in the history, if one is kept */
+static void
+record (struct dhcp_core *core, uint8_t event, in_addr_t addr,
+        const struct ether_addr *ether, time_t start, time_t end)
+{
+  static const struct ether_addr null_ether;
+
+  /* Quarantined addresses were never bound */
+  if (core->history == NULL
+      || memcmp (ether, &null_ether, sizeof (*ether)) == 0)
+    return;
+
+  hist_add (core->history, event, addr, ether, start, end);
+}
+
+int
+core_init (struct dhcp_core *core, const struct conf *conf,
+           const struct iface_conf *ic, in_addr_t server_addr,
+           const char *sname, int64_t now)
+{
+  memset (core, 0, sizeof (*core));
+  core->conf = conf;
+  core->iface = ic;
+  core->server_addr = server_addr;
+  strncpy (core->sname, sname, sizeof (core->sname) - 1);
+
+  as_init (&core->aspace, ic->range_lo, ic->range_hi);
+  af_init (&core->affinity, conf->affinity_cache);
+
+  al_init (&core->adaptive, conf->adaptive_floor,
+           conf->adaptive_ceiling ? conf->adaptive_ceiling : ic->lease_time,
+           conf->adaptive_low, conf->adaptive_high, now / 1000);
+
+  /* Offers are only valid for the request window */
+  rc_init (&core->rcache, conf->retransmit_cache,
+           conf->request_window * 1000);
+
+  if (init_classes (core) < 0)
+    return -1;
+
+  /* Every address in the pools and every static host can hold
+   * at most one lease, so the lease table never has to grow. */
+  size_t capac = as_size (&core->aspace) + conf->nstatic_confs;
+  for (size_t i = 0; i < core->nclasses; i++)
+    capac += as_size (&core->classes[i].aspace);
+
+  if (lq_init (&core->leaseq, ic->range_lo, capac,
+               conf->huge_pages, now / 1000) < 0)
+    return -1;
+
+  return 0;
+}
+
+void
+core_deinit (struct dhcp_core *core)
+{
+  lq_deinit (&core->leaseq);
+  rc_deinit (&core->rcache);
+
+  for (size_t i = 0; i < core->nclasses; i++)
+    as_deinit (&core->classes[i].aspace);
+  free (core->classes);
+  if (core->nclasses > 0)
+    cl_deinit (&core->classifier);
+}
+
+/* Class of a User Class option, which holds a list of length
+ * prefixed class names (RFC 3004). Clients that send a bare name
+ * are matched on the whole option when no listed name matches. */
+static uint32_t
+match_user_class (struct dhcp_core *core, const uint8_t *data, size_t len)
+{
+  uint32_t class = CL_NO_CLASS;
+  size_t off = 0;
+
+  while (off < len && data[off] > 0 && data[off] <= len - off - 1) {
+    uint32_t c = cl_match (&core->classifier, CLASS_KEY_USER_CLASS,
+                           data + off + 1, data[off]);
+    if (c < class)
+      class = c;
+    off += 1 + data[off];
+  }
+
+  if (off == len && class != CL_NO_CLASS)
+    return class;
+
+  return cl_match (&core->classifier, CLASS_KEY_USER_CLASS, data, len);
+}
+
+int
+core_handle (struct dhcp_core *core, const struct dhcp_msg *msg,
+             size_t len, int64_t now, struct core_reply *reply)
+{
+  reply->type = 0;
+  reply->cached = 0;
+  reply->hostname[0] = '\0';
+
+  if (len < offsetof (struct dhcp_msg, options))
+    return 0;
+
+  if (msg->hlen != ETHER_ADDR_LEN)
+    return 0;
+
+  if (core->acl
+      && !mf_permits (core->acl, (const struct ether_addr *) msg->chaddr)) {
+#ifdef DHCP_SERVER_DEBUG
+    char ether_str[ETHER_STRLEN];
+    debug ("Not serving %s",
+           ether_ntoa_r ((const struct ether_addr *) msg->chaddr, ether_str));
+#endif
+    return 0;
+  }
+
+  struct dhcp_oit it = dhcp_oit_init ((struct dhcp_msg *) msg);
+  struct dhcp_opt opt;
+
+  if (dhcp_eat_magic_cookie (&it) < 0) {
+    log_error ("Failed to parse message: missing or invalid magic cookie");
+    return 0;
+  }
+
+  int have_client_id = 0;
+  uint8_t bucket = 0;
+  int have_msg_type = 0;
+  int rapid_commit = 0;
+  int selecting = 0;
+  uint32_t class = CL_NO_CLASS;
+  enum dhcp_msg_type type;
+  while (!it.done) {
+    if (dhcp_opt_take (&opt, &it) < 0) {
+      log_error ("Error while parsing options");
+      break;
+    }
+
+    if (opt.tag == DHCP_OPT_DHCP_MESSAGE_TYPE) {
+      have_msg_type = 1;
+      type = opt.buf[0];
+    }
+
+    if (opt.tag == DHCP_OPT_HOST_NAME_OPTION) {
+      memcpy (reply->hostname, opt.buf, opt.len);
+      reply->hostname[opt.len] = '\0';
+    }
+
+    if (opt.tag == DHCP_OPT_CLIENT_IDENTIFIER) {
+      have_client_id = 1;
+      bucket = lb_hash (opt.buf, opt.len);
+    }
+
+    if (opt.tag == DHCP_OPT_RAPID_COMMIT)
+      rapid_commit = 1;
+
+    if (core->nclasses > 0 && opt.tag == DHCP_OPT_CLASS_IDENTIFIER) {
+      uint32_t c = cl_match (&core->classifier, CLASS_KEY_VENDOR_CLASS,
+                             opt.buf, opt.len);
+      if (c < class)
+        class = c;
+    }
+
+    if (core->nclasses > 0 && opt.tag == DHCP_OPT_USER_CLASS) {
+      uint32_t c = match_user_class (core, opt.buf, opt.len);
+      if (c < class)
+        class = c;
+    }
+
+    if (opt.tag == DHCP_OPT_SERVER_IDENTIFIER
+        || opt.tag == DHCP_OPT_REQUESTED_IP_ADDRESS)
+      selecting = 1;
+  }
+
+  if (!have_msg_type)
+    return 0;
+
+  /* Leave clients in other buckets to the other servers */
+  if (!have_client_id)
+    bucket = lb_hash (msg->chaddr, msg->hlen);
+  if (core->lb && !lb_serves (core->lb, bucket)) {
+    debug ("Not serving bucket %d", bucket);
+    core->lb->nignored++;
+    return 0;
+  }
+
+  char ether_str[ETHER_STRLEN];
+  log_info ("[%s] %s: %s (%s)", dhcp_msg_type_str (type), core->iface->name,
+            ether_ntoa_r ((const struct ether_addr *) msg->chaddr,
+                          ether_str),
+            reply->hostname[0] ? reply->hostname : "<unknown>");
+
+  /* Answer retransmissions with the reply sent before */
+  const struct rc_entry *cached = rc_lookup (&core->rcache, msg, type, now);
+  if (cached) {
+    debug ("Retransmission, resending reply");
+    reply->type = cached->reply_type;
+    reply->cached = 1;
+    *reply->msg = cached->reply;
+    reply->addr = cached->addr;
+    reply->hostname[0] = '\0';
+    return 1;
+  }
+
+  /* Pick the class of the client, which decides its pool,
+   * lease time and boot fields */
+  struct core_class *cls = NULL;
+  if (core->nclasses > 0) {
+    uint32_t c = cl_match (&core->classifier, CLASS_KEY_MAC,
+                           msg->chaddr, ETHER_ADDR_LEN);
+    if (c < class)
+      class = c;
+    if (class != CL_NO_CLASS)
+      cls = &core->classes[class];
+  }
+
+  switch (type) {
+  case DHCP_MSG_TYPE_DHCPDISCOVER:
+    process_discover (core, msg, now, rapid_commit, cls, reply);
+    break;
+  case DHCP_MSG_TYPE_DHCPREQUEST:
+    /* Renewing and rebinding clients only fill in ciaddr */
+    if (msg->ciaddr != 0 && !selecting
+        && process_renew (core, msg, now / 1000, cls, reply) == 0)
+      break;
+    process_request (core, msg, now / 1000, cls, reply);
+    break;
+  default:
+    debug ("Unhandled message type %s", dhcp_msg_type_str (type));
+    break;
+  }
+
+  /* Only bound addresses are registered */
+  if (reply->type != DHCP_MSG_TYPE_DHCPACK)
+    reply->hostname[0] = '\0';
+
+  if (reply->type == 0)
+    return 0;
+
+  rc_put (&core->rcache, reply->msg, reply->type, &reply->addr, now);
+  return 1;
+}
+
+void
+core_expire (struct dhcp_core *core, time_t now)
+{
+  struct lease lease;
+  char ether_str[ETHER_STRLEN];
+  char addr_str[INET_ADDRSTRLEN];
+
+  while (lq_next (&core->leaseq, &lease) == 0 && now >= lease.expire) {
+    log_info ("expire %s -> %s", ether_ntoa_r (&lease.ether_addr, ether_str),
+              inet_str (lease.in_addr, addr_str));
+    af_put (&core->affinity, &lease.ether_addr, lease.in_addr);
+    as_free (pool_of (core, lease.in_addr), lease.in_addr);
+
+    /* Offers that were never taken up are no part of the history */
+    if (lease.bound)
+      record (core, HIST_EXPIRE, lease.in_addr, &lease.ether_addr,
+              lease.expire, lease.expire);
+    lq_pop (&core->leaseq);
+  }
+}
+
+int64_t
+core_deadline (struct dhcp_core *core)
+{
+  struct lease lease;
+
+  if (lq_next (&core->leaseq, &lease) < 0)
+    return -1;
+
+  return lease.expire * 1000;
+}
+
+const struct static_conf *
+core_find_static (struct dhcp_core *core, const struct ether_addr *ether)
+{
+  const struct static_conf *sconf = core->reserv
+                                    ? rv_find (core->reserv, ether)
+                                    : conf_find_static (core->conf, ether);
+  in_addr_t mask = core->iface->subnet_mask;
+
+  /* Configured for a host on another interface */
+  if (sconf && (sconf->in_addr & mask) != (core->server_addr & mask))
+    return NULL;
+
+  return sconf;
+}
+
+int
+core_in_pool (const struct dhcp_core *core, in_addr_t addr)
+{
+  uint32_t a = ntohl (addr);
+
+  if (a >= ntohl (core->aspace.lo) && a <= ntohl (core->aspace.hi))
+    return 1;
+
+  for (size_t i = 0; i < core->nclasses; i++) {
+    const struct addr_space *as = &core->classes[i].aspace;
+    if (a >= ntohl (as->lo) && a <= ntohl (as->hi))
+      return 1;
+  }
+
+  return 0;
+}
+
+void
+core_revoke (struct dhcp_core *core, const struct ether_addr *ether,
+             in_addr_t keep, time_t now)
+{
+  ssize_t lease_id = lq_find (&core->leaseq, ether);
+  if (lease_id < 0)
+    return;
+
+  struct lease lease;
+  lq_get (&core->leaseq, lease_id, &lease);
+  if (lease.in_addr == keep)
+    return;
+
+  lq_remove (&core->leaseq, lease_id);
+  as_free (pool_of (core, lease.in_addr), lease.in_addr);
+  if (lease.bound)
+    record (core, HIST_EXPIRE, lease.in_addr, ether, now, now);
+}
+
+/* Address a reply to the broadcast address */
+static void
+broadcast (struct core_reply *reply)
+{
+  reply->addr.sin_family = AF_INET;
+  reply->addr.sin_port = htons (DHCP_PORT_CLIENT);
+  reply->addr.sin_addr.s_addr = INADDR_BROADCAST;
+}
+
+static void
+process_discover (struct dhcp_core *core, const struct dhcp_msg *msg,
+                  int64_t now_ms, int rapid_commit,
+                  struct core_class *cls, struct core_reply *reply)
+{
+  time_t now = now_ms / 1000;
+
+  /* Commit the lease right away instead of offering it */
+  uint8_t msg_type = DHCP_MSG_TYPE_DHCPOFFER;
+  if (rapid_commit && core->iface->rapid_commit)
+    msg_type = DHCP_MSG_TYPE_DHCPACK;
+
+  /* Ignore if lease exists */
+  if (lq_find (&core->leaseq, (struct ether_addr *) msg->chaddr) >= 0) {
+    debug ("Lease exists");
+    return;
+  }
+
+  /* Find static configuration if it exists */
+  const struct static_conf *sconf =
+    core_find_static (core, (struct ether_addr *) msg->chaddr);
+
+  /* Determine address and lease time */
+  in_addr_t in_addr;
+  uint32_t lease_time;
+  const char *alloc_type;
+  if (sconf) {
+    in_addr = sconf->in_addr;
+    lease_time = (uint32_t) sconf->lease_time;
+    alloc_type = "static";
+  } else if (cls) {
+    /* Classes have pools of their own, which are not probed */
+    struct addr_space *as = &cls->aspace;
+    if (af_claim (&core->affinity, (struct ether_addr *) msg->chaddr,
+                  as, &in_addr) < 0
+        && as_alloc (as, &in_addr) < 0) {
+      log_error ("Out of addresses in class %s", cls->conf->name);
+      return;
+    }
+    lease_time = lease_time_of (core, cls, now);
+    alloc_type = cls->conf->name;
+  } else {
+    /* Prefer the address the host had before, then an
+     * address that has been probed for conflicts */
+    if (af_claim (&core->affinity, (struct ether_addr *) msg->chaddr,
+                  &core->aspace, &in_addr) < 0
+        && (core->prober == NULL
+            || probe_take (core->prober, &in_addr, now_ms) < 0)
+        && as_alloc (&core->aspace, &in_addr) < 0) {
+      log_error ("Out of addresses");
+      return;
+    }
+    lease_time = al_lease_time (&core->adaptive, &core->aspace, now);
+    al_arrival (&core->adaptive);
+    alloc_type = "dynamic";
+  }
+
+  /* Reserve address during request window */
+  struct lease lease;
+  memcpy (&lease.ether_addr, msg->chaddr, sizeof (struct ether_addr));
+  lease.in_addr = in_addr;
+  /* Expiry is in whole seconds: round up, or an offer made late in a
+   * second would lapse up to a second before the window is over */
+  lease.expire = (now_ms + core->conf->request_window * 1000 + 999) / 1000;
+  lease.bound = msg_type == DHCP_MSG_TYPE_DHCPACK;
+  if (lease.bound) {
+    lease.expire = now + lease_time;
+    record (core, HIST_BIND, in_addr, &lease.ether_addr, now, lease.expire);
+  }
+  lq_add (&core->leaseq, &lease);
+
+  reply->hostname_addr = in_addr;
+
+  /* Create reply */
+  struct dhcp_msg *rmsg = reply->msg;
+  memcpy (rmsg, msg, sizeof (*rmsg));
+
+  /* Set message fields */
+  rmsg->op = DHCP_OP_BOOTREPLY;
+  rmsg->hops = 0;
+  rmsg->secs = 0;
+  rmsg->ciaddr = 0;
+  rmsg->yiaddr = in_addr;
+  rmsg->siaddr = 0;
+
+  memset (rmsg->sname, 0, sizeof (rmsg->sname));
+  memset (rmsg->file, 0, sizeof (rmsg->file));
+  memcpy (rmsg->sname, core->sname, sizeof (rmsg->sname) - 1);
+  set_class_fields (rmsg, cls);
+
+  /* Set options */
+  struct dhcp_opt opt;
+  struct dhcp_oit it = dhcp_oit_init (rmsg);
+  dhcp_add_magic_cookie (&it);
+
+  /* Message type */
+  opt.tag = DHCP_OPT_DHCP_MESSAGE_TYPE;
+  opt.buf[0] = msg_type;
+  opt.len = 1;
+  dhcp_opt_add (&opt, &it);
+
+  /* Rapid commit */
+  if (msg_type == DHCP_MSG_TYPE_DHCPACK) {
+    opt.tag = DHCP_OPT_RAPID_COMMIT;
+    opt.len = 0;
+    dhcp_opt_add (&opt, &it);
+  }
+
+  /* Lease time */
+  lease_time = htonl (lease_time);
+  opt.tag = DHCP_OPT_IP_ADDRESS_LEASE_TIME;
+  memcpy (opt.buf, &lease_time, 4);
+  opt.len = 4;
+  dhcp_opt_add (&opt, &it);
+
+  /* Server identifier */
+  opt.tag = DHCP_OPT_SERVER_IDENTIFIER;
+  memcpy (opt.buf, &core->server_addr, 4);
+  opt.len = 4;
+  dhcp_opt_add (&opt, &it);
+
+  /* Subnet mask */
+  opt.tag = DHCP_OPT_SUBNET_MASK;
+  memcpy (opt.buf, &core->iface->subnet_mask, 4);
+  opt.len = 4;
+  dhcp_opt_add (&opt, &it);
+
+  /* End options */
+  opt.tag = DHCP_OPT_END_OPTION;
+  dhcp_opt_add (&opt, &it);
+
+  char addr_str[INET_ADDRSTRLEN];
+  log_info ("[%s] %s (%s)", dhcp_msg_type_str (msg_type),
+            inet_str (in_addr, addr_str), alloc_type);
+  reply->type = msg_type;
+  broadcast (reply);
+}
+
+static void
+process_request (struct dhcp_core *core, const struct dhcp_msg *msg,
+                 time_t now, struct core_class *cls,
+                 struct core_reply *reply)
+{
+  enum dhcp_msg_type msg_type = DHCP_MSG_TYPE_DHCPACK;
+
+  /* Determine requested address */
+  struct dhcp_oit it = dhcp_oit_init ((struct dhcp_msg *) msg);
+  assert (dhcp_eat_magic_cookie (&it) == 0);
+
+  in_addr_t req_addr = 0;
+  while (!it.done) {
+    struct dhcp_opt opt;
+    if (dhcp_opt_take (&opt, &it) < 0) {
+      log_error ("Failed to parse message options");
+      return;
+    }
+
+    if (opt.tag == DHCP_OPT_REQUESTED_IP_ADDRESS) {
+      memcpy (&req_addr, opt.buf, 4);
+      continue;
+    }
+
+    if (opt.tag == DHCP_OPT_SERVER_IDENTIFIER &&
+        memcmp (opt.buf, &core->server_addr, 4) != 0) {
+      debug ("Wrong server id");
+      return;
+    }
+  }
+
+  /* Check if lease exists */
+  ssize_t lease_id = lq_find (&core->leaseq,
+                              (struct ether_addr *) msg->chaddr);
+  struct lease lease;
+  if (lease_id >= 0)
+    lq_get (&core->leaseq, lease_id, &lease);
+
+  /* Refuse if requested address doesn't match
+   * existing lease. */
+  in_addr_t in_addr = 0;
+  const char *nak_reason = NULL;
+  if (lease_id >= 0 && req_addr != 0 && lease.in_addr != req_addr) {
+    char req_str[INET_ADDRSTRLEN], lease_str[INET_ADDRSTRLEN];
+    log_info ("%s =/= %s", inet_str (req_addr, req_str),
+              inet_str (lease.in_addr, lease_str));
+    nak_reason = "The requested address does not match an existing lease";
+    msg_type = DHCP_MSG_TYPE_DHCPNAK;
+  } else if (lease_id >= 0) {
+    /* Remove existing lease */
+    in_addr = lease.in_addr;
+    lq_remove (&core->leaseq, lease_id);
+  }
+
+  uint32_t lease_time = lease_time_of (core, cls, now);
+
+  if (msg_type != DHCP_MSG_TYPE_DHCPNAK) {
+    /* Check if host is statically configured */
+    const struct static_conf *sconf =
+      core_find_static (core, (struct ether_addr *) msg->chaddr);
+    if (sconf)
+      lease_time = sconf->lease_time;
+
+    /* Refuse if requested address doesn't match
+     * static configuration */
+    if (sconf && req_addr != 0 && sconf->in_addr != req_addr) {
+      msg_type = DHCP_MSG_TYPE_DHCPNAK;
+      nak_reason = "The requested address does not match the static configuration of this host";
+    } else if (sconf) {
+      in_addr = sconf->in_addr;
+    }
+
+    /* No existsing lease and no static
+     * configuration -> refuse */
+    if (lease_id < 0 && sconf == NULL) {
+      msg_type = DHCP_MSG_TYPE_DHCPNAK;
+      nak_reason = "There is no existing lease or static configuration for this host";
+    }
+  }
+
+  /* Create new lease */
+  if (msg_type != DHCP_MSG_TYPE_DHCPNAK) {
+    lease.in_addr = in_addr;
+    memcpy (&lease.ether_addr, msg->chaddr, sizeof (lease.ether_addr));
+    lease.expire = now + lease_time;
+    lease.bound = 1;
+    lq_add (&core->leaseq, &lease);
+    record (core, HIST_BIND, in_addr, &lease.ether_addr, now, lease.expire);
+    reply->hostname_addr = in_addr;
+  }
+
+  /* Create reply */
+  struct dhcp_msg *rmsg = reply->msg;
+  memcpy (rmsg, msg, sizeof (*rmsg));
+
+  /* Set message fields */
+  rmsg->op = DHCP_OP_BOOTREPLY;
+  rmsg->hops = 0;
+  rmsg->secs = 0;
+  rmsg->siaddr = 0;
+
+  if (msg_type == DHCP_MSG_TYPE_DHCPACK)
+    rmsg->yiaddr = in_addr;
+  else
+    rmsg->yiaddr = 0;
+
+  memset (rmsg->file, 0, sizeof (rmsg->file));
+  memcpy (rmsg->sname, core->sname, sizeof (rmsg->sname) - 1);
+  if (msg_type == DHCP_MSG_TYPE_DHCPACK)
+    set_class_fields (rmsg, cls);
+
+  /* Set message options */
+  struct dhcp_opt opt;
+  it = dhcp_oit_init (rmsg);
+  dhcp_add_magic_cookie (&it);
+
+  /* Message type */
+  opt.tag = DHCP_OPT_DHCP_MESSAGE_TYPE;
+  opt.len = 1;
+  opt.buf[0] = msg_type;
+  dhcp_opt_add (&opt, &it);
+
+  /* Server address */
+  opt.tag = DHCP_OPT_SERVER_IDENTIFIER;
+  opt.len = 4;
+  memcpy (opt.buf, &core->server_addr, 4);
+  dhcp_opt_add (&opt, &it);
+
+  /* Subnet mask */
+  opt.tag = DHCP_OPT_SUBNET_MASK;
+  opt.len = 4;
+  memcpy (opt.buf, &core->iface->subnet_mask, 4);
+  dhcp_opt_add (&opt, &it);
+
+  /* Lease time (for DHCPACK) */
+  if (msg_type == DHCP_MSG_TYPE_DHCPACK) {
+    lease_time = htonl (lease_time);
+    opt.tag = DHCP_OPT_IP_ADDRESS_LEASE_TIME;
+    opt.len = 4;
+    memcpy (opt.buf, &lease_time, 4);
+    dhcp_opt_add (&opt, &it);
+  }
+
+  /* End of options */
+  opt.tag = DHCP_OPT_END_OPTION;
+  dhcp_opt_add (&opt, &it);
+
+  char addr_str[INET_ADDRSTRLEN];
+  log_info ("[%s] %s", dhcp_msg_type_str (msg_type),
+            msg_type == DHCP_MSG_TYPE_DHCPACK ?
+              inet_str (in_addr, addr_str) : nak_reason);
+  reply->type = msg_type;
+  broadcast (reply);
+}
+
+/* Extend the lease of a renewing or rebinding client in place.
+ * Returns -1 to leave the request to process_request. */
+static int
+process_renew (struct dhcp_core *core, const struct dhcp_msg *msg,
+               time_t now, struct core_class *cls,
+               struct core_reply *reply)
+{
+  struct ether_addr *ether = (struct ether_addr *) msg->chaddr;
+
+  /* Only handle clients renewing the lease they hold. An offer is
+   * bound the long way, through process_request. */
+  ssize_t lease_id = lq_find (&core->leaseq, ether);
+  if (lease_id < 0)
+    return -1;
+
+  struct lease lease;
+  lq_get (&core->leaseq, lease_id, &lease);
+  if (!lease.bound || lease.in_addr != msg->ciaddr)
+    return -1;
+
+  uint32_t lease_time = lease_time_of (core, cls, now);
+  const struct static_conf *sconf = core_find_static (core, ether);
+  if (sconf && sconf->in_addr != msg->ciaddr)
+    return -1;
+  if (sconf)
+    lease_time = sconf->lease_time;
+
+  lq_extend (&core->leaseq, lease_id, now + lease_time);
+  record (core, HIST_RENEW, lease.in_addr, ether, now, now + lease_time);
+  reply->hostname_addr = lease.in_addr;
+
+  /* Create reply */
+  struct dhcp_msg *rmsg = reply->msg;
+  memcpy (rmsg, msg, sizeof (*rmsg));
+
+  rmsg->op = DHCP_OP_BOOTREPLY;
+  rmsg->hops = 0;
+  rmsg->secs = 0;
+  rmsg->yiaddr = lease.in_addr;
+  rmsg->siaddr = 0;
+
+  memset (rmsg->file, 0, sizeof (rmsg->file));
+  memcpy (rmsg->sname, core->sname, sizeof (rmsg->sname) - 1);
+  set_class_fields (rmsg, cls);
+
+  struct dhcp_opt opt;
+  struct dhcp_oit it = dhcp_oit_init (rmsg);
+  dhcp_add_magic_cookie (&it);
+
+  opt.tag = DHCP_OPT_DHCP_MESSAGE_TYPE;
+  opt.len = 1;
+  opt.buf[0] = DHCP_MSG_TYPE_DHCPACK;
+  dhcp_opt_add (&opt, &it);
+
+  opt.tag = DHCP_OPT_SERVER_IDENTIFIER;
+  opt.len = 4;
+  memcpy (opt.buf, &core->server_addr, 4);
+  dhcp_opt_add (&opt, &it);
+
+  opt.tag = DHCP_OPT_SUBNET_MASK;
+  opt.len = 4;
+  memcpy (opt.buf, &core->iface->subnet_mask, 4);
+  dhcp_opt_add (&opt, &it);
+
+  lease_time = htonl (lease_time);
+  opt.tag = DHCP_OPT_IP_ADDRESS_LEASE_TIME;
+  opt.len = 4;
+  memcpy (opt.buf, &lease_time, 4);
+  dhcp_opt_add (&opt, &it);
+
+  opt.tag = DHCP_OPT_END_OPTION;
+  dhcp_opt_add (&opt, &it);
+
+  char addr_str[INET_ADDRSTRLEN];
+  log_info ("[%s] %s (renew)", dhcp_msg_type_str (DHCP_MSG_TYPE_DHCPACK),
+            inet_str (lease.in_addr, addr_str));
+  reply->type = DHCP_MSG_TYPE_DHCPACK;
+
+  /* The client can receive unicast at its address */
+  reply->addr.sin_family = AF_INET;
+  reply->addr.sin_port = htons (DHCP_PORT_CLIENT);
+  reply->addr.sin_addr.s_addr = msg->ciaddr;
+
+  return 0;
+}
+
+/* Convert an in_addr_t in to a string in buf, of INET_ADDRSTRLEN
+ * bytes */
+static char *
+inet_str (in_addr_t in_addr, char *buf)
+{
+  struct in_addr addr = { .s_addr = in_addr };
+  inet_ntop (AF_INET, &addr, buf, INET_ADDRSTRLEN);
+  return buf;
+}
@@ -0,0 +1,143 @@
+#ifndef CORE_H_INCLUDED
+#define CORE_H_INCLUDED
+
+/* Protocol engine
+ *
+ * Everything the server decides about a message lives here, apart
+ * from any socket: the context holds the address pool and the lease
+ * table of one interface, and handling a message only returns the
+ * reply and where to send it, together with the side effects that
+ * are left to the caller. Time is passed in, nothing reads the
+ * clock. The server drives it from its event loop, and the same
+ * engine runs in memory in the simulator and in benchmarks.
+ *
+ * Built as libdhcpcore.a.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/ether.h>
+
+#include "dhcp.h"
+#include "conf.h"
+#include "addr_space.h"
+#include "lease_queue.h"
+#include "probe.h"
+#include "affinity.h"
+#include "rcache.h"
+#include "adaptive.h"
+#include "loadbal.h"
+#include "classify.h"
+#include "history.h"
+#include "macfilter.h"
+#include "reserv.h"
+
+/* Pool of a client class */
+struct core_class {
+  const struct class_conf *conf;
+  struct addr_space aspace;
+};
+
+struct dhcp_core {
+  /* Server configuration and that of the interface */
+  const struct conf *conf;
+  const struct iface_conf *iface;
+
+  /* Address of the interface, used as server identifier */
+  in_addr_t server_addr;
+
+  /* Host name put in the sname field of replies */
+  char sname[64];
+
+  /* Load balancing buckets, NULL to serve every client */
+  struct lb *lb;
+
+  /* Conflict prober to take addresses from, NULL if none */
+  struct prober *prober;
+
+  /* Lease history to record bindings in, NULL if none */
+  struct history *history;
+
+  /* Hardware address access lists, NULL to serve every client */
+  struct mac_acl *acl;
+
+  /* Reservations to look static hosts up in, NULL to use those of
+   * the configuration */
+  struct reserv *reserv;
+
+  /* Dynamic address pool */
+  struct addr_space aspace;
+
+  /* Active leases */
+  struct lease_queue leaseq;
+
+  /* Expired bindings */
+  struct affinity affinity;
+
+  /* Replies to recent messages */
+  struct rcache rcache;
+
+  /* Lease time of the dynamic pool */
+  struct adaptive adaptive;
+
+  /* Classes of the interface, in the order they are defined,
+   * and the rules that put clients in them */
+  struct core_class *classes;
+  size_t nclasses;
+  struct classifier classifier;
+};
+
+/* Outcome of handling a message */
+struct core_reply {
+  /* Message type of the reply, 0 if there is none */
+  uint8_t type;
+
+  /* The reply was sent before, to a retransmission */
+  int cached;
+
+  /* Reply, built where the caller points msg, and its
+   * destination */
+  struct dhcp_msg *msg;
+  struct sockaddr_in addr;
+
+  /* Host name to register in DNS for addr, empty if none */
+  char hostname[DHCP_OPT_MAXLEN + 1];
+  in_addr_t hostname_addr;
+};
+
+/* Initialize engine of an interface at monotonic time now (ms) */
+int core_init (struct dhcp_core *core, const struct conf *conf,
+               const struct iface_conf *ic, in_addr_t server_addr,
+               const char *sname, int64_t now);
+
+/* Dispose of engine */
+void core_deinit (struct dhcp_core *core);
+
+/* Handle a message of len bytes received at monotonic time now (ms).
+ * The message is read as a whole struct dhcp_msg, zero padded past
+ * len. Any reply is built in reply->msg, which must not overlap
+ * msg. Returns 1 if reply holds a message to send, 0 otherwise. */
+int core_handle (struct dhcp_core *core, const struct dhcp_msg *msg,
+                 size_t len, int64_t now, struct core_reply *reply);
+
+/* Remove leases expired at monotonic time now (s) */
+void core_expire (struct dhcp_core *core, time_t now);
+
+/* Monotonic time (ms) of the next lease expiration, -1 if none */
+int64_t core_deadline (struct dhcp_core *core);
+
+/* Find the static configuration of a host on this interface */
+const struct static_conf *core_find_static (struct dhcp_core *core,
+                                            const struct ether_addr *ether);
+
+/* Whether an address is in a dynamic pool of the interface */
+int core_in_pool (const struct dhcp_core *core, in_addr_t addr);
+
+/* End the lease of a host at monotonic time now (s), unless it is
+ * on address keep */
+void core_revoke (struct dhcp_core *core, const struct ether_addr *ether,
+                  in_addr_t keep, time_t now);
+
+#endif
@@ -0,0 +1,338 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "ddns.h"
+#include "clock.h"
+#include "log.h"
+
+/* Send without waiting for the delay once this many records
+ * are queued */
+static const size_t batch_records = 32;
+
+/* Retransmission timeout, doubled for every retry */
+static const int64_t retry_timeout = 1000;
+static const int max_tries = 5;
+
+enum {
+  DNS_OPCODE_UPDATE = 5,
+  DNS_TYPE_A = 1,
+  DNS_TYPE_SOA = 6,
+  DNS_TYPE_OPT = 41,
+  DNS_CLASS_IN = 1,
+  DNS_CLASS_ANY = 255,
+  DNS_HEADER_SIZE = 12,
+  DNS_OPT_SIZE = 11,
+};
+
+static uint8_t *
+put16 (uint8_t *p, uint16_t x)
+{
+  x = htons (x);
+  memcpy (p, &x, 2);
+  return p + 2;
+}
+
+static uint8_t *
+put32 (uint8_t *p, uint32_t x)
+{
+  x = htonl (x);
+  memcpy (p, &x, 4);
+  return p + 4;
+}
+
+/* Convert a dotted name to wire format */
+static int
+encode_name (const char *name, uint8_t *buf, size_t size, size_t *len)
+{
+  size_t n = 0;
+
+  while (*name) {
+    const char *dot = strchr (name, '.');
+    size_t label = dot ? (size_t) (dot - name) : strlen (name);
+
+    if (label == 0 || label > DDNS_MAX_LABEL || n + label + 2 > size)
+      return -1;
+
+    buf[n++] = label;
+    memcpy (buf + n, name, label);
+    n += label;
+    name += label;
+    if (*name == '.')
+      name++;
+  }
+
+  buf[n++] = 0;
+  *len = n;
+  return 0;
+}
+
+/* Encode queued records into an update, returns the number
+ * of records encoded */
+static size_t
+ddns_encode (struct ddns *dd, struct ddns_update *up)
+{
+  uint8_t *p = up->buf;
+
+  p = put16 (p, up->id);
+  p = put16 (p, DNS_OPCODE_UPDATE << 11);
+  p = put16 (p, 1);           /* zones */
+  p = put16 (p, 0);           /* prerequisites */
+  p = put16 (p, 0);           /* updates, filled in below */
+  p = put16 (p, 1);           /* additional, the OPT record */
+
+  memcpy (p, dd->zone, dd->zone_len);
+  p += dd->zone_len;
+  p = put16 (p, DNS_TYPE_SOA);
+  p = put16 (p, DNS_CLASS_IN);
+
+  size_t n = 0;
+  while (n < dd->queue_len) {
+    struct ddns_record *rec =
+      &dd->queue[(dd->queue_head + n) % DDNS_QUEUE_SIZE];
+    size_t label = strlen (rec->label);
+    size_t used = p - up->buf;
+
+    if (used + label + 29 + DNS_OPT_SIZE > sizeof (up->buf))
+      break;
+
+    /* Delete the existing A records of the name... */
+    size_t name_off = used;
+    *p++ = label;
+    memcpy (p, rec->label, label);
+    p += label;
+    p = put16 (p, 0xc000 | DNS_HEADER_SIZE);
+    p = put16 (p, DNS_TYPE_A);
+    p = put16 (p, DNS_CLASS_ANY);
+    p = put32 (p, 0);
+    p = put16 (p, 0);
+
+    /* ...and add the new one */
+    p = put16 (p, 0xc000 | name_off);
+    p = put16 (p, DNS_TYPE_A);
+    p = put16 (p, DNS_CLASS_IN);
+    p = put32 (p, dd->ttl);
+    p = put16 (p, 4);
+    memcpy (p, &rec->in_addr, 4);
+    p += 4;
+
+    n++;
+  }
+
+  /* EDNS OPT record, allows responses larger than 512 bytes */
+  *p++ = 0;
+  p = put16 (p, DNS_TYPE_OPT);
+  p = put16 (p, DDNS_MSG_SIZE);
+  p = put32 (p, 0);
+  p = put16 (p, 0);
+
+  put16 (up->buf + 8, 2 * n);
+  up->len = p - up->buf;
+  up->nrecords = n;
+
+  return n;
+}
+
+static void
+ddns_send (struct ddns *dd, struct ddns_update *up)
+{
+  up->tries++;
+  up->deadline = clock_ms () + (retry_timeout << (up->tries - 1));
+
+  if (send (dd->sockfd, up->buf, up->len, MSG_DONTWAIT) < 0)
+    log_errno ("Failed to send DNS update");
+}
+
+int
+ddns_init (struct ddns *dd, in_addr_t server, uint16_t port,
+           const char *zone, uint32_t ttl, int64_t delay)
+{
+  memset (dd, 0, sizeof (*dd));
+  dd->sockfd = -1;
+
+  if (server == 0)
+    return 0;
+
+  if (zone == NULL
+      || encode_name (zone, dd->zone, sizeof (dd->zone), &dd->zone_len) < 0) {
+    log_error ("Invalid or missing DNS update zone");
+    return -1;
+  }
+
+  if ((dd->sockfd = socket (AF_INET, SOCK_DGRAM, 0)) < 0) {
+    log_errno ("Failed to open DNS update socket");
+    return -1;
+  }
+
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port = htons (port),
+    .sin_addr.s_addr = server,
+  };
+
+  if (connect (dd->sockfd, (struct sockaddr *) &addr, sizeof (addr)) < 0) {
+    log_errno ("Failed to connect DNS update socket");
+    close (dd->sockfd);
+    dd->sockfd = -1;
+    return -1;
+  }
+
+  dd->ttl = ttl;
+  dd->delay = delay;
+  dd->next_id = getpid ();
+
+  return 0;
+}
+
+void
+ddns_add (struct ddns *dd, const char *hostname, in_addr_t addr)
+{
+  if (dd->sockfd < 0)
+    return;
+
+  if (dd->queue_len == DDNS_QUEUE_SIZE) {
+    dd->ndropped++;
+    return;
+  }
+
+  struct ddns_record *rec =
+    &dd->queue[(dd->queue_head + dd->queue_len) % DDNS_QUEUE_SIZE];
+
+  /* First label of the host name, reduced to valid characters */
+  size_t n = 0;
+  for (const char *c = hostname; *c && *c != '.' && n < DDNS_MAX_LABEL; c++)
+    if (isalnum ((unsigned char) *c) || *c == '-')
+      rec->label[n++] = tolower ((unsigned char) *c);
+  rec->label[n] = '\0';
+
+  if (n == 0)
+    return;
+
+  rec->in_addr = addr;
+  rec->queued_at = clock_ms ();
+
+  if (dd->queue_len == 0)
+    dd->queued_at = rec->queued_at;
+  dd->queue_len++;
+}
+
+void
+ddns_recv (struct ddns *dd)
+{
+  uint8_t buf[DDNS_MSG_SIZE];
+  ssize_t len;
+
+  while ((len = recv (dd->sockfd, buf, sizeof (buf), MSG_DONTWAIT)) > 0) {
+    if (len < DNS_HEADER_SIZE)
+      continue;
+
+    uint16_t id = (buf[0] << 8) | buf[1];
+    int rcode = buf[3] & 0xf;
+
+    for (int i = 0; i < DDNS_MAX_INFLIGHT; i++) {
+      struct ddns_update *up = &dd->inflight[i];
+      if (up->id != id || up->tries == 0)
+        continue;
+
+      if (rcode == 0) {
+        dd->nregistered += up->nrecords;
+      } else {
+        log_error ("DNS update of %zu records refused, rcode %d",
+                   up->nrecords, rcode);
+        dd->ndropped += up->nrecords;
+      }
+
+      up->tries = 0;
+      break;
+    }
+  }
+
+  if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    log_errno ("Failed to receive DNS update response");
+}
+
+void
+ddns_flush (struct ddns *dd)
+{
+  if (dd->sockfd < 0)
+    return;
+
+  int64_t now = clock_ms ();
+
+  for (int i = 0; i < DDNS_MAX_INFLIGHT; i++) {
+    struct ddns_update *up = &dd->inflight[i];
+    if (up->tries == 0 || up->deadline > now)
+      continue;
+
+    if (up->tries == max_tries) {
+      log_error ("DNS update of %zu records timed out", up->nrecords);
+      dd->ndropped += up->nrecords;
+      up->tries = 0;
+      continue;
+    }
+
+    ddns_send (dd, up);
+  }
+
+  while (dd->queue_len > 0
+         && (dd->queue_len >= batch_records
+             || now - dd->queued_at >= dd->delay)) {
+    struct ddns_update *up = NULL;
+    for (int i = 0; i < DDNS_MAX_INFLIGHT; i++)
+      if (dd->inflight[i].tries == 0) {
+        up = &dd->inflight[i];
+        break;
+      }
+
+    /* Wait for responses before sending more */
+    if (up == NULL)
+      break;
+
+    up->id = dd->next_id++;
+    size_t n = ddns_encode (dd, up);
+    dd->queue_head = (dd->queue_head + n) % DDNS_QUEUE_SIZE;
+    dd->queue_len -= n;
+    if (dd->queue_len > 0)
+      dd->queued_at = dd->queue[dd->queue_head].queued_at;
+    dd->nmessages++;
+
+    ddns_send (dd, up);
+  }
+}
+
+int64_t
+ddns_deadline (struct ddns *dd)
+{
+  int64_t deadline = -1;
+  int have_free = 0;
+
+  if (dd->sockfd < 0)
+    return -1;
+
+  for (int i = 0; i < DDNS_MAX_INFLIGHT; i++) {
+    struct ddns_update *up = &dd->inflight[i];
+    if (up->tries == 0)
+      have_free = 1;
+    else if (deadline < 0 || up->deadline < deadline)
+      deadline = up->deadline;
+  }
+
+  /* Queued records can only be sent when an update is free */
+  if (dd->queue_len > 0 && have_free
+      && (deadline < 0 || dd->queued_at + dd->delay < deadline))
+    deadline = dd->queued_at + dd->delay;
+
+  return deadline;
+}
+
+void
+ddns_deinit (struct ddns *dd)
+{
+  if (dd->sockfd >= 0)
+    close (dd->sockfd);
+}
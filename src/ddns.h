@@ -0,0 +1,105 @@
+#ifndef DDNS_H_INCLUDED
+#define DDNS_H_INCLUDED
+
+/* Dynamic DNS updates
+ * https://www.rfc-editor.org/rfc/rfc2136
+ *
+ * Host names of acknowledged clients are queued and registered as A
+ * records in the configured zone. Queued names are coalesced into
+ * UPDATE messages that each carry many records, which are sent from
+ * the event loop after a short delay and retried with exponential
+ * backoff until the server answers.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#define DDNS_MAX_LABEL 63
+#define DDNS_QUEUE_SIZE 4096
+#define DDNS_MAX_INFLIGHT 8
+#define DDNS_MSG_SIZE 1232
+
+struct ddns_record {
+  /* Host label, NUL terminated */
+  char label[DDNS_MAX_LABEL + 1];
+
+  /* Address to register */
+  in_addr_t in_addr;
+
+  /* Monotonic time (ms) at which the record was queued */
+  int64_t queued_at;
+};
+
+struct ddns_update {
+  /* Message id, 0 if unused */
+  uint16_t id;
+
+  /* Encoded message */
+  uint8_t buf[DDNS_MSG_SIZE];
+  size_t len;
+
+  /* Number of records in the message */
+  size_t nrecords;
+
+  /* Number of transmissions so far */
+  int tries;
+
+  /* Monotonic time (ms) of next retransmission */
+  int64_t deadline;
+};
+
+struct ddns {
+  /* UDP socket connected to the DNS server, -1 if disabled */
+  int sockfd;
+
+  /* Zone name in wire format */
+  uint8_t zone[256];
+  size_t zone_len;
+
+  /* TTL of registered records */
+  uint32_t ttl;
+
+  /* Time (ms) to wait for more records before sending */
+  int64_t delay;
+
+  /* Queue of records not yet sent */
+  struct ddns_record queue[DDNS_QUEUE_SIZE];
+  size_t queue_head;
+  size_t queue_len;
+
+  /* Monotonic time (ms) at which the oldest queued record
+   * was added */
+  int64_t queued_at;
+
+  /* Updates waiting for a response */
+  struct ddns_update inflight[DDNS_MAX_INFLIGHT];
+
+  uint16_t next_id;
+
+  /* Counters */
+  size_t nregistered;
+  size_t nmessages;
+  size_t ndropped;
+};
+
+/* Initialize, a zero server address disables updates */
+int ddns_init (struct ddns *dd, in_addr_t server, uint16_t port,
+               const char *zone, uint32_t ttl, int64_t delay);
+
+/* Queue registration of a host name */
+void ddns_add (struct ddns *dd, const char *hostname, in_addr_t addr);
+
+/* Read responses */
+void ddns_recv (struct ddns *dd);
+
+/* Send queued records and retransmit unanswered updates */
+void ddns_flush (struct ddns *dd);
+
+/* Monotonic time (ms) at which ddns_flush has work, -1 if none */
+int64_t ddns_deadline (struct ddns *dd);
+
+/* Dispose of update state */
+void ddns_deinit (struct ddns *dd);
+
+#endif
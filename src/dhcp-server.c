@@ -1,64 +1,147 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
-#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
 
 #include <unistd.h>
-#include <ifaddrs.h>
-#include <sys/poll.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
 #include "dhcp.h"
 #include "dhcp-server.h"
+#include "clock.h"
 #include "log.h"
 
-#ifdef DHCP_SERVER_DEBUG
-#define debug(...) log_info("[DEBUG] " __VA_ARGS__)
-#else
-#define debug(...)
-#endif
-
 struct conf g_conf;
-struct lease_queue g_leaseq;
-struct addr_space g_aspace;
-int g_sockfd;
-in_addr_t g_server_addr;
+struct iface g_ifaces[CONF_MAX_IFACES];
+size_t g_nifaces;
+struct lb g_lb;
+struct bulkquery g_bulkquery;
+struct ddns g_ddns;
+struct history g_history;
+struct mac_acl g_acl;
+struct reserv g_reserv;
+struct control g_control;
 char g_hostname[HOST_NAME_MAX];
 
-static const int poll_timeout = 1 * 1000;
-static struct sockaddr_in client_addr;
-
-static int get_servaddr (void);
-static char *inet_str (in_addr_t in_addr);
-static void process_discover (struct dhcp_msg *msg);
-static void process_request (struct dhcp_msg *msg);
-static void process_release (struct dhcp_msg *msg);
-static void process_decline (struct dhcp_msg *msg);
+/* Kinds of descriptors in the event loop. Events carry the kind in
+ * the upper and an index in the lower half of their data. */
+enum {
+  EV_SERVER,
+  EV_PROBE,
+  EV_TIMER,
+  EV_DDNS,
+  EV_BULKQUERY,
+  EV_XDP,
+  EV_CONTROL,
+};
+
+#define EV_TAG(kind, index) ((uint64_t) (kind) << 32 | (index))
+#define EV_MAX 64
+
+/* Delay before sending DNS updates, to let more records queue up */
+static const int64_t ddns_delay = 100;
+
+/* Delay before writing lease history, to fill blocks */
+static const int64_t history_delay = 60000;
+
+/* Time (ms) to keep spinning after the last message when busy
+ * polling, before going back to sleep */
+static const int64_t busy_idle = 50;
+
+/* Stack touched up front when busy polling */
+#define PREFAULT_STACK (64 * 1024)
+
+static const char *conf_path = "./dhcp-server.conf";
+static volatile sig_atomic_t dump_requested;
+static volatile sig_atomic_t reload_requested;
+
+static int watch (int epfd, int fd, uint32_t events, uint64_t tag);
+static int arm_timer (int timerfd, int64_t deadline);
+static void min_deadline (int64_t *deadline, int64_t other);
+static void configure_lb (const struct conf *conf);
+static int configure_acl (const struct conf *conf);
+static void reload (void);
+static void dump_stats (void);
+static void on_sigusr1 (int sig);
+static void on_sighup (int sig);
+static void prefault_stack (void);
+static size_t process_messages (struct iface *ifc);
+static void process_message (struct iface *ifc, struct dhcp_msg *msg,
+                             size_t len, struct msghdr *mh);
+static size_t process_xdp (struct iface *ifc);
 
 int
 main (int argc, char **argv)
 {
-  const char *conf_path = "./dhcp-server.conf";
-  struct pollfd pollfd;
-  struct sockaddr_in sockaddr;
-  int en_broadcast = 1;
-
-  /* Default configuration */
-  g_conf.subnet_mask = htonl (0xffffff00); /* 255.255.255.0 */
-  g_conf.interface = "eth0";
-  g_conf.lease_time = 24 * 3600;           /* 24h */
-  g_conf.range_lo = htonl (0xc0a8001);     /* 192.168.0.1 */
-  g_conf.range_hi = htonl (0xc0a80fe);     /* 192.168.0.254 */
-  g_conf.request_window = 1;               /* 1s */
+  struct epoll_event events[EV_MAX];
+  struct lease_queue *leaseqs[CONF_MAX_IFACES];
+  struct dhcp_core *cores[CONF_MAX_IFACES];
+  int epfd, timerfd;
+  int64_t armed = -1;
+  int64_t last_rx = -1;
+
+  int compile = 0;
+  if (argc > 1 && strcmp (argv[1], "--compile") == 0) {
+    compile = 1;
+    argc--;
+    argv++;
+  }
 
   if (argc > 1)
     conf_path = argv[1];
 
-  if (conf_parse (conf_path, &g_conf) < 0)
-    exit (EXIT_FAILURE);
+  char image_path[PATH_MAX];
+  snprintf (image_path, sizeof (image_path), "%s.bin", conf_path);
 
-  if (get_servaddr () < 0)
+  /* Validate the configuration and write a binary image of it */
+  if (compile) {
+    conf_defaults (&g_conf);
+    if (conf_parse (conf_path, &g_conf) < 0
+        || conf_compile (&g_conf, conf_path, image_path) < 0)
+      exit (EXIT_FAILURE);
+    log_info ("Compiled %s to %s (%zu static hosts)",
+              conf_path, image_path, g_conf.nstatic_confs);
+    exit (EXIT_SUCCESS);
+  }
+
+  /* Prefer an up to date binary image over parsing the source */
+  if (conf_load_image (image_path, conf_path, &g_conf) < 0) {
+    conf_defaults (&g_conf);
+    if (conf_parse (conf_path, &g_conf) < 0)
+      exit (EXIT_FAILURE);
+  }
+
+  /* Each cooperating server hands out its own slice of every range */
+  for (size_t i = 0; g_conf.lb_count > 0 && i < g_conf.nifaces; i++) {
+    struct iface_conf *ic = &g_conf.ifaces[i];
+    lb_split_range (g_conf.lb_index, g_conf.lb_count,
+                    &ic->range_lo, &ic->range_hi);
+    if (ntohl (ic->range_lo) > ntohl (ic->range_hi)) {
+      log_error ("Range of %s is too small to split between %d servers",
+                 ic->name, g_conf.lb_count);
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (size_t i = 0; g_conf.lb_count > 0 && i < g_conf.nclasses; i++) {
+    struct class_conf *cc = &g_conf.classes[i];
+    lb_split_range (g_conf.lb_index, g_conf.lb_count,
+                    &cc->range_lo, &cc->range_hi);
+    if (ntohl (cc->range_lo) > ntohl (cc->range_hi)) {
+      log_error ("Range of class %s is too small to split between %d servers",
+                 cc->name, g_conf.lb_count);
+      exit (EXIT_FAILURE);
+    }
+  }
+  configure_lb (&g_conf);
+  if (configure_acl (&g_conf) < 0)
     exit (EXIT_FAILURE);
 
   if (gethostname (g_hostname, sizeof (g_hostname))) {
@@ -66,426 +149,506 @@ main (int argc, char **argv)
     exit (EXIT_FAILURE);
   }
 
-  as_init (&g_aspace, g_conf.range_lo, g_conf.range_hi);
-  lq_init (&g_leaseq);
-
-  if ((g_sockfd = socket (AF_INET, SOCK_DGRAM, 0)) < 0) {
-    log_errno ("Failed to open socket");
+  if ((epfd = epoll_create1 (EPOLL_CLOEXEC)) < 0) {
+    log_errno ("Failed to create event loop");
     exit (EXIT_FAILURE);
   }
 
-  pollfd.fd = g_sockfd;
-  pollfd.events = POLLIN;
+  clock_update ();
+  for (size_t i = 0; i < g_conf.nifaces; i++) {
+    struct iface *ifc = &g_ifaces[i];
 
-  /* Bind socket to configured device */
-  if (setsockopt (g_sockfd, SOL_SOCKET, SO_BINDTODEVICE,
-                  g_conf.interface, strlen (g_conf.interface)) < 0) {
-    log_errno ("Failed to bind socket to device %s", g_conf.interface);
-    exit (EXIT_FAILURE);
+    if (iface_open (ifc, &g_conf.ifaces[i], &g_conf, g_hostname) < 0)
+      exit (EXIT_FAILURE);
+    g_nifaces++;
+    leaseqs[i] = &ifc->core.leaseq;
+    cores[i] = &ifc->core;
+    ifc->core.lb = &g_lb;
+    ifc->core.acl = &g_acl;
+
+    /* Errors signal transmit timestamps on the error queue */
+    if (watch (epfd, ifc->sockfd, EPOLLIN | EPOLLERR,
+               EV_TAG (EV_SERVER, i)) < 0
+        || watch (epfd, ifc->prober.sockfd, EPOLLIN,
+                  EV_TAG (EV_PROBE, i)) < 0)
+      exit (EXIT_FAILURE);
+
+    if (ifc->xdp.fd >= 0
+        && watch (epfd, ifc->xdp.fd, EPOLLIN, EV_TAG (EV_XDP, i)) < 0)
+      exit (EXIT_FAILURE);
   }
 
-  /* Enabled broadcasting */
-  if (setsockopt (g_sockfd, SOL_SOCKET, SO_BROADCAST,
-                  &en_broadcast, sizeof (en_broadcast)) < 0) {
-    log_errno ("Failed to enable broadcasting");
+  /* Wakes the loop at the next lease or probe deadline */
+  if ((timerfd = timerfd_create (CLOCK_MONOTONIC,
+                                 TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+    log_errno ("Failed to create timer");
     exit (EXIT_FAILURE);
   }
 
-  sockaddr.sin_family = AF_INET;
-  sockaddr.sin_port = htons (DHCP_PORT_SERVER);
-  sockaddr.sin_addr.s_addr = INADDR_ANY;
+  if (ddns_init (&g_ddns, g_conf.ddns_server, g_conf.ddns_port,
+                 g_conf.ddns_zone, g_conf.ddns_ttl, ddns_delay) < 0)
+    exit (EXIT_FAILURE);
 
-  client_addr.sin_addr.s_addr = INADDR_BROADCAST;
-  client_addr.sin_port = htons (DHCP_PORT_CLIENT);
-  client_addr.sin_family = AF_INET;
+  if (hist_init (&g_history, g_conf.history_dir, history_delay) < 0)
+    exit (EXIT_FAILURE);
+  for (size_t i = 0; g_conf.history_dir && i < g_nifaces; i++)
+    g_ifaces[i].core.history = &g_history;
+
+  if (watch (epfd, timerfd, EPOLLIN, EV_TAG (EV_TIMER, 0)) < 0
+      || watch (epfd, g_ddns.sockfd, EPOLLIN, EV_TAG (EV_DDNS, 0)) < 0)
+    exit (EXIT_FAILURE);
 
-  if (bind (g_sockfd, (struct sockaddr*) &sockaddr, sizeof (sockaddr)) < 0) {
-    log_errno ("Failed to bind socket");
+  if (bq_init (&g_bulkquery, g_conf.leasequery_socket, g_nifaces, epfd,
+               EV_TAG (EV_BULKQUERY, 0)) < 0)
     exit (EXIT_FAILURE);
+
+  /* Reservations take over from the static hosts of the
+   * configuration once they can change at runtime */
+  if (g_conf.reservation_socket || g_conf.reservation_journal) {
+    if (rv_init (&g_reserv, &g_conf, CTL_MAX_BATCH) < 0)
+      exit (EXIT_FAILURE);
+    for (size_t i = 0; i < g_nifaces; i++)
+      g_ifaces[i].core.reserv = &g_reserv;
   }
 
-  for (;;) {
-    int ready = poll (&pollfd, 1, poll_timeout);
+  if (ctl_init (&g_control, &g_conf, &g_reserv, cores, g_nifaces, epfd,
+                EV_TAG (EV_CONTROL, 0)) < 0)
+    exit (EXIT_FAILURE);
 
-    if (ready < 0) {
-      log_errno ("poll()");
+  /* Dump statistics on SIGUSR1 */
+  struct sigaction sa;
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = on_sigusr1;
+  sigaction (SIGUSR1, &sa, NULL);
+
+  /* Reload load balancing buckets and access lists on SIGHUP */
+  sa.sa_handler = on_sighup;
+  sigaction (SIGHUP, &sa, NULL);
+
+  if (g_conf.cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO (&set);
+    CPU_SET (g_conf.cpu, &set);
+    if (sched_setaffinity (0, sizeof (set), &set) < 0) {
+      log_errno ("Failed to pin to CPU %d", g_conf.cpu);
       exit (EXIT_FAILURE);
     }
+  }
 
-    /* Check for expired leases */
-    time_t now = time (NULL);
-    while (g_leaseq.nleases > 0 && now > g_leaseq.leases[0].expire) {
-      log_info ("expire %s -> %s", ether_ntoa (&g_leaseq.leases[0].ether_addr),
-                inet_str (g_leaseq.leases[0].in_addr));
-      as_free (&g_aspace, g_leaseq.leases[0].in_addr);
-      lq_pop (&g_leaseq);
+  /* Keep the lease tables and everything else the loop touches
+   * resident, so that no reply waits for a page fault */
+  if (g_conf.busy_poll > 0) {
+    if (mlockall (MCL_CURRENT | MCL_FUTURE) < 0)
+      log_errno ("Failed to lock memory");
+    prefault_stack ();
+  }
+
+  for (;;) {
+    /* Sleep until the next deadline, or indefinitely */
+    int64_t deadline = ddns_deadline (&g_ddns);
+    min_deadline (&deadline, hist_deadline (&g_history));
+    for (size_t i = 0; i < g_nifaces; i++)
+      min_deadline (&deadline, iface_deadline (&g_ifaces[i]));
+
+    if (deadline != armed) {
+      if (arm_timer (timerfd, deadline) < 0)
+        exit (EXIT_FAILURE);
+      armed = deadline;
     }
 
-    if (ready == 0)
-      continue;
+    /* Spin while messages keep arriving when busy polling */
+    int timeout = -1;
+    if (g_conf.busy_poll > 0 && last_rx >= 0
+        && clock_ms () - last_rx < busy_idle)
+      timeout = 0;
 
-    /* Read message */
-    struct dhcp_msg msg;
-    memset (&msg, 0, sizeof (msg));
-    if (recvfrom (g_sockfd, &msg, sizeof (msg), 0, NULL, NULL) < 0) {
-      log_errno ("recvfrom()");
-      continue;
+    int ready = epoll_wait (epfd, events, EV_MAX, timeout);
+
+    if (ready < 0 && errno != EINTR) {
+      log_errno ("epoll_wait()");
+      exit (EXIT_FAILURE);
     }
 
-    if (msg.hlen != ETHER_ADDR_LEN)
-      continue;
+    if (dump_requested) {
+      dump_requested = 0;
+      dump_stats ();
+    }
 
-    struct dhcp_oit it = dhcp_oit_init(&msg);
-    struct dhcp_opt opt;
+    if (reload_requested) {
+      reload_requested = 0;
+      reload ();
+    }
 
-    if (dhcp_eat_magic_cookie (&it) < 0) {
-      log_error ("Failed to parse message: missing or invalid magic cookie");
+    if (ready < 0)
       continue;
-    }
 
-    char *hostname = NULL;
-    int have_msg_type = 0;
-    enum dhcp_msg_type type;
-    while (!it.done) {
-      if (dhcp_opt_take (&opt, &it) < 0) {
-        log_error ("Error while parsing options");
+    clock_update ();
+    time_t now = clock_now ();
+
+    /* Check for expired leases */
+    for (size_t i = 0; i < g_nifaces; i++)
+      core_expire (&g_ifaces[i].core, now);
+
+    for (int i = 0; i < ready; i++) {
+      uint32_t kind = events[i].data.u64 >> 32;
+      uint32_t index = events[i].data.u64 & 0xffffffff;
+      struct iface *ifc = &g_ifaces[index];
+
+      switch (kind) {
+      case EV_TIMER: {
+        uint64_t expirations;
+        read (timerfd, &expirations, sizeof (expirations));
+        armed = -1;
         break;
       }
-
-      if (opt.tag == DHCP_OPT_DHCP_MESSAGE_TYPE) {
-        have_msg_type = 1;
-        type = opt.buf[0];
+      case EV_PROBE:
+        probe_recv (&ifc->prober, &ifc->core.leaseq,
+                    now + ifc->conf->lease_time);
+        break;
+      case EV_DDNS:
+        ddns_recv (&g_ddns);
+        break;
+      case EV_BULKQUERY:
+        /* Stream a chunk of any bulk lease query in progress */
+        bq_event (&g_bulkquery, index, events[i].events,
+                  leaseqs, g_nifaces);
+        break;
+      case EV_CONTROL:
+        /* Apply reservation changes between rounds of messages */
+        ctl_event (&g_control, index, events[i].events, cores, g_nifaces);
+        break;
+      case EV_SERVER:
+        /* Transmit timestamps arrive on the error queue */
+        if (events[i].events & EPOLLERR)
+          trace_errqueue (&ifc->trace);
+        if (events[i].events & EPOLLIN && process_messages (ifc) > 0)
+          last_rx = clock_ms ();
+        break;
+      case EV_XDP:
+        if (process_xdp (ifc) > 0)
+          last_rx = clock_ms ();
+        break;
       }
-
-      if (opt.tag == DHCP_OPT_HOST_NAME_OPTION)
-        hostname = strndup ((char *) opt.buf, opt.len);
     }
 
-    if (!have_msg_type)
-      continue;
+    /* Receive straight from the sockets while spinning, each empty
+     * receive polls the device once more */
+    for (size_t i = 0; timeout == 0 && i < g_nifaces; i++) {
+      if (process_messages (&g_ifaces[i]) > 0)
+        last_rx = clock_ms ();
+      if (g_ifaces[i].xdp.fd >= 0 && process_xdp (&g_ifaces[i]) > 0)
+        last_rx = clock_ms ();
+    }
 
-    log_info ("[%s] %s (%s)", dhcp_msg_type_str (type),
-              ether_ntoa ((struct ether_addr *) msg.chaddr),
-              hostname ? hostname : "<unknown>");
-    free (hostname);
-
-    switch (type) {
-    case DHCP_MSG_TYPE_DHCPDISCOVER:
-      process_discover(&msg);
-      break;
-    case DHCP_MSG_TYPE_DHCPREQUEST:
-      process_request(&msg);
-      break;
-    // case DHCP_MSG_TYPE_DHCPRELEASE:
-    //   process_release(&msg);
-    //   break;
-    // case DHCP_MSG_TYPE_DHCPDECLINE:
-    //   process_decline(&msg);
-    //   break;
-    default:
-      debug ("Unhandled message type %s", dhcp_msg_type_str (type));
-      break;
+    /* Keep conflict probes running ahead of demand */
+    for (size_t i = 0; i < g_nifaces; i++) {
+      probe_expire (&g_ifaces[i].prober);
+      probe_fill (&g_ifaces[i].prober, &g_ifaces[i].core.aspace);
     }
+
+    /* Send DNS updates queued by this and earlier iterations */
+    ddns_flush (&g_ddns);
+
+    /* Write out lease history */
+    hist_flush (&g_history);
   }
 }
 
-static void
-process_discover (struct dhcp_msg *msg)
+/* Read and handle messages received on an interface, returns the
+ * number of messages read */
+static size_t
+process_messages (struct iface *ifc)
 {
-  time_t now = time (NULL);
-
-  /* Ignore if lease exists */
-  for (int i = 0; i < g_leaseq.nleases; i++) {
-    struct ether_addr *ether = &g_leaseq.leases[i].ether_addr;
-    if (memcmp (ether, msg->chaddr, sizeof (*ether)) == 0) {
-      debug ("Lease exists");
-      return;
-    }
-  }
+  static struct ol_batch batch;
+  struct overload *ol = &ifc->overload;
+
+  ol_update (ol, ifc->sockfd);
 
-  /* Find static configuration if it exists */
-  struct static_conf *sconf = NULL;
-  for (int i = 0; i < g_conf.nstatic_confs; i++) {
-    struct ether_addr *ether = &g_conf.static_confs[i].ether_addr;
-    if (memcmp (ether, msg->chaddr, sizeof (*ether)) == 0) {
-      sconf = &g_conf.static_confs[i];
-      break;
+  if (!ol->active) {
+    struct dhcp_msg msg;
+    memset (&msg, 0, sizeof (msg));
+
+    char control[256];
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof (msg) };
+    struct msghdr mh = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control,
+      .msg_controllen = sizeof (control),
+    };
+
+    ssize_t len = recvmsg (ifc->sockfd, &mh, MSG_DONTWAIT);
+    if (len < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        log_errno ("recvmsg()");
+      return 0;
     }
+
+    ol_rx (ol, &mh);
+    process_message (ifc, &msg, len, &mh);
+    return 1;
   }
 
-  /* Determine address and lease time */
-  in_addr_t in_addr;
-  uint32_t lease_time;
-  const char *alloc_type;
-  if (sconf) {
-    in_addr = sconf->in_addr;
-    lease_time = (uint32_t) sconf->lease_time;
-    alloc_type = "static";
-  } else {
-    if (as_alloc (&g_aspace, &in_addr) < 0) {
-      log_error ("Out of addresses");
-      return;
+  /* Overloaded, serve renewals and requests of a whole batch
+   * before its DISCOVERs, and shed those while backed up */
+  int shed = -1;
+  ol_recv (ol, ifc->sockfd, &batch);
+  for (size_t k = 0; k < batch.count; k++) {
+    size_t i = batch.order[k];
+
+    if (batch.classes[i] == OL_DISCOVER) {
+      if (shed < 0)
+        shed = ol_backlogged (ifc->sockfd);
+      if (shed) {
+        ol->nshed++;
+        continue;
+      }
     }
-    lease_time = (uint32_t) g_conf.lease_time;
-    alloc_type = "dynamic";
+
+    process_message (ifc, &batch.msgs[i], batch.lens[i], &batch.hdrs[i]);
   }
 
-  /* Reserve address during request window */
-  struct lease lease;
-  memcpy (&lease.ether_addr, msg->chaddr, sizeof (struct ether_addr));
-  lease.in_addr = in_addr;
-  lease.expire = now + g_conf.request_window;
-  lq_add (&g_leaseq, &lease);
-
-  /* Create reply */
-  struct dhcp_msg reply;
-  memcpy (&reply, msg, sizeof (reply));
-
-  /* Set message fields */
-  reply.op = DHCP_OP_BOOTREPLY;
-  reply.hops = 0;
-  reply.secs = 0;
-  reply.ciaddr = 0;
-  reply.yiaddr = in_addr;
-  reply.siaddr = 0;
-
-  memset (reply.sname, 0, sizeof (reply.sname));
-  memset (reply.file, 0, sizeof (reply.file));
-  memcpy (reply.sname, g_hostname, sizeof (reply.sname) - 1);
-
-  /* Set options */
-  struct dhcp_opt opt;
-  struct dhcp_oit it = dhcp_oit_init (&reply);
-  dhcp_add_magic_cookie (&it);
-
-  /* Message type */
-  opt.tag = DHCP_OPT_DHCP_MESSAGE_TYPE;
-  opt.buf[0] = DHCP_MSG_TYPE_DHCPOFFER;
-  opt.len = 1;
-  dhcp_opt_add (&opt, &it);
-
-  /* Lease time */
-  lease_time = htonl (lease_time);
-  opt.tag = DHCP_OPT_IP_ADDRESS_LEASE_TIME;
-  memcpy (opt.buf, &lease_time, 4);
-  opt.len = 4;
-  dhcp_opt_add (&opt, &it);
-
-  /* Server identifier */
-  opt.tag = DHCP_OPT_SERVER_IDENTIFIER;
-  memcpy (opt.buf, &g_server_addr, 4);
-  opt.len = 4;
-  dhcp_opt_add (&opt, &it);
-
-  /* Subnet mask */
-  opt.tag = DHCP_OPT_SUBNET_MASK;
-  memcpy (opt.buf, &g_conf.subnet_mask, 4);
-  opt.len = 4;
-  dhcp_opt_add (&opt, &it);
-
-  /* End options */
-  opt.tag = DHCP_OPT_END_OPTION;
-  dhcp_opt_add (&opt, &it);
-
-  /* Send reply */
-  log_info ("[%s] %s (%s)", dhcp_msg_type_str (DHCP_MSG_TYPE_DHCPOFFER),
-            inet_str (in_addr), alloc_type);
-  if (sendto (g_sockfd, &reply, sizeof (reply), 0,
-              (struct sockaddr*) &client_addr, sizeof (client_addr)) < 0)
-    log_errno ("sendto() failed");
+  return batch.count;
 }
 
+/* Hand a received message to the protocol engine and carry out
+ * what it decides */
 static void
-process_request (struct dhcp_msg *msg)
+process_message (struct iface *ifc, struct dhcp_msg *msg, size_t len,
+                 struct msghdr *mh)
 {
-  enum dhcp_msg_type msg_type = DHCP_MSG_TYPE_DHCPACK;
-  time_t now = time (NULL);
-
-  /* Determine requested address */
-  struct dhcp_oit it = dhcp_oit_init (msg);
-  assert (dhcp_eat_magic_cookie (&it) == 0);
-
-  in_addr_t req_addr = 0;
-  while (!it.done) {
-    struct dhcp_opt opt;
-    if (dhcp_opt_take (&opt, &it) < 0) {
-      log_error ("Failed to parse message options");
-      return;
-    }
+  static struct dhcp_msg reply_msg;
+  static struct core_reply reply = { .msg = &reply_msg };
 
-    if (opt.tag == DHCP_OPT_REQUESTED_IP_ADDRESS) {
-      memcpy (&req_addr, opt.buf, 4);
-      continue;
-    }
+  trace_rx (&ifc->trace, mh);
 
-    if (opt.tag == DHCP_OPT_SERVER_IDENTIFIER &&
-        memcmp (opt.buf, &g_server_addr, 4) != 0) {
-      debug ("Wrong server id");
-      return;
-    }
-  }
+  if (!core_handle (&ifc->core, msg, len, clock_ms (), &reply))
+    return;
 
-  /* Check if lease exists */
-  int lease_id = -1;
-  for (int i = 0; i < g_leaseq.nleases; i++) {
-    struct ether_addr *ether = &g_leaseq.leases[i].ether_addr;
-    if (memcmp (ether, msg->chaddr, sizeof (*ether)) == 0) {
-      lease_id = i;
-      break;
-    }
-  }
+  if (reply.hostname[0])
+    ddns_add (&g_ddns, reply.hostname, reply.hostname_addr);
+
+  /* Only first replies are traced */
+  if (!reply.cached)
+    trace_send (&ifc->trace, ntohl (reply.msg->xid), reply.type);
 
-  /* Refuse if requested address doesn't match
-   * existing lease. */
-  in_addr_t in_addr;
-  const char *nak_reason = NULL;
-  if (lease_id >= 0 && req_addr != 0 && g_leaseq.leases[lease_id].in_addr != req_addr) {
-    log_info ("%s =/= %s", inet_str (req_addr),
-               inet_str (g_leaseq.leases[lease_id].in_addr));
-    nak_reason = "The requested address does not match an existing lease";
-    msg_type = DHCP_MSG_TYPE_DHCPNAK;
-  } else if (lease_id >= 0) {
-    /* Remove existing lease */
-    in_addr = g_leaseq.leases[lease_id].in_addr;
-    lq_remove (&g_leaseq, lease_id);
+  if (sendto (ifc->sockfd, reply.msg, sizeof (*reply.msg), 0,
+              (struct sockaddr*) &reply.addr, sizeof (reply.addr)) < 0) {
+    log_errno ("sendto() failed");
+    return;
   }
 
-  uint32_t lease_time = g_conf.lease_time;
+  /* The kernel numbers every transmitted packet */
+  if (reply.cached)
+    trace_skip (&ifc->trace);
+  else
+    trace_sent (&ifc->trace);
+}
 
-  if (msg_type != DHCP_MSG_TYPE_DHCPNAK) {
-    /* Check if host is statically configured */
-    struct static_conf *sconf = NULL;
-    for (int i = 0; i < g_conf.nstatic_confs; i++) {
-      struct ether_addr *ether = &g_conf.static_confs[i].ether_addr;
-      if (memcmp (ether, msg->chaddr, sizeof (*ether)) == 0) {
-        sconf = &g_conf.static_confs[i];
-        lease_time = sconf->lease_time;
-        break;
-      }
+/* Handle the frames received on the AF_XDP socket of an interface,
+ * reading each message in place and building its reply straight
+ * into a transmit frame. Returns the number of frames read. */
+static size_t
+process_xdp (struct iface *ifc)
+{
+  static struct xdp_frame frames[XDP_BATCH];
+  static struct core_reply reply;
+  struct xdp_port *xp = &ifc->xdp;
+
+  size_t n = xdp_recv (xp, frames, XDP_BATCH);
+
+  for (size_t i = 0; i < n; i++) {
+    /* Drop the message while every transmit frame is in flight,
+     * the client sends it again */
+    reply.msg = xdp_tx_buf (xp);
+    if (reply.msg == NULL) {
+      xp->ndropped++;
+      continue;
     }
 
-    /* Refuse if requested address doesn't match
-     * static configuration */
-    if (sconf && req_addr != 0 && sconf->in_addr != req_addr) {
-      msg_type = DHCP_MSG_TYPE_DHCPNAK;
-      nak_reason = "The requested address does not match the static configuration of this host";
-    } else if (sconf) {
-      in_addr = sconf->in_addr;
-    }
+    if (!core_handle (&ifc->core, frames[i].msg, frames[i].len,
+                      clock_ms (), &reply))
+      continue;
 
-    /* No existsing lease and no static
-     * configuration -> refuse */
-    if (lease_id < 0 && sconf == NULL) {
-      msg_type = DHCP_MSG_TYPE_DHCPNAK;
-      nak_reason = "There is no existing lease or static configuration for this host";
-    }
+    if (reply.hostname[0])
+      ddns_add (&g_ddns, reply.hostname, reply.hostname_addr);
+
+    xdp_send (xp, reply.msg, ifc->core.server_addr, &reply.addr,
+              frames[i].src_ether);
   }
 
-  /* Create new lease */
-  if (msg_type != DHCP_MSG_TYPE_DHCPNAK) {
-    struct lease lease;
-    lease.in_addr = in_addr;
-    memcpy (&lease.ether_addr, msg->chaddr, sizeof (lease.ether_addr));
-    lease.expire = now + lease_time;
-    lq_add (&g_leaseq, &lease);
+  xdp_release (xp, frames, n);
+  xdp_flush (xp);
+  return n;
+}
+
+/* Load a hardware address list */
+static int
+load_mac_set (struct mac_set *set, const char *path, const char *what)
+{
+  if (mf_load (set, path) < 0)
+    return -1;
+
+  log_info ("%s %zu hardware addresses from %s, %.1f bytes each", what,
+            set->nkeys, path,
+            set->nkeys ? (double) mf_memory (set) / set->nkeys : 0.0);
+  return 0;
+}
+
+/* Load the hardware address lists of a configuration, and replace
+ * the lists in use once all of them are read */
+static int
+configure_acl (const struct conf *conf)
+{
+  struct mac_acl acl;
+  memset (&acl, 0, sizeof (acl));
+
+  if ((conf->mac_allow
+       && load_mac_set (&acl.allow, conf->mac_allow, "Allowing") < 0)
+      || (conf->mac_deny
+          && load_mac_set (&acl.deny, conf->mac_deny, "Denying") < 0)) {
+    mf_acl_deinit (&acl);
+    return -1;
   }
 
-  /* Create reply */
-  struct dhcp_msg reply;
-  memcpy (&reply, msg, sizeof (reply));
+  acl.have_allow = conf->mac_allow != NULL;
+  acl.have_deny = conf->mac_deny != NULL;
+  acl.ndenied = g_acl.ndenied;
+  mf_acl_deinit (&g_acl);
+  g_acl = acl;
+  return 0;
+}
 
-  /* Set message fields */
-  reply.op = DHCP_OP_BOOTREPLY;
-  reply.hops = 0;
-  reply.secs = 0;
-  reply.siaddr = 0;
+static void
+configure_lb (const struct conf *conf)
+{
+  uint8_t buckets[LB_NBUCKETS / 8];
 
-  if (msg_type == DHCP_MSG_TYPE_DHCPACK)
-    reply.yiaddr = in_addr;
-  else
-    reply.yiaddr = 0;
-
-  memset (reply.file, 0, sizeof (reply.file));
-  memcpy (reply.sname, g_hostname, sizeof (reply.sname) - 1);
-
-  /* Set message options */
-  struct dhcp_opt opt;
-  it = dhcp_oit_init (&reply);
-  dhcp_add_magic_cookie (&it);
-
-  /* Message type */
-  opt.tag = DHCP_OPT_DHCP_MESSAGE_TYPE;
-  opt.len = 1;
-  opt.buf[0] = msg_type;
-  dhcp_opt_add (&opt, &it);
-
-  /* Server address */
-  opt.tag = DHCP_OPT_SERVER_IDENTIFIER;
-  opt.len = 4;
-  memcpy (opt.buf, &g_server_addr, 4);
-  dhcp_opt_add (&opt, &it);
-
-  /* Subnet mask */
-  opt.tag = DHCP_OPT_SUBNET_MASK;
-  opt.len = 4;
-  memcpy (opt.buf, &g_conf.subnet_mask, 4);
-  dhcp_opt_add (&opt, &it);
-
-  /* Lease time (for DHCPACK) */
-  if (msg_type == DHCP_MSG_TYPE_DHCPACK) {
-    lease_time = htonl (lease_time);
-    opt.tag = DHCP_OPT_IP_ADDRESS_LEASE_TIME;
-    opt.len = 4;
-    memcpy (opt.buf, &lease_time, 4);
-    dhcp_opt_add (&opt, &it);
+  if (conf->have_lb_buckets) {
+    lb_set_buckets (&g_lb, conf->lb_buckets);
+  } else if (conf->lb_count > 0) {
+    lb_split_buckets (conf->lb_index, conf->lb_count, buckets);
+    lb_set_buckets (&g_lb, buckets);
+  } else {
+    g_lb.enabled = 0;
+  }
+}
+
+/* Re-read the configuration and apply the settings that can
+ * change at runtime */
+static void
+reload (void)
+{
+  struct conf conf;
+  conf_defaults (&conf);
+
+  /* Lists that fail to load leave the previous ones in place */
+  if (conf_parse (conf_path, &conf) == 0) {
+    configure_lb (&conf);
+    configure_acl (&conf);
+    log_info ("Reloaded %s", conf_path);
   }
 
-  /* End of options */
-  opt.tag = DHCP_OPT_END_OPTION;
-  dhcp_opt_add (&opt, &it);
+  conf_deinit (&conf);
+}
 
-  /* Send reply */
-  log_info ("[%s] %s", dhcp_msg_type_str (msg_type),
-            msg_type == DHCP_MSG_TYPE_DHCPACK ?
-              inet_str (in_addr) : nak_reason);
-  if (sendto (g_sockfd, &reply, sizeof (reply), 0,
-              (struct sockaddr*) &client_addr, sizeof (client_addr)) < 0)
-    log_errno ("sendto() failed");
+static void
+on_sighup (int sig)
+{
+  (void) sig;
+  reload_requested = 1;
+}
+
+static void
+on_sigusr1 (int sig)
+{
+  (void) sig;
+  dump_requested = 1;
+}
+
+/* Log counters and pool state */
+static void
+dump_stats (void)
+{
+  for (size_t i = 0; i < g_nifaces; i++)
+    iface_dump (&g_ifaces[i]);
+  if (g_lb.enabled)
+    log_info ("load balancing: %zu ignored", g_lb.nignored);
+  if (g_ddns.sockfd >= 0)
+    log_info ("ddns: %zu registered in %zu updates, %zu dropped",
+              g_ddns.nregistered, g_ddns.nmessages, g_ddns.ndropped);
+  if (g_history.dir)
+    log_info ("history: %zu records in %zu blocks (%zu bytes), %zu dropped",
+              g_history.nrecords, g_history.nblocks, g_history.nbytes,
+              g_history.ndropped);
+  if (g_acl.have_allow || g_acl.have_deny)
+    log_info ("access lists: %zu denied, %zu bytes", g_acl.ndenied,
+              mf_memory (&g_acl.allow) + mf_memory (&g_acl.deny));
+  if (g_reserv.hosts)
+    log_info ("reservations: %zu hosts, %zu changes in %zu batches, "
+              "%zu batches rejected", g_reserv.nhosts, g_reserv.nchanges,
+              g_reserv.nbatches, g_reserv.nrejected);
+  if (g_bulkquery.listenfd >= 0)
+    log_info ("bulk query: %zu exports", g_bulkquery.nexports);
+}
+
+/* Touch the stack the loop will use, so that growing into it does
+ * not fault later */
+static void
+prefault_stack (void)
+{
+  volatile char stack[PREFAULT_STACK];
+
+  for (size_t i = 0; i < sizeof (stack); i += 4096)
+    stack[i] = 0;
 }
 
-/* Find address on configured interface */
+/* Lower a deadline to another one, negative deadlines mean none */
+static void
+min_deadline (int64_t *deadline, int64_t other)
+{
+  if (other >= 0 && (*deadline < 0 || other < *deadline))
+    *deadline = other;
+}
+
+/* Arm timer to expire at a monotonic deadline (ms), or
+ * disarm it if the deadline is negative */
 static int
-get_servaddr (void)
+arm_timer (int timerfd, int64_t deadline)
 {
-  struct ifaddrs *ifap, *it;
-  if (getifaddrs (&ifap) < 0) {
-    log_errno ("getifaddrs()");
+  struct itimerspec its;
+  memset (&its, 0, sizeof (its));
+
+  if (deadline >= 0) {
+    /* An all zero value would disarm the timer */
+    if (deadline == 0)
+      deadline = 1;
+    its.it_value.tv_sec = deadline / 1000;
+    its.it_value.tv_nsec = deadline % 1000 * 1000000;
+  }
+
+  if (timerfd_settime (timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+    log_errno ("Failed to arm timer");
     return -1;
   }
 
-  for (it = ifap; it; it = it->ifa_next) {
-    if (strcmp (it->ifa_name, g_conf.interface) != 0)
-      continue;
+  return 0;
+}
 
-    if (it->ifa_addr->sa_family != AF_INET)
-      continue;
+/* Add a descriptor to the event loop */
+static int
+watch (int epfd, int fd, uint32_t events, uint64_t tag)
+{
+  struct epoll_event ev = { .events = events, .data.u64 = tag };
 
-    g_server_addr = ((struct sockaddr_in*) it->ifa_addr)->sin_addr.s_addr;
-    freeifaddrs (ifap);
+  /* Disabled modules have no descriptor */
+  if (fd < 0)
     return 0;
-  }
 
-  log_error ("No address found on device %s", g_conf.interface);
-  freeifaddrs (ifap);
-  return -1;
-}
+  if (epoll_ctl (epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    log_errno ("Failed to add descriptor to event loop");
+    return -1;
+  }
 
-/* Convert an in_addr_t in to a string */
-static char *
-inet_str (in_addr_t in_addr)
-{
-  static char buf[INET_ADDRSTRLEN];
-  struct in_addr addr = { .s_addr = in_addr };
-  inet_ntop (AF_INET, &addr, buf, sizeof (buf));
-  return buf;
+  return 0;
 }
@@ -4,12 +4,28 @@
 #include "addr_space.h"
 #include "lease_queue.h"
 #include "conf.h"
+#include "probe.h"
+#include "affinity.h"
+#include "loadbal.h"
+#include "bulkquery.h"
+#include "ddns.h"
+#include "history.h"
+#include "macfilter.h"
+#include "reserv.h"
+#include "control.h"
+#include "trace.h"
+#include "iface.h"
 
 extern struct conf g_conf;
-extern struct lease_queue g_leaseq;
-extern struct addr_space g_aspace;
-extern int g_sockfd;
-extern in_addr_t g_server_addr;
+extern struct iface g_ifaces[];
+extern size_t g_nifaces;
+extern struct lb g_lb;
+extern struct bulkquery g_bulkquery;
+extern struct ddns g_ddns;
+extern struct history g_history;
+extern struct mac_acl g_acl;
+extern struct reserv g_reserv;
+extern struct control g_control;
 extern char g_hostname[];
 
 #endif
@@ -137,6 +137,8 @@ enum dhcp_opt_tag {
   DHCP_OPT_REBINDING = 59,
   DHCP_OPT_CLASS_IDENTIFIER = 60,
   DHCP_OPT_CLIENT_IDENTIFIER = 61,
+  DHCP_OPT_USER_CLASS = 77,
+  DHCP_OPT_RAPID_COMMIT = 80,
   DHCP_OPT_END_OPTION = 255,
 };
 
@@ -0,0 +1,28 @@
+#include "hash.h"
+
+uint32_t
+hash_ether (const struct ether_addr *ether)
+{
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < sizeof (ether->ether_addr_octet); i++) {
+    hash ^= ether->ether_addr_octet[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+uint32_t
+hash_bytes (const void *buf, size_t len)
+{
+  const uint8_t *p = buf;
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
@@ -0,0 +1,16 @@
+#ifndef HASH_H_INCLUDED
+#define HASH_H_INCLUDED
+
+/* Hashing of keys used in lookup tables */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/ether.h>
+
+/* FNV-1a hash of a hardware address */
+uint32_t hash_ether (const struct ether_addr *ether);
+
+/* FNV-1a hash of a byte string */
+uint32_t hash_bytes (const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,627 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "history.h"
+#include "clock.h"
+#include "log.h"
+
+#define INDEX_VERSION 1
+
+static const char block_magic[4] = "DHLB";
+static const char index_magic[4] = "DHLI";
+
+struct index_header {
+  char magic[4];
+  uint32_t version;
+  uint64_t data_size;
+  uint64_t nblocks;
+  uint64_t nips;
+  uint64_t nmacs;
+};
+
+/* Encoding buffer of one block */
+static uint8_t block_buf[HIST_HEADER_SIZE + HIST_BLOCK * HIST_MAX_RECORD];
+
+static size_t
+put_varint (uint8_t *p, uint64_t v)
+{
+  size_t n = 0;
+
+  while (v >= 0x80) {
+    p[n++] = v | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+
+  return n;
+}
+
+static int
+get_varint (const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+  *v = 0;
+
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (*p == end)
+      return -1;
+
+    uint8_t b = *(*p)++;
+    *v |= (uint64_t) (b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return 0;
+  }
+
+  return -1;
+}
+
+static uint64_t
+zigzag (int64_t v)
+{
+  return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static int64_t
+unzigzag (uint64_t v)
+{
+  return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+void
+hist_path (char *buf, size_t size, const char *dir, int64_t day,
+           const char *ext)
+{
+  time_t t = day * 86400;
+  struct tm tm;
+
+  gmtime_r (&t, &tm);
+  snprintf (buf, size, "%s/%04d%02d%02d%s", dir, tm.tm_year + 1900,
+            tm.tm_mon + 1, tm.tm_mday, ext);
+}
+
+/* Segment for the indexing thread */
+struct index_job {
+  const char *dir;
+  int64_t day;
+};
+
+/* Write the index of the segment of a day that is over */
+static void *
+index_segment (void *arg)
+{
+  struct index_job *job = arg;
+  char path[4096];
+  struct hist_index idx;
+
+  hist_path (path, sizeof (path), job->dir, job->day, ".hist");
+  int fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    log_errno ("Failed to open %s", path);
+    free (job);
+    return NULL;
+  }
+
+  if (hist_index_build (fd, &idx) == 0) {
+    hist_path (path, sizeof (path), job->dir, job->day, ".idx");
+    hist_index_write (&idx, path);
+    hist_index_free (&idx);
+  }
+
+  close (fd);
+  free (job);
+  return NULL;
+}
+
+/* Index the segment of a day that is over off the event loop. One
+ * segment is indexed at a time: should the previous one still be
+ * going, this one is left for queries to index on the fly. */
+static void
+start_indexing (struct history *h, int64_t day)
+{
+  if (h->indexing) {
+    if (pthread_tryjoin_np (h->indexer, NULL) != 0) {
+      log_error ("Still indexing lease history, leaving a segment "
+                 "without index");
+      return;
+    }
+    h->indexing = 0;
+  }
+
+  struct index_job *job = malloc (sizeof (*job));
+  if (job == NULL) {
+    log_error ("Out of memory");
+    return;
+  }
+  job->dir = h->dir;
+  job->day = day;
+
+  /* Signals are left to the event loop */
+  sigset_t all, old;
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+  int err = pthread_create (&h->indexer, NULL, index_segment, job);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+
+  if (err != 0) {
+    log_error ("Failed to start indexing lease history: %s",
+               strerror (err));
+    free (job);
+    return;
+  }
+  h->indexing = 1;
+}
+
+/* Read the header of the block at off. Fails unless the header is
+ * intact and the block ends within a file of file_size bytes. */
+static int
+read_block_header (int fd, uint64_t off, uint64_t file_size,
+                   struct hist_block *block)
+{
+  uint8_t header[HIST_HEADER_SIZE];
+
+  if (file_size - off < HIST_HEADER_SIZE
+      || pread (fd, header, sizeof (header), off) != sizeof (header)
+      || memcmp (header, block_magic, 4) != 0)
+    return -1;
+
+  block->offset = off;
+  memcpy (&block->count, header + 4, 4);
+  memcpy (&block->size, header + 8, 4);
+  memcpy (&block->t_min, header + 16, 8);
+  memcpy (&block->t_max, header + 24, 8);
+
+  if (block->count > HIST_BLOCK
+      || block->size > HIST_BLOCK * HIST_MAX_RECORD
+      || block->size > file_size - off - HIST_HEADER_SIZE)
+    return -1;
+
+  return 0;
+}
+
+/* Cut off a block left partly written by a crash, so that blocks
+ * appended to the segment can be found after it */
+static void
+truncate_torn_block (int fd, const char *path)
+{
+  struct stat st;
+  struct hist_block block;
+
+  if (fstat (fd, &st) < 0)
+    return;
+
+  uint64_t off = 0;
+  while (off < (uint64_t) st.st_size
+         && read_block_header (fd, off, st.st_size, &block) == 0)
+    off += HIST_HEADER_SIZE + block.size;
+
+  if (off == (uint64_t) st.st_size)
+    return;
+
+  log_error ("Truncating torn block at %llu of %s",
+             (unsigned long long) off, path);
+  if (ftruncate (fd, off) < 0)
+    log_errno ("Failed to truncate %s", path);
+}
+
+static int
+open_segment (struct history *h, int64_t day)
+{
+  char path[4096];
+
+  if (h->fd >= 0) {
+    close (h->fd);
+    start_indexing (h, h->day);
+  }
+
+  h->day = day;
+  hist_path (path, sizeof (path), h->dir, day, ".hist");
+  h->fd = open (path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (h->fd < 0) {
+    log_errno ("Failed to open %s", path);
+    return -1;
+  }
+  truncate_torn_block (h->fd, path);
+
+  return 0;
+}
+
+int
+hist_init (struct history *h, const char *dir, int64_t delay)
+{
+  memset (h, 0, sizeof (*h));
+  h->fd = -1;
+  h->day = -1;
+  h->queued_at = -1;
+  h->delay = delay;
+
+  if (dir == NULL)
+    return 0;
+
+  h->dir = dir;
+  if (mkdir (dir, 0755) < 0 && errno != EEXIST) {
+    log_errno ("Failed to create %s", dir);
+    return -1;
+  }
+
+  return open_segment (h, time (NULL) / 86400);
+}
+
+void
+hist_add (struct history *h, uint8_t event, in_addr_t addr,
+          const struct ether_addr *ether, time_t start, time_t end)
+{
+  if (h->queue_len == HIST_QUEUE_SIZE) {
+    h->ndropped++;
+    return;
+  }
+
+  struct hist_record *rec =
+    &h->queue[(h->queue_head + h->queue_len++) % HIST_QUEUE_SIZE];
+  rec->in_addr = addr;
+  rec->ether = *ether;
+  rec->event = event;
+  rec->start = start;
+  rec->end = end;
+}
+
+/* Encode and write the first n queued records as a block */
+static void
+write_block (struct history *h, size_t n, time_t wall_offset)
+{
+  uint8_t *p = block_buf + HIST_HEADER_SIZE;
+  int64_t t_min = INT64_MAX;
+  int64_t t_max = INT64_MIN;
+
+  for (size_t i = 0; i < n; i++) {
+    struct hist_record *rec =
+      &h->queue[(h->queue_head + i) % HIST_QUEUE_SIZE];
+    rec->start += wall_offset;
+    rec->end += wall_offset;
+    if (rec->start < t_min)
+      t_min = rec->start;
+    if (rec->end > t_max)
+      t_max = rec->end;
+  }
+
+  int64_t prev_addr = 0;
+  int64_t prev_start = t_min;
+  for (size_t i = 0; i < n; i++) {
+    const struct hist_record *rec =
+      &h->queue[(h->queue_head + i) % HIST_QUEUE_SIZE];
+    int64_t addr = ntohl (rec->in_addr);
+
+    *p++ = rec->event;
+    p += put_varint (p, zigzag (addr - prev_addr));
+    memcpy (p, &rec->ether, ETHER_ADDR_LEN);
+    p += ETHER_ADDR_LEN;
+    p += put_varint (p, zigzag (rec->start - prev_start));
+    p += put_varint (p, zigzag (rec->end - rec->start));
+
+    prev_addr = addr;
+    prev_start = rec->start;
+  }
+
+  uint32_t count = n;
+  uint32_t size = p - block_buf - HIST_HEADER_SIZE;
+  memcpy (block_buf, block_magic, 4);
+  memcpy (block_buf + 4, &count, 4);
+  memcpy (block_buf + 8, &size, 4);
+  memset (block_buf + 12, 0, 4);
+  memcpy (block_buf + 16, &t_min, 8);
+  memcpy (block_buf + 24, &t_max, 8);
+
+  h->queue_head = (h->queue_head + n) % HIST_QUEUE_SIZE;
+  h->queue_len -= n;
+
+  size_t len = HIST_HEADER_SIZE + size;
+  if (h->fd < 0 || write (h->fd, block_buf, len) != (ssize_t) len) {
+    if (h->fd >= 0)
+      log_errno ("Failed to write lease history");
+    h->ndropped += n;
+    return;
+  }
+
+  h->nrecords += n;
+  h->nblocks++;
+  h->nbytes += len;
+}
+
+void
+hist_flush (struct history *h)
+{
+  if (h->dir == NULL || h->queue_len == 0)
+    return;
+
+  int64_t now = clock_ms ();
+  if (h->queued_at < 0)
+    h->queued_at = now;
+
+  if (h->queue_len < HIST_BLOCK && now - h->queued_at < h->delay)
+    return;
+
+  /* Records go to the segment of the day they are written on */
+  time_t wall_offset = clock_wall (0);
+  int64_t day = (clock_now () + wall_offset) / 86400;
+  if (day != h->day)
+    open_segment (h, day);
+
+  while (h->queue_len > 0)
+    write_block (h, h->queue_len < HIST_BLOCK ? h->queue_len : HIST_BLOCK,
+                 wall_offset);
+
+  h->queued_at = -1;
+}
+
+int64_t
+hist_deadline (struct history *h)
+{
+  if (h->dir == NULL || h->queue_len == 0 || h->queued_at < 0)
+    return -1;
+
+  return h->queued_at + h->delay;
+}
+
+ssize_t
+hist_read_block (int fd, const struct hist_block *block,
+                 struct hist_record *records)
+{
+  static uint8_t buf[HIST_BLOCK * HIST_MAX_RECORD];
+
+  if (block->count > HIST_BLOCK || block->size > sizeof (buf)
+      || pread (fd, buf, block->size, block->offset + HIST_HEADER_SIZE)
+         != (ssize_t) block->size)
+    return -1;
+
+  const uint8_t *p = buf;
+  const uint8_t *end = buf + block->size;
+  int64_t prev_addr = 0;
+  int64_t prev_start = block->t_min;
+
+  for (uint32_t i = 0; i < block->count; i++) {
+    struct hist_record *rec = &records[i];
+    uint64_t addr, start, len;
+
+    if (end - p < 1 + ETHER_ADDR_LEN)
+      return -1;
+    rec->event = *p++;
+
+    if (get_varint (&p, end, &addr) < 0 || end - p < ETHER_ADDR_LEN)
+      return -1;
+    prev_addr += unzigzag (addr);
+    rec->in_addr = htonl (prev_addr);
+    memcpy (&rec->ether, p, ETHER_ADDR_LEN);
+    p += ETHER_ADDR_LEN;
+
+    if (get_varint (&p, end, &start) < 0 || get_varint (&p, end, &len) < 0)
+      return -1;
+    prev_start += unzigzag (start);
+    rec->start = prev_start;
+    rec->end = prev_start + unzigzag (len);
+  }
+
+  return block->count;
+}
+
+static int
+compare_ip_entries (const void *a, const void *b)
+{
+  const struct hist_ip_entry *x = a, *y = b;
+
+  if (x->in_addr != y->in_addr)
+    return x->in_addr < y->in_addr ? -1 : 1;
+  return x->block < y->block ? -1 : x->block > y->block;
+}
+
+static int
+compare_mac_entries (const void *a, const void *b)
+{
+  const struct hist_mac_entry *x = a, *y = b;
+  int c = memcmp (x->ether, y->ether, ETHER_ADDR_LEN);
+
+  if (c != 0)
+    return c;
+  return x->block < y->block ? -1 : x->block > y->block;
+}
+
+/* Grow an array to hold at least n elements */
+static int
+reserve (void **array, size_t *capac, size_t n, size_t size)
+{
+  if (n <= *capac)
+    return 0;
+
+  size_t new_capac = *capac ? *capac * 2 : 1024;
+  while (new_capac < n)
+    new_capac *= 2;
+
+  void *p = realloc (*array, new_capac * size);
+  if (p == NULL) {
+    log_error ("Out of memory");
+    return -1;
+  }
+
+  *array = p;
+  *capac = new_capac;
+  return 0;
+}
+
+int
+hist_index_build (int fd, struct hist_index *idx)
+{
+  static struct hist_record records[HIST_BLOCK];
+  size_t blocks_capac = 0, ips_capac = 0, macs_capac = 0;
+  struct stat st;
+
+  memset (idx, 0, sizeof (*idx));
+
+  if (fstat (fd, &st) < 0) {
+    log_errno ("fstat()");
+    return -1;
+  }
+  idx->data_size = st.st_size;
+
+  /* A block cut short by a crash ends the usable part of the file,
+   * one that only fails to decode is skipped */
+  uint64_t off = 0;
+  while (off < (uint64_t) st.st_size) {
+    struct hist_block block;
+
+    if (read_block_header (fd, off, st.st_size, &block) < 0)
+      break;
+    off += HIST_HEADER_SIZE + block.size;
+
+    ssize_t n = hist_read_block (fd, &block, records);
+    if (n < 0)
+      continue;
+
+    if (reserve ((void **) &idx->blocks, &blocks_capac, idx->nblocks + 1,
+                 sizeof (*idx->blocks)) < 0
+        || reserve ((void **) &idx->ips, &ips_capac, idx->nips + n,
+                    sizeof (*idx->ips)) < 0
+        || reserve ((void **) &idx->macs, &macs_capac, idx->nmacs + n,
+                    sizeof (*idx->macs)) < 0) {
+      hist_index_free (idx);
+      return -1;
+    }
+
+    uint32_t b = idx->nblocks;
+    idx->blocks[idx->nblocks++] = block;
+
+    for (ssize_t i = 0; i < n; i++) {
+      struct hist_ip_entry *ip = &idx->ips[idx->nips++];
+      ip->in_addr = ntohl (records[i].in_addr);
+      ip->block = b;
+
+      struct hist_mac_entry *mac = &idx->macs[idx->nmacs++];
+      memcpy (mac->ether, &records[i].ether, ETHER_ADDR_LEN);
+      mac->reserved = 0;
+      mac->block = b;
+    }
+  }
+
+  /* Keep one entry per key and block */
+  qsort (idx->ips, idx->nips, sizeof (*idx->ips), compare_ip_entries);
+  qsort (idx->macs, idx->nmacs, sizeof (*idx->macs), compare_mac_entries);
+
+  size_t n = 0;
+  for (size_t i = 0; i < idx->nips; i++)
+    if (n == 0 || compare_ip_entries (&idx->ips[n - 1], &idx->ips[i]) != 0)
+      idx->ips[n++] = idx->ips[i];
+  idx->nips = n;
+
+  n = 0;
+  for (size_t i = 0; i < idx->nmacs; i++)
+    if (n == 0 || compare_mac_entries (&idx->macs[n - 1], &idx->macs[i]) != 0)
+      idx->macs[n++] = idx->macs[i];
+  idx->nmacs = n;
+
+  return 0;
+}
+
+int
+hist_index_write (const struct hist_index *idx, const char *path)
+{
+  char tmp_path[4096];
+  struct index_header hdr;
+
+  memset (&hdr, 0, sizeof (hdr));
+  memcpy (hdr.magic, index_magic, 4);
+  hdr.version = INDEX_VERSION;
+  hdr.data_size = idx->data_size;
+  hdr.nblocks = idx->nblocks;
+  hdr.nips = idx->nips;
+  hdr.nmacs = idx->nmacs;
+
+  /* Replace any older index in one step */
+  snprintf (tmp_path, sizeof (tmp_path), "%s.tmp", path);
+  FILE *f = fopen (tmp_path, "w");
+  if (f == NULL) {
+    log_errno ("Failed to open %s", tmp_path);
+    return -1;
+  }
+
+  int ok = fwrite (&hdr, sizeof (hdr), 1, f) == 1
+    && fwrite (idx->blocks, sizeof (*idx->blocks), idx->nblocks, f)
+       == idx->nblocks
+    && fwrite (idx->ips, sizeof (*idx->ips), idx->nips, f) == idx->nips
+    && fwrite (idx->macs, sizeof (*idx->macs), idx->nmacs, f) == idx->nmacs;
+
+  if (fclose (f) != 0 || !ok || rename (tmp_path, path) < 0) {
+    log_errno ("Failed to write %s", path);
+    unlink (tmp_path);
+    return -1;
+  }
+
+  return 0;
+}
+
+int
+hist_index_load (const char *path, uint64_t data_size,
+                 struct hist_index *idx)
+{
+  struct index_header hdr;
+  struct stat st;
+
+  memset (idx, 0, sizeof (*idx));
+
+  int fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  if (fstat (fd, &st) < 0 || (size_t) st.st_size < sizeof (hdr)
+      || pread (fd, &hdr, sizeof (hdr), 0) != sizeof (hdr)) {
+    close (fd);
+    return -1;
+  }
+
+  /* Stale if records were added after it was written */
+  uint64_t size = sizeof (hdr) + hdr.nblocks * sizeof (*idx->blocks)
+    + hdr.nips * sizeof (*idx->ips) + hdr.nmacs * sizeof (*idx->macs);
+  if (memcmp (hdr.magic, index_magic, 4) != 0
+      || hdr.version != INDEX_VERSION || hdr.data_size != data_size
+      || size != (uint64_t) st.st_size) {
+    close (fd);
+    return -1;
+  }
+
+  uint8_t *map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  idx->map = map;
+  idx->map_size = st.st_size;
+  idx->data_size = hdr.data_size;
+  idx->nblocks = hdr.nblocks;
+  idx->nips = hdr.nips;
+  idx->nmacs = hdr.nmacs;
+  idx->blocks = (struct hist_block *) (map + sizeof (hdr));
+  idx->ips = (struct hist_ip_entry *) (idx->blocks + idx->nblocks);
+  idx->macs = (struct hist_mac_entry *) (idx->ips + idx->nips);
+
+  return 0;
+}
+
+void
+hist_index_free (struct hist_index *idx)
+{
+  if (idx->map) {
+    munmap (idx->map, idx->map_size);
+    return;
+  }
+
+  free (idx->blocks);
+  free (idx->ips);
+  free (idx->macs);
+}
@@ -0,0 +1,177 @@
+#ifndef HISTORY_H_INCLUDED
+#define HISTORY_H_INCLUDED
+
+/* Lease history
+ *
+ * Every binding, renewal and expiration is recorded in an append-only
+ * store, so that it can later be told who held an address or which
+ * addresses a host held at a given time. The protocol engine only
+ * queues records. They are written from the event loop in blocks,
+ * one write per block.
+ *
+ * The store is a directory with one segment per UTC day, named after
+ * the day. The data file YYYYMMDD.hist is a sequence of blocks:
+ *
+ *   magic    4 bytes  "DHLB"
+ *   count    4 bytes  number of records
+ *   size     4 bytes  size of the encoded records
+ *   reserved 4 bytes
+ *   t_min    8 bytes  earliest start of the records
+ *   t_max    8 bytes  latest end of the records
+ *
+ * followed by the records. Each record is encoded as the event byte,
+ * the address as a zigzag varint delta from the previous record, the
+ * 6 byte hardware address, the start as a zigzag varint delta from
+ * the previous record and the length of the lease as a varint.
+ *
+ * Once a day is over its segment gets an index, YYYYMMDD.idx, built
+ * on a thread of its own so the event loop does not wait for it, with
+ * the block table and the addresses and hardware addresses of the
+ * segment, sorted, each with the block it appears in. Queries look up
+ * the blocks to decode in the indexes, or in an index built on the
+ * fly for segments that have none.
+ *
+ * Integers are in host byte order and times are wall clock seconds.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/ether.h>
+
+#define HIST_QUEUE_SIZE 16384
+#define HIST_BLOCK 4096
+
+/* Size of an encoded block header and the most a record takes */
+#define HIST_HEADER_SIZE 32
+#define HIST_MAX_RECORD 32
+
+enum hist_event {
+  HIST_BIND = 1,
+  HIST_RENEW,
+  HIST_EXPIRE,
+};
+
+struct hist_record {
+  in_addr_t in_addr;
+  struct ether_addr ether;
+  uint8_t event;
+
+  /* Start and end of the lease. Expirations start when they end. */
+  int64_t start;
+  int64_t end;
+};
+
+/* Block in a data file */
+struct hist_block {
+  /* Position of the block header */
+  uint64_t offset;
+
+  uint32_t count;
+  uint32_t size;
+  int64_t t_min;
+  int64_t t_max;
+};
+
+/* Index entries, sorted by key and then block */
+struct hist_ip_entry {
+  /* Address in host byte order */
+  uint32_t in_addr;
+  uint32_t block;
+};
+
+struct hist_mac_entry {
+  uint8_t ether[ETHER_ADDR_LEN];
+  uint16_t reserved;
+  uint32_t block;
+};
+
+struct hist_index {
+  /* Size of the data file when it was indexed */
+  uint64_t data_size;
+
+  struct hist_block *blocks;
+  size_t nblocks;
+  struct hist_ip_entry *ips;
+  size_t nips;
+  struct hist_mac_entry *macs;
+  size_t nmacs;
+
+  /* Mapped index file, NULL if built in memory */
+  void *map;
+  size_t map_size;
+};
+
+struct history {
+  /* Directory of the store, NULL if disabled */
+  const char *dir;
+
+  /* Data file of the current segment, -1 if none */
+  int fd;
+
+  /* Day of the current segment, in days since the epoch */
+  int64_t day;
+
+  /* Thread indexing the segment of a previous day, if indexing */
+  pthread_t indexer;
+  int indexing;
+
+  /* Records not yet written, with times in monotonic seconds */
+  struct hist_record queue[HIST_QUEUE_SIZE];
+  size_t queue_head;
+  size_t queue_len;
+
+  /* Monotonic time (ms) at which the oldest queued record was
+   * added, and time to wait for more before writing */
+  int64_t queued_at;
+  int64_t delay;
+
+  /* Counters */
+  size_t nrecords;
+  size_t nblocks;
+  size_t nbytes;
+  size_t ndropped;
+};
+
+/* Initialize, a NULL directory disables the history. Records are
+ * written once a block is full or delay ms after the first. */
+int hist_init (struct history *h, const char *dir, int64_t delay);
+
+/* Queue a record, times in monotonic seconds */
+void hist_add (struct history *h, uint8_t event, in_addr_t addr,
+               const struct ether_addr *ether, time_t start, time_t end);
+
+/* Write queued records that are due */
+void hist_flush (struct history *h);
+
+/* Monotonic time (ms) at which hist_flush has work, -1 if none */
+int64_t hist_deadline (struct history *h);
+
+/* Path of a file of the segment of a day */
+void hist_path (char *buf, size_t size, const char *dir, int64_t day,
+                const char *ext);
+
+/* Index a data file by reading it through. Not reentrant, like
+ * hist_read_block. */
+int hist_index_build (int fd, struct hist_index *idx);
+
+/* Write an index to a file */
+int hist_index_write (const struct hist_index *idx, const char *path);
+
+/* Map the index file of a data file of data_size bytes, returns -1
+ * if there is none or it is out of date */
+int hist_index_load (const char *path, uint64_t data_size,
+                     struct hist_index *idx);
+
+/* Dispose of an index */
+void hist_index_free (struct hist_index *idx);
+
+/* Read and decode the records of a block, returns their number
+ * or -1. Not reentrant. */
+ssize_t hist_read_block (int fd, const struct hist_block *block,
+                         struct hist_record *records);
+
+#endif
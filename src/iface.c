@@ -0,0 +1,183 @@
+#include <string.h>
+
+#include <unistd.h>
+#include <ifaddrs.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "iface.h"
+#include "dhcp.h"
+#include "clock.h"
+#include "log.h"
+
+/* Find address on interface */
+static int
+get_servaddr (struct iface *ifc, in_addr_t *server_addr)
+{
+  struct ifaddrs *ifap, *it;
+  if (getifaddrs (&ifap) < 0) {
+    log_errno ("getifaddrs()");
+    return -1;
+  }
+
+  for (it = ifap; it; it = it->ifa_next) {
+    if (strcmp (it->ifa_name, ifc->conf->name) != 0)
+      continue;
+
+    if (it->ifa_addr == NULL || it->ifa_addr->sa_family != AF_INET)
+      continue;
+
+    *server_addr = ((struct sockaddr_in*) it->ifa_addr)->sin_addr.s_addr;
+    freeifaddrs (ifap);
+    return 0;
+  }
+
+  log_error ("No address found on device %s", ifc->conf->name);
+  freeifaddrs (ifap);
+  return -1;
+}
+
+int
+iface_open (struct iface *ifc, const struct iface_conf *ic,
+            const struct conf *conf, const char *hostname)
+{
+  struct sockaddr_in sockaddr;
+  in_addr_t server_addr;
+  int enable = 1;
+
+  memset (ifc, 0, sizeof (*ifc));
+  ifc->conf = ic;
+
+  if (get_servaddr (ifc, &server_addr) < 0)
+    return -1;
+
+  if (core_init (&ifc->core, conf, ic, server_addr, hostname,
+                 clock_ms ()) < 0)
+    return -1;
+
+  if (probe_init (&ifc->prober, ic->name, conf->probe_depth,
+                  conf->probe_timeout) < 0)
+    return -1;
+  ifc->core.prober = &ifc->prober;
+
+  if ((ifc->sockfd = socket (AF_INET, SOCK_DGRAM, 0)) < 0) {
+    log_errno ("Failed to open socket");
+    return -1;
+  }
+
+  /* Bind socket to configured device */
+  if (setsockopt (ifc->sockfd, SOL_SOCKET, SO_BINDTODEVICE,
+                  ic->name, strlen (ic->name)) < 0) {
+    log_errno ("Failed to bind socket to device %s", ic->name);
+    return -1;
+  }
+
+  /* Enabled broadcasting */
+  if (setsockopt (ifc->sockfd, SOL_SOCKET, SO_BROADCAST,
+                  &enable, sizeof (enable)) < 0) {
+    log_errno ("Failed to enable broadcasting");
+    return -1;
+  }
+
+  /* Sockets of other interfaces are bound to the same port */
+  if (setsockopt (ifc->sockfd, SOL_SOCKET, SO_REUSEADDR,
+                  &enable, sizeof (enable)) < 0) {
+    log_errno ("Failed to enable address reuse");
+    return -1;
+  }
+
+  /* Poll the device from receives instead of waiting for its
+   * interrupts */
+  if (conf->busy_poll > 0) {
+    if (setsockopt (ifc->sockfd, SOL_SOCKET, SO_BUSY_POLL,
+                    &conf->busy_poll, sizeof (conf->busy_poll)) < 0) {
+      log_errno ("Failed to enable busy polling");
+      return -1;
+    }
+
+#ifdef SO_PREFER_BUSY_POLL
+    /* Keep interrupts deferred while the server polls */
+    if (setsockopt (ifc->sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+                    &enable, sizeof (enable)) < 0) {
+      log_errno ("Failed to prefer busy polling");
+      return -1;
+    }
+#endif
+  }
+
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons (DHCP_PORT_SERVER);
+  sockaddr.sin_addr.s_addr = INADDR_ANY;
+
+  if (ol_init (&ifc->overload, ifc->sockfd) < 0)
+    return -1;
+
+  if (bind (ifc->sockfd, (struct sockaddr*) &sockaddr, sizeof (sockaddr)) < 0) {
+    log_errno ("Failed to bind socket");
+    return -1;
+  }
+
+  if (conf->timestamping
+      && trace_init (&ifc->trace, ifc->sockfd, conf->trace_file,
+                     conf->trace_sample) < 0)
+    return -1;
+
+  /* The socket stays open for messages the XDP program passes on */
+  ifc->xdp.fd = -1;
+  if (conf->xdp != CONF_XDP_OFF
+      && xdp_open (&ifc->xdp, ic->name, conf->xdp == CONF_XDP_NATIVE) < 0)
+    return -1;
+
+  return 0;
+}
+
+int64_t
+iface_deadline (struct iface *ifc)
+{
+  int64_t deadline = probe_deadline (&ifc->prober);
+  int64_t expire = core_deadline (&ifc->core);
+
+  if (expire >= 0 && (deadline < 0 || expire < deadline))
+    deadline = expire;
+
+  return deadline;
+}
+
+void
+iface_dump (struct iface *ifc)
+{
+  struct dhcp_core *core = &ifc->core;
+  struct affinity *af = &core->affinity;
+  struct rcache *rc = &core->rcache;
+
+  log_info ("%s: leases: %zu, pool: %zu/%zu used", ifc->conf->name,
+            core->leaseq.nleases, as_used (&core->aspace),
+            as_size (&core->aspace));
+  for (size_t i = 0; i < core->nclasses; i++)
+    log_info ("%s: class %s: pool: %zu/%zu used", ifc->conf->name,
+              core->classes[i].conf->name,
+              as_used (&core->classes[i].aspace),
+              as_size (&core->classes[i].aspace));
+  log_info ("%s: affinity: %zu/%zu hits (%.1f%%)", ifc->conf->name,
+            af->nhits, af->nlookups,
+            af->nlookups ? 100.0 * af->nhits / af->nlookups : 0.0);
+  log_info ("%s: probe: %zu conflicts", ifc->conf->name,
+            ifc->prober.nconflicts);
+  log_info ("%s: retransmissions: %zu/%zu answered from cache (%.1f%%)",
+            ifc->conf->name, rc->nhits, rc->nlookups,
+            rc->nlookups ? 100.0 * rc->nhits / rc->nlookups : 0.0);
+  if (core->adaptive.floor > 0)
+    log_info ("%s: lease time: %us, shortened %zu times, lengthened %zu times",
+              ifc->conf->name, core->adaptive.lease_time,
+              core->adaptive.nshortened, core->adaptive.nlengthened);
+  if (ifc->overload.nentered > 0)
+    log_info ("%s: overload: entered %zu times, %zu dropped by kernel, "
+              "%zu DISCOVERs shed", ifc->conf->name,
+              ifc->overload.nentered, ifc->overload.ndropped,
+              ifc->overload.nshed);
+  if (ifc->xdp.fd >= 0)
+    log_info ("%s: xdp: %zu received, %zu sent, %zu dropped",
+              ifc->conf->name, ifc->xdp.nreceived, ifc->xdp.nsent,
+              ifc->xdp.ndropped);
+  trace_dump (&ifc->trace);
+}
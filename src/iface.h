@@ -0,0 +1,57 @@
+#ifndef IFACE_H_INCLUDED
+#define IFACE_H_INCLUDED
+
+/* Served interfaces
+ *
+ * Every interface has its own socket and protocol engine, with its
+ * own address pool and lease table, all driven from the same event
+ * loop.
+ */
+
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/ether.h>
+
+#include "conf.h"
+#include "core.h"
+#include "probe.h"
+#include "trace.h"
+#include "overload.h"
+#include "xdp.h"
+
+struct iface {
+  /* Configuration of the interface */
+  const struct iface_conf *conf;
+
+  /* Socket bound to the interface */
+  int sockfd;
+
+  /* Protocol engine, holding pool and leases */
+  struct dhcp_core core;
+
+  /* Conflict prober */
+  struct prober prober;
+
+  /* Latency tracing of the socket */
+  struct trace trace;
+
+  /* Receive queue overload state */
+  struct overload overload;
+
+  /* AF_XDP datapath, its fd is -1 when not in use */
+  struct xdp_port xdp;
+};
+
+/* Open socket and set up state of an interface, with hostname
+ * as the server name in replies */
+int iface_open (struct iface *ifc, const struct iface_conf *ic,
+                const struct conf *conf, const char *hostname);
+
+/* Monotonic time (ms) of the next lease or probe deadline,
+ * -1 if none */
+int64_t iface_deadline (struct iface *ifc);
+
+/* Log interface statistics */
+void iface_dump (struct iface *ifc);
+
+#endif
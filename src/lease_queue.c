@@ -1,73 +1,364 @@
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <arpa/inet.h>
 
 #include "lease_queue.h"
+#include "clock.h"
+#include "hash.h"
 #include "log.h"
 
-void
-lq_init (struct lease_queue *lq)
+#define BIT_GET(set, i) (((set)[(i) / 64] >> ((i) % 64)) & 1)
+#define BIT_SET(set, i) ((set)[(i) / 64] |= (uint64_t) 1 << ((i) % 64))
+#define BIT_CLEAR(set, i) ((set)[(i) / 64] &= ~((uint64_t) 1 << ((i) % 64)))
+#define BIT_WORDS(n) (((n) + 63) / 64)
+
+/* Map an anonymous region, preferring huge pages if requested */
+static void *
+lq_map (size_t size, int huge_pages)
 {
-  lq->leases = NULL;
-  lq->nleases = 0;
-  lq->capac = 0;
+  void *ptr;
+
+  if (huge_pages) {
+    ptr = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED)
+      return ptr;
+  }
+
+  ptr = mmap (NULL, size, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED)
+    return NULL;
+
+  if (huge_pages)
+    madvise (ptr, size, MADV_HUGEPAGE);
+
+  return ptr;
 }
 
-void
-lq_deinit (struct lease_queue *lq)
+/* Save lease i into the snapshots that have yet to copy it, before
+ * it changes */
+static void
+lq_preserve (struct lease_queue *lq, size_t i)
 {
-  free (lq->leases);
+  for (struct lq_snapshot *snap = lq->snapshots; snap; snap = snap->next) {
+    if (i < snap->copied || i >= snap->count || BIT_GET (snap->saved, i))
+      continue;
+
+    snap->offsets[i] = lq->offsets[i];
+    snap->expires[i] = lq->expires[i];
+    snap->ethers[i] = lq->ethers[i];
+    BIT_SET (snap->saved, i);
+  }
 }
 
-int
-lq_add (struct lease_queue *lq, struct lease *lease)
+static int
+is_null_ether (const struct ether_addr *ether)
+{
+  static const struct ether_addr null_ether;
+  return memcmp (ether, &null_ether, sizeof (*ether)) == 0;
+}
+
+/* Index the lease at heap position i */
+static void
+lq_index_insert (struct lease_queue *lq, size_t i)
 {
-  if (lq->capac == 0) {
-    lq->capac = 2;
-    lq->leases = realloc (lq->leases, sizeof (*lq->leases) * lq->capac);
+  size_t mask = lq->index_size - 1;
+
+  if (is_null_ether (&lq->ethers[i])) {
+    lq->slots[i] = LQ_NO_SLOT;
+    return;
   }
 
-  if (lq->nleases == lq->capac) {
-    lq->capac *= 1.5f;
-    lq->leases = realloc (lq->leases, sizeof (*lq->leases) * lq->capac);
+  size_t s = hash_ether (&lq->ethers[i]) & mask;
+  while (lq->index[s] != 0)
+    s = (s + 1) & mask;
+
+  lq->index[s] = i + 1;
+  lq->slots[i] = s;
+}
+
+/* Remove the lease at heap position i from the index, shifting
+ * back later entries of the probe sequence into the hole */
+static void
+lq_index_delete (struct lease_queue *lq, size_t i)
+{
+  size_t mask = lq->index_size - 1;
+  size_t hole = lq->slots[i];
+
+  if (hole == LQ_NO_SLOT)
+    return;
+
+  lq->index[hole] = 0;
+  lq->slots[i] = LQ_NO_SLOT;
+
+  for (size_t s = (hole + 1) & mask; lq->index[s] != 0; s = (s + 1) & mask) {
+    size_t j = lq->index[s] - 1;
+    size_t home = hash_ether (&lq->ethers[j]) & mask;
+
+    /* Entries whose home lies cyclically in (hole, s] stay */
+    if (((s - home) & mask) < ((s - hole) & mask))
+      continue;
+
+    lq->index[hole] = j + 1;
+    lq->slots[j] = hole;
+    lq->index[s] = 0;
+    hole = s;
   }
+}
 
-  memcpy (&lq->leases[lq->nleases], lease, sizeof (*lease));
-  lq->nleases++;
+/* Allocate arrays for capac leases, copying existing leases */
+static int
+lq_resize (struct lease_queue *lq, size_t capac)
+{
+  size_t index_size = 1;
+  while (index_size < 2 * capac)
+    index_size *= 2;
 
-  /* heapify-up */
-  size_t ci = lq->nleases - 1;
+  uint32_t *offsets = lq_map (sizeof (*offsets) * capac, lq->huge_pages);
+  uint32_t *expires = lq_map (sizeof (*expires) * capac, lq->huge_pages);
+  struct ether_addr *ethers = lq_map (sizeof (*ethers) * capac, lq->huge_pages);
+  uint64_t *bound = lq_map (sizeof (*bound) * BIT_WORDS (capac),
+                            lq->huge_pages);
+  uint32_t *slots = lq_map (sizeof (*slots) * capac, lq->huge_pages);
+  uint32_t *index = lq_map (sizeof (*index) * index_size, lq->huge_pages);
+
+  if (offsets == NULL || expires == NULL || ethers == NULL
+      || bound == NULL || slots == NULL || index == NULL) {
+    log_errno ("Failed to allocate lease queue");
+    if (offsets)
+      munmap (offsets, sizeof (*offsets) * capac);
+    if (expires)
+      munmap (expires, sizeof (*expires) * capac);
+    if (ethers)
+      munmap (ethers, sizeof (*ethers) * capac);
+    if (bound)
+      munmap (bound, sizeof (*bound) * BIT_WORDS (capac));
+    if (slots)
+      munmap (slots, sizeof (*slots) * capac);
+    if (index)
+      munmap (index, sizeof (*index) * index_size);
+    return -1;
+  }
+
+  if (lq->capac > 0) {
+    memcpy (offsets, lq->offsets, sizeof (*offsets) * lq->nleases);
+    memcpy (expires, lq->expires, sizeof (*expires) * lq->nleases);
+    memcpy (ethers, lq->ethers, sizeof (*ethers) * lq->nleases);
+    memcpy (bound, lq->bound, sizeof (*bound) * BIT_WORDS (lq->nleases));
+    lq_deinit (lq);
+  }
+
+  lq->offsets = offsets;
+  lq->expires = expires;
+  lq->ethers = ethers;
+  lq->bound = bound;
+  lq->slots = slots;
+  lq->index = index;
+  lq->index_size = index_size;
+  lq->capac = capac;
+
+  for (size_t i = 0; i < lq->nleases; i++)
+    lq_index_insert (lq, i);
+
+  return 0;
+}
+
+static void
+lq_swap (struct lease_queue *lq, size_t i, size_t j)
+{
+  if (lq->snapshots) {
+    lq_preserve (lq, i);
+    lq_preserve (lq, j);
+  }
+
+  uint32_t offset = lq->offsets[i];
+  uint32_t expire = lq->expires[i];
+  struct ether_addr ether = lq->ethers[i];
+  int bound = BIT_GET (lq->bound, i);
+  uint32_t slot = lq->slots[i];
+
+  lq->offsets[i] = lq->offsets[j];
+  lq->expires[i] = lq->expires[j];
+  lq->ethers[i] = lq->ethers[j];
+  lq->slots[i] = lq->slots[j];
+  if (BIT_GET (lq->bound, j))
+    BIT_SET (lq->bound, i);
+  else
+    BIT_CLEAR (lq->bound, i);
+
+  lq->offsets[j] = offset;
+  lq->expires[j] = expire;
+  lq->ethers[j] = ether;
+  lq->slots[j] = slot;
+  if (bound)
+    BIT_SET (lq->bound, j);
+  else
+    BIT_CLEAR (lq->bound, j);
+
+  if (lq->slots[i] != LQ_NO_SLOT)
+    lq->index[lq->slots[i]] = i + 1;
+  if (lq->slots[j] != LQ_NO_SLOT)
+    lq->index[lq->slots[j]] = j + 1;
+}
+
+static size_t
+lq_heapify_up (struct lease_queue *lq, size_t ci)
+{
   while (ci > 0)
   {
     size_t pi = (ci + 1) / 2 - 1;
 
-    struct lease *child = &lq->leases[ci];
-    struct lease *parent = &lq->leases[pi];
+    if (lq->expires[ci] >= lq->expires[pi])
+      break;
 
-    if (child->expire < parent->expire) {
-      struct lease tmp;
+    lq_swap (lq, ci, pi);
+    ci = pi;
+  }
 
-      memcpy (&tmp, child, sizeof (struct lease));
-      memcpy (child, parent, sizeof (struct lease));
-      memcpy (parent, &tmp, sizeof (struct lease));
+  return ci;
+}
 
-      ci = pi;
-      continue;
-    }
+static size_t
+lq_heapify_down (struct lease_queue *lq, size_t pi)
+{
+  for (;;)
+  {
+    size_t mi = pi;
+    size_t li = 2 * (pi + 1) - 1;
+    size_t ri = li + 1;
+
+    if (li < lq->nleases && lq->expires[li] < lq->expires[mi])
+      mi = li;
 
-    break;
+    if (ri < lq->nleases && lq->expires[ri] < lq->expires[mi])
+      mi = ri;
+
+    if (mi == pi)
+      return pi;
+
+    lq_swap (lq, mi, pi);
+    pi = mi;
   }
+}
+
+int
+lq_init (struct lease_queue *lq, in_addr_t base, size_t capac,
+         int huge_pages, time_t epoch)
+{
+  lq->base = base;
+  lq->epoch = epoch;
+  lq->offsets = NULL;
+  lq->expires = NULL;
+  lq->ethers = NULL;
+  lq->bound = NULL;
+  lq->slots = NULL;
+  lq->index = NULL;
+  lq->index_size = 0;
+  lq->nleases = 0;
+  lq->capac = 0;
+  lq->huge_pages = huge_pages;
+  lq->snapshots = NULL;
+
+  if (capac < 2)
+    capac = 2;
+
+  return lq_resize (lq, capac);
+}
+
+void
+lq_deinit (struct lease_queue *lq)
+{
+  munmap (lq->offsets, sizeof (*lq->offsets) * lq->capac);
+  munmap (lq->expires, sizeof (*lq->expires) * lq->capac);
+  munmap (lq->ethers, sizeof (*lq->ethers) * lq->capac);
+  munmap (lq->bound, sizeof (*lq->bound) * BIT_WORDS (lq->capac));
+  munmap (lq->slots, sizeof (*lq->slots) * lq->capac);
+  munmap (lq->index, sizeof (*lq->index) * lq->index_size);
+}
+
+int
+lq_add (struct lease_queue *lq, const struct lease *lease)
+{
+  if (lq->nleases == lq->capac
+      && lq_resize (lq, lq->capac + lq->capac / 2) < 0)
+    return -1;
+
+  size_t i = lq->nleases++;
+
+  if (lq->snapshots)
+    lq_preserve (lq, i);
+
+  lq->offsets[i] = ntohl (lease->in_addr) - ntohl (lq->base);
+  lq->expires[i] = lease->expire > lq->epoch ? lease->expire - lq->epoch : 0;
+  lq->ethers[i] = lease->ether_addr;
+  if (lease->bound)
+    BIT_SET (lq->bound, i);
+  else
+    BIT_CLEAR (lq->bound, i);
+
+  lq_index_insert (lq, i);
+  lq_heapify_up (lq, i);
 
   return 0;
 }
 
-struct lease *
-lq_next (struct lease_queue *lq)
+void
+lq_get (struct lease_queue *lq, size_t i, struct lease *lease)
+{
+  lease->in_addr = htonl (ntohl (lq->base) + lq->offsets[i]);
+  lease->ether_addr = lq->ethers[i];
+  lease->expire = lq->epoch + lq->expires[i];
+  lease->bound = BIT_GET (lq->bound, i);
+}
+
+ssize_t
+lq_find (struct lease_queue *lq, const struct ether_addr *ether)
+{
+  size_t mask = lq->index_size - 1;
+
+  /* Quarantined addresses are not indexed */
+  if (is_null_ether (ether)) {
+    for (size_t i = 0; i < lq->nleases; i++)
+      if (is_null_ether (&lq->ethers[i]))
+        return i;
+    return -1;
+  }
+
+  for (size_t s = hash_ether (ether) & mask; lq->index[s] != 0;
+       s = (s + 1) & mask) {
+    size_t i = lq->index[s] - 1;
+    if (memcmp (&lq->ethers[i], ether, sizeof (*ether)) == 0)
+      return i;
+  }
+
+  return -1;
+}
+
+size_t
+lq_extend (struct lease_queue *lq, size_t i, time_t expire)
+{
+  if (lq->snapshots)
+    lq_preserve (lq, i);
+
+  lq->expires[i] = expire > lq->epoch ? expire - lq->epoch : 0;
+
+  size_t j = lq_heapify_up (lq, i);
+  if (j == i)
+    j = lq_heapify_down (lq, i);
+
+  return j;
+}
+
+int
+lq_next (struct lease_queue *lq, struct lease *lease)
 {
   if (lq->nleases == 0)
-    return NULL;
+    return -1;
 
-  return &lq->leases[0];
+  lq_get (lq, 0, lease);
+  return 0;
 }
 
 void
@@ -79,54 +370,112 @@ lq_pop (struct lease_queue *lq)
 void
 lq_remove (struct lease_queue *lq, size_t i)
 {
-  struct lease *leases = lq->leases;
-  struct lease *last = &leases[lq->nleases - 1];
-  struct lease *removed = &leases[i];
+  size_t last = --lq->nleases;
 
-  memcpy (removed, last, sizeof (struct lease));
-  lq->nleases--;
+  lq_index_delete (lq, i);
 
-  /* heapify-down */
-  size_t pi = i;
-  while (pi < lq->nleases - 1)
-  {
-    struct lease *parent = &leases[pi];
-    size_t mi = pi;
-    size_t li = 2 * (pi + 1) - 1;
-    size_t ri = li + 1;
+  if (i == last)
+    return;
 
-    if (li <= lq->nleases && leases[li].expire < leases[mi].expire)
-      mi = li;
+  lq_swap (lq, i, last);
 
-    if (ri <= lq->nleases && leases[ri].expire < leases[mi].expire)
-      mi = ri;
+  /* The moved lease may belong either above or below */
+  if (lq_heapify_up (lq, i) == i)
+    lq_heapify_down (lq, i);
+}
 
-    if (mi == pi)
-      return;
+/* Stop saving leases for a snapshot */
+static void
+lq_snapshot_detach (struct lease_queue *lq, struct lq_snapshot *snap)
+{
+  for (struct lq_snapshot **p = &lq->snapshots; *p; p = &(*p)->next)
+    if (*p == snap) {
+      *p = snap->next;
+      break;
+    }
+}
 
-    struct lease tmp;
-    struct lease *child = &leases[mi];
+int
+lq_snapshot_begin (struct lease_queue *lq, struct lq_snapshot *snap)
+{
+  size_t n = lq->nleases;
 
-    memcpy (&tmp, child, sizeof (struct lease));
-    memcpy (child, parent, sizeof (struct lease));
-    memcpy (parent, &tmp, sizeof (struct lease));
+  memset (snap, 0, sizeof (*snap));
+  snap->count = n;
 
-    pi = mi;
+  /* Nothing to copy, and nothing to keep track of */
+  if (n == 0)
+    return 0;
+
+  snap->offsets = malloc (sizeof (*snap->offsets) * n);
+  snap->expires = malloc (sizeof (*snap->expires) * n);
+  snap->ethers = malloc (sizeof (*snap->ethers) * n);
+  snap->saved = calloc ((n + 63) / 64, sizeof (*snap->saved));
+
+  if (!snap->offsets || !snap->expires || !snap->ethers || !snap->saved) {
+    lq_snapshot_end (lq, snap);
+    return -1;
   }
+
+  snap->next = lq->snapshots;
+  lq->snapshots = snap;
+  return 0;
+}
+
+int
+lq_snapshot_step (struct lease_queue *lq, struct lq_snapshot *snap,
+                  size_t n)
+{
+  if (snap->copied == snap->count)
+    return 1;
+
+  size_t end = snap->copied + n < snap->count ? snap->copied + n
+                                               : snap->count;
+
+  for (size_t i = snap->copied; i < end; i++) {
+    if (BIT_GET (snap->saved, i))
+      continue;
+    snap->offsets[i] = lq->offsets[i];
+    snap->expires[i] = lq->expires[i];
+    snap->ethers[i] = lq->ethers[i];
+  }
+  snap->copied = end;
+
+  if (snap->copied < snap->count)
+    return 0;
+
+  /* Complete, the queue no longer needs to save leases for it */
+  lq_snapshot_detach (lq, snap);
+  return 1;
+}
+
+void
+lq_snapshot_end (struct lease_queue *lq, struct lq_snapshot *snap)
+{
+  lq_snapshot_detach (lq, snap);
+
+  free (snap->offsets);
+  free (snap->expires);
+  free (snap->ethers);
+  free (snap->saved);
+  memset (snap, 0, sizeof (*snap));
 }
 
 void
 lq_dump (struct lease_queue *lq)
 {
-  for (int i = 0; i < lq->nleases; i++) {
-    struct lease *lease = &lq->leases[i];
+  for (size_t i = 0; i < lq->nleases; i++) {
+    struct lease lease;
+    lq_get (lq, i, &lease);
 
-    struct in_addr in_addr = { .s_addr = lease->in_addr };
+    struct in_addr in_addr = { .s_addr = lease.in_addr };
     char buf[INET_ADDRSTRLEN];
     inet_ntop(AF_INET, &in_addr, buf, sizeof (buf));
 
-    char *expire = ctime (&lease->expire);
-    char *ether = ether_ntoa (&lease->ether_addr);
+    time_t wall = clock_wall (lease.expire);
+    char expire[26], ether[18];
+    ctime_r (&wall, expire);
+    ether_ntoa_r (&lease.ether_addr, ether);
 
     log_info ("%s, %s, %s\n", buf, ether, expire);
   }
@@ -3,10 +3,14 @@
 
 /* Lease handling */
 
+#include <stdint.h>
+#include <sys/types.h>
 #include <time.h>
 #include <netinet/in.h>
 #include <netinet/ether.h>
 
+#define LQ_NO_SLOT UINT32_MAX
+
 struct lease {
   /* Assigned IPv4 address */
   in_addr_t in_addr;
@@ -14,32 +18,106 @@ struct lease {
   /* Hardware address */
   struct ether_addr ether_addr;
 
-  /* Expiration time */
+  /* Expiration time, in monotonic seconds */
   time_t expire;
+
+  /* Whether the host took the address, as opposed to it only being
+   * offered or held back */
+  uint8_t bound;
 };
 
+/* Point-in-time copy of a lease queue, taken a step at a time.
+ * Leases below the copy position are copied already. Leases at or
+ * past it are copied by the steps, unless the queue saved them when
+ * it was about to change them. */
+struct lq_snapshot {
+  uint32_t *offsets;
+  uint32_t *expires;
+  struct ether_addr *ethers;
+
+  /* Number of leases, copy position, and bit set of the leases
+   * saved ahead of the copy position */
+  size_t count;
+  size_t copied;
+  uint64_t *saved;
+
+  /* Other snapshots being taken of the same queue */
+  struct lq_snapshot *next;
+};
+
+/* Leases are kept in a binary min-heap ordered by expiration
+ * time, stored as separate arrays to keep each lease at
+ * 14 bytes and a bit instead of the 24 of a padded struct lease.
+ *
+ * A hash index from hardware address to heap position makes
+ * finding the lease of a host constant time. Quarantined
+ * addresses all have the null hardware address and are left
+ * out of the index. */
 struct lease_queue {
-  /* Set of active leases */
-  struct lease *leases;
+  /* Address that lease addresses are stored relative to */
+  in_addr_t base;
+
+  /* Time that expiration times are stored relative to */
+  time_t epoch;
+
+  /* Assigned addresses, as host order offsets from base */
+  uint32_t *offsets;
+
+  /* Expiration times, in seconds since epoch */
+  uint32_t *expires;
+
+  /* Hardware addresses */
+  struct ether_addr *ethers;
+
+  /* Bit set of the bound leases */
+  uint64_t *bound;
+
+  /* Index slot of each lease, LQ_NO_SLOT if not indexed */
+  uint32_t *slots;
+
+  /* Open addressing hash index, slots hold heap position + 1,
+   * 0 if empty */
+  uint32_t *index;
+
+  /* Number of slots in the index, a power of two */
+  size_t index_size;
 
   /* Number of active leases */
   size_t nleases;
 
   /* Allocation size */
   size_t capac;
+
+  /* Try to back the arrays with huge pages */
+  int huge_pages;
+
+  /* Snapshots being taken, NULL if none */
+  struct lq_snapshot *snapshots;
 };
 
-/* Initialize lease set */
-void lq_init (struct lease_queue *lq);
+/* Initialize lease set with room for capac leases, storing times
+ * relative to epoch */
+int lq_init (struct lease_queue *lq, in_addr_t base, size_t capac,
+             int huge_pages, time_t epoch);
 
 /* Deinitialize lease set */
 void lq_deinit (struct lease_queue *lq);
 
 /* Add a new lease */
-int lq_add (struct lease_queue *lq, struct lease *lease);
+int lq_add (struct lease_queue *lq, const struct lease *lease);
+
+/* Get the lease at specified index */
+void lq_get (struct lease_queue *lq, size_t i, struct lease *lease);
 
-/* Get the lease that will expire next */
-struct lease *lq_next (struct lease_queue *lq);
+/* Find the lease of a hardware address, returns -1 if none */
+ssize_t lq_find (struct lease_queue *lq, const struct ether_addr *ether);
+
+/* Change the expiration time of the lease at specified index,
+ * returns the new index of the lease */
+size_t lq_extend (struct lease_queue *lq, size_t i, time_t expire);
+
+/* Get the lease that will expire next, returns -1 if empty */
+int lq_next (struct lease_queue *lq, struct lease *lease);
 
 /* Remove the lease that will expire next */
 void lq_pop (struct lease_queue *lq);
@@ -47,6 +125,17 @@ void lq_pop (struct lease_queue *lq);
 /* Remove lease at specified index */
 void lq_remove (struct lease_queue *lq, size_t i);
 
+/* Start a snapshot of the leases, returns -1 if out of memory */
+int lq_snapshot_begin (struct lease_queue *lq, struct lq_snapshot *snap);
+
+/* Copy up to n more leases into a snapshot, returns 1 once the
+ * snapshot is complete */
+int lq_snapshot_step (struct lease_queue *lq, struct lq_snapshot *snap,
+                      size_t n);
+
+/* Dispose of a snapshot, complete or not */
+void lq_snapshot_end (struct lease_queue *lq, struct lq_snapshot *snap);
+
 /* Print the contents of the lease queue */
 void lq_dump (struct lease_queue *lq);
 
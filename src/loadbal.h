@@ -0,0 +1,46 @@
+#ifndef LOADBAL_H_INCLUDED
+#define LOADBAL_H_INCLUDED
+
+/* Load balancing between cooperating servers
+ * https://www.rfc-editor.org/rfc/rfc3074
+ *
+ * Each client is hashed into one of 256 buckets, and a server only
+ * answers clients in the buckets assigned to it.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#define LB_NBUCKETS 256
+
+struct lb {
+  /* Nonzero if load balancing is enabled */
+  int enabled;
+
+  /* Bit set of buckets served */
+  uint8_t buckets[LB_NBUCKETS / 8];
+
+  /* Number of requests ignored because of their bucket */
+  size_t nignored;
+};
+
+/* Hash a client identifier or hardware address into a bucket */
+uint8_t lb_hash (const uint8_t *key, size_t len);
+
+/* Enable load balancing with a set of buckets */
+void lb_set_buckets (struct lb *lb, const uint8_t *buckets);
+
+/* Check if a bucket is served */
+int lb_serves (struct lb *lb, uint8_t bucket);
+
+/* Parse a bucket set like "0-63,128-191" */
+int lb_parse_buckets (const char *str, uint8_t *buckets);
+
+/* Assign every count:th bucket, starting at index */
+void lb_split_buckets (int index, int count, uint8_t *buckets);
+
+/* Narrow an address range to the index:th of count slices */
+void lb_split_range (int index, int count, in_addr_t *lo, in_addr_t *hi);
+
+#endif
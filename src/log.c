@@ -7,29 +7,26 @@
 
 #include "log.h"
 
-static __thread char *user_msg_buf = NULL;
+/* Longer messages are truncated, so that logging never touches
+ * the heap */
+#define LOG_MSG_MAX 1024
+
+static __thread char user_msg_buf[LOG_MSG_MAX];
+static __thread char timestamp_buf[26];
+static int quiet;
 
 static void
 set_user_msg (const char *fmt, va_list ap)
 {
-  va_list ap_copy;
-  size_t size;
-
-  va_copy (ap_copy, ap);
-
-  size = 1 + vsnprintf (NULL, 0, fmt, ap);
-  user_msg_buf = realloc (user_msg_buf, size);
+  vsnprintf (user_msg_buf, sizeof (user_msg_buf), fmt, ap);
   va_end (ap);
-
-  vsnprintf (user_msg_buf, size, fmt, ap_copy);
-  va_end (ap_copy);
 }
 
 static const char *
 timestamp (void)
 {
   time_t t = time (NULL);
-  char *ts = ctime (&t);
+  char *ts = ctime_r (&t, timestamp_buf);
 
   for (char *p = ts; *p; p++)
     if (*p == '\n') {
@@ -40,9 +37,18 @@ timestamp (void)
   return ts;
 }
 
+void
+log_quiet (int q)
+{
+  quiet = q;
+}
+
 void
 log_info (const char *fmt, ...)
 {
+  if (quiet)
+    return;
+
   va_list ap;
   va_start (ap, fmt);
   set_user_msg (fmt, ap);
@@ -1,6 +1,9 @@
 #ifndef LOG_H_INCLUDED
 #define LOG_H_INCLUDED
 
+/* Suppress informational messages */
+void log_quiet (int quiet);
+
 void log_info (const char *fmt, ...);
 void log_error (const char *fmt, ...);
 void log_errno (const char *fmt, ...);
@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "macfilter.h"
+#include "log.h"
+
+/* Fingerprints per bucket, and buckets filled on average */
+#define SLOTS 4
+#define LOAD 0.95
+
+/* Evictions tried before the filter is made larger */
+#define MAX_KICKS 500
+
+#define ONES 0x0001000100010001ULL
+#define HIGHS 0x8000800080008000ULL
+
+static uint64_t
+pack (const struct ether_addr *ether)
+{
+  uint64_t key = 0;
+  for (int i = 0; i < ETHER_ADDR_LEN; i++)
+    key = key << 8 | ether->ether_addr_octet[i];
+  return key;
+}
+
+/* Finalizer of MurmurHash3, hardware addresses are often sequential */
+static uint64_t
+mix (uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+/* The low half of the hash picks the first bucket and the next 16
+ * bits are the fingerprint. The second bucket is the first reflected
+ * about a point that depends on the fingerprint only, so either one
+ * gives the other. */
+static uint16_t
+fingerprint (uint64_t hash)
+{
+  uint16_t fp = hash >> 32;
+  return fp ? fp : 1;
+}
+
+static size_t
+first_bucket (const struct mac_set *set, uint64_t hash)
+{
+  return ((hash & 0xffffffff) * set->nbuckets) >> 32;
+}
+
+static size_t
+other_bucket (const struct mac_set *set, size_t i, uint16_t fp)
+{
+  size_t pivot = ((uint64_t) (uint32_t) (fp * 0x5bd1e995u)
+                  * set->nbuckets) >> 32;
+  return pivot >= i ? pivot - i : pivot + set->nbuckets - i;
+}
+
+static int
+bucket_has (uint64_t bucket, uint16_t fp)
+{
+  uint64_t v = bucket ^ (fp * ONES);
+  return ((v - ONES) & ~v & HIGHS) != 0;
+}
+
+/* Find the slot of a key in a bucket, -1 if it is not there */
+static int
+bucket_find (const struct mac_set *set, size_t i, uint16_t fp, uint64_t key)
+{
+  if (!bucket_has (set->buckets[i], fp))
+    return -1;
+
+  for (int s = 0; s < SLOTS; s++)
+    if (((set->buckets[i] >> (16 * s)) & 0xffff) == fp
+        && set->keys[i * SLOTS + s] == key)
+      return s;
+
+  return -1;
+}
+
+/* Put a key in a free slot of a bucket */
+static int
+bucket_put (struct mac_set *set, size_t i, uint16_t fp, uint64_t key)
+{
+  for (int s = 0; s < SLOTS; s++) {
+    if (((set->buckets[i] >> (16 * s)) & 0xffff) == 0) {
+      set->buckets[i] |= (uint64_t) fp << (16 * s);
+      set->keys[i * SLOTS + s] = key;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static int
+insert (struct mac_set *set, uint64_t key, uint64_t *rng)
+{
+  uint64_t hash = mix (key);
+  uint16_t fp = fingerprint (hash);
+  size_t i = first_bucket (set, hash);
+  size_t j = other_bucket (set, i, fp);
+
+  /* Lists may repeat addresses */
+  if (bucket_find (set, i, fp, key) >= 0
+      || bucket_find (set, j, fp, key) >= 0)
+    return 0;
+
+  if (bucket_put (set, i, fp, key) == 0) {
+    set->nkeys++;
+    return 0;
+  }
+
+  for (int n = 0; n < MAX_KICKS; n++) {
+    if (bucket_put (set, j, fp, key) == 0) {
+      set->nkeys++;
+      return 0;
+    }
+
+    /* Evict a random key to its other bucket */
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 7;
+    *rng ^= *rng << 17;
+    int s = *rng % SLOTS;
+    uint16_t victim_fp = set->buckets[j] >> (16 * s);
+    uint64_t victim = set->keys[j * SLOTS + s];
+    set->buckets[j] &= ~(0xffffULL << (16 * s));
+    set->buckets[j] |= (uint64_t) fp << (16 * s);
+    set->keys[j * SLOTS + s] = key;
+    fp = victim_fp;
+    key = victim;
+    j = other_bucket (set, j, fp);
+  }
+
+  return -1;
+}
+
+/* Build a set of n keys */
+static int
+build (struct mac_set *set, const uint64_t *keys, size_t n)
+{
+  memset (set, 0, sizeof (*set));
+  set->nbuckets = n / (SLOTS * LOAD) + 1;
+
+  for (;;) {
+    uint64_t rng = 0x9e3779b97f4a7c15ULL;
+    size_t i;
+
+    set->nkeys = 0;
+    set->buckets = calloc (set->nbuckets, sizeof (*set->buckets));
+    set->keys = malloc (sizeof (*set->keys) * set->nbuckets * SLOTS);
+    if (set->buckets == NULL || set->keys == NULL) {
+      mf_deinit (set);
+      return -1;
+    }
+
+    for (i = 0; i < n; i++)
+      if (insert (set, keys[i], &rng) < 0)
+        break;
+    if (i == n)
+      return 0;
+
+    /* Too full to place every key, start over larger */
+    free (set->buckets);
+    free (set->keys);
+    set->nbuckets += set->nbuckets / 8 + 1;
+  }
+}
+
+int
+mf_load (struct mac_set *set, const char *path)
+{
+  uint64_t *keys = NULL;
+  size_t n = 0, capac = 0;
+  char *line = NULL;
+  size_t line_size = 0;
+  int lineno = 0;
+  int ret = -1;
+
+  FILE *f = fopen (path, "r");
+  if (f == NULL) {
+    log_errno ("Failed to open %s", path);
+    return -1;
+  }
+
+  while (getline (&line, &line_size, f) >= 0) {
+    struct ether_addr ether;
+    char *str = line;
+    lineno++;
+
+    str[strcspn (str, "#\n")] = '\0';
+    while (isspace ((unsigned char) *str))
+      str++;
+    if (*str == '\0')
+      continue;
+    str[strcspn (str, " \t\r")] = '\0';
+
+    if (ether_aton_r (str, &ether) == NULL) {
+      log_error ("%s:%d: Invalid hardware address", path, lineno);
+      goto done;
+    }
+
+    if (n == capac) {
+      capac = capac ? capac * 2 : 1024;
+      uint64_t *tmp = realloc (keys, sizeof (*keys) * capac);
+      if (tmp == NULL) {
+        log_error ("Out of memory");
+        goto done;
+      }
+      keys = tmp;
+    }
+
+    keys[n++] = pack (&ether);
+  }
+
+  if (ferror (f)) {
+    log_errno ("Failed to read %s", path);
+    goto done;
+  }
+
+  if (build (set, keys, n) < 0) {
+    log_error ("Out of memory");
+    goto done;
+  }
+
+  ret = 0;
+
+done:
+  free (line);
+  free (keys);
+  fclose (f);
+  return ret;
+}
+
+int
+mf_contains (const struct mac_set *set, const struct ether_addr *ether)
+{
+  if (set->nkeys == 0)
+    return 0;
+
+  uint64_t key = pack (ether);
+  uint64_t hash = mix (key);
+  uint16_t fp = fingerprint (hash);
+  size_t i = first_bucket (set, hash);
+  size_t j = other_bucket (set, i, fp);
+
+  /* Start every miss a lookup may take at once */
+  __builtin_prefetch (&set->buckets[j]);
+  __builtin_prefetch (&set->keys[i * SLOTS]);
+
+  return bucket_find (set, i, fp, key) >= 0
+         || bucket_find (set, j, fp, key) >= 0;
+}
+
+size_t
+mf_memory (const struct mac_set *set)
+{
+  return (sizeof (*set->buckets) + sizeof (*set->keys) * SLOTS)
+         * set->nbuckets;
+}
+
+void
+mf_deinit (struct mac_set *set)
+{
+  free (set->buckets);
+  free (set->keys);
+  memset (set, 0, sizeof (*set));
+}
+
+int
+mf_permits (struct mac_acl *acl, const struct ether_addr *ether)
+{
+  if ((acl->have_deny && mf_contains (&acl->deny, ether))
+      || (acl->have_allow && !mf_contains (&acl->allow, ether))) {
+    acl->ndenied++;
+    return 0;
+  }
+
+  return 1;
+}
+
+void
+mf_acl_deinit (struct mac_acl *acl)
+{
+  mf_deinit (&acl->allow);
+  mf_deinit (&acl->deny);
+  acl->have_allow = 0;
+  acl->have_deny = 0;
+}
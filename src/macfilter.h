@@ -0,0 +1,60 @@
+#ifndef MACFILTER_H_INCLUDED
+#define MACFILTER_H_INCLUDED
+
+/* Hardware address access lists
+ *
+ * Lists of allowed and denied hardware addresses, read from files of
+ * one address per line, that can hold millions of entries. A set is
+ * a cuckoo filter of 16 bit fingerprints, four to a bucket, with the
+ * addresses themselves in a table parallel to it. Most addresses
+ * not in the set are turned away by the filter alone, from two
+ * buckets of 8 bytes, and only slots whose fingerprint matches have
+ * their address compared, so a lookup is exact in at most four
+ * cache lines.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/ether.h>
+
+struct mac_set {
+  /* Buckets of four fingerprints, 0 marks an empty slot */
+  uint64_t *buckets;
+  size_t nbuckets;
+
+  /* Address of each slot, packed in the low 48 bits */
+  uint64_t *keys;
+  size_t nkeys;
+};
+
+struct mac_acl {
+  /* Only addresses in the allow list are served, if there is
+   * one, and addresses in the deny list never are */
+  struct mac_set allow;
+  struct mac_set deny;
+  int have_allow;
+  int have_deny;
+
+  /* Messages turned away */
+  size_t ndenied;
+};
+
+/* Read a set from a file, returns -1 on error */
+int mf_load (struct mac_set *set, const char *path);
+
+/* Whether an address is in a set */
+int mf_contains (const struct mac_set *set, const struct ether_addr *ether);
+
+/* Bytes of memory taken by a set */
+size_t mf_memory (const struct mac_set *set);
+
+/* Dispose of a set */
+void mf_deinit (struct mac_set *set);
+
+/* Whether the access lists let an address be served */
+int mf_permits (struct mac_acl *acl, const struct ether_addr *ether);
+
+/* Dispose of access lists */
+void mf_acl_deinit (struct mac_acl *acl);
+
+#endif
@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+
+#include <linux/sock_diag.h>
+
+#include "overload.h"
+#include "clock.h"
+#include "log.h"
+
+/* Time (ms) the queue must stay calm before leaving overload mode */
+static const int64_t calm_period = 1000;
+
+/* Fill of the receive queue, in 1/256ths of its size */
+static int
+ol_fill (int sockfd)
+{
+  uint32_t meminfo[SK_MEMINFO_VARS];
+  socklen_t len = sizeof (meminfo);
+
+  if (getsockopt (sockfd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) < 0
+      || meminfo[SK_MEMINFO_RCVBUF] == 0)
+    return 0;
+
+  return (uint64_t) meminfo[SK_MEMINFO_RMEM_ALLOC] * 256
+         / meminfo[SK_MEMINFO_RCVBUF];
+}
+
+/* Classify a message by type and ciaddr, without a full parse */
+static enum ol_class
+ol_classify (const struct dhcp_msg *msg, size_t len)
+{
+  const uint8_t *p = msg->options + 4;
+  const uint8_t *end = (const uint8_t *) msg + len;
+
+  while (p + 2 < end && *p != DHCP_OPT_END_OPTION) {
+    if (*p == DHCP_OPT_PAD_OPTION) {
+      p++;
+      continue;
+    }
+
+    if (*p == DHCP_OPT_DHCP_MESSAGE_TYPE) {
+      if (p[2] == DHCP_MSG_TYPE_DHCPDISCOVER)
+        return OL_DISCOVER;
+      if (p[2] == DHCP_MSG_TYPE_DHCPREQUEST && msg->ciaddr != 0)
+        return OL_RENEW;
+      return OL_REQUEST;
+    }
+
+    p += 2 + p[1];
+  }
+
+  return OL_REQUEST;
+}
+
+int
+ol_init (struct overload *ol, int sockfd)
+{
+  int enable = 1;
+
+  memset (ol, 0, sizeof (*ol));
+
+  if (setsockopt (sockfd, SOL_SOCKET, SO_RXQ_OVFL,
+                  &enable, sizeof (enable)) < 0) {
+    log_errno ("Failed to enable drop counts");
+    return -1;
+  }
+
+  return 0;
+}
+
+void
+ol_rx (struct overload *ol, const struct msghdr *mh)
+{
+  struct cmsghdr *cmsg;
+
+  for (cmsg = CMSG_FIRSTHDR (mh); cmsg;
+       cmsg = CMSG_NXTHDR ((struct msghdr *) mh, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SO_RXQ_OVFL)
+      continue;
+
+    uint32_t drops;
+    memcpy (&drops, CMSG_DATA (cmsg), sizeof (drops));
+    if (drops != ol->kernel_drops) {
+      ol->ndropped += drops - ol->kernel_drops;
+      ol->kernel_drops = drops;
+      ol->dropping = 1;
+    }
+  }
+}
+
+void
+ol_update (struct overload *ol, int sockfd)
+{
+  int64_t now = clock_ms ();
+  int fill = ol_fill (sockfd);
+
+  /* Enter at half full or on drops, leave once the queue has
+   * stayed below an eighth for a while */
+  if (ol->dropping || fill >= 128) {
+    ol->calm_since = 0;
+    if (!ol->active) {
+      log_info ("Receive queue overloaded, prioritizing renewals");
+      ol->active = 1;
+      ol->nentered++;
+    }
+  } else if (ol->active && fill < 32) {
+    if (ol->calm_since == 0)
+      ol->calm_since = now;
+    if (now - ol->calm_since >= calm_period) {
+      log_info ("Receive queue recovered, %zu DISCOVERs shed", ol->nshed);
+      ol->active = 0;
+    }
+  }
+
+  ol->dropping = 0;
+}
+
+int
+ol_backlogged (int sockfd)
+{
+  return ol_fill (sockfd) >= 32;
+}
+
+size_t
+ol_recv (struct overload *ol, int sockfd, struct ol_batch *b)
+{
+  struct mmsghdr mmh[OL_BATCH];
+
+  for (size_t i = 0; i < OL_BATCH; i++) {
+    b->iovs[i].iov_base = &b->msgs[i];
+    b->iovs[i].iov_len = sizeof (b->msgs[i]);
+    memset (&mmh[i], 0, sizeof (mmh[i]));
+    mmh[i].msg_hdr.msg_iov = &b->iovs[i];
+    mmh[i].msg_hdr.msg_iovlen = 1;
+    mmh[i].msg_hdr.msg_control = b->control[i];
+    mmh[i].msg_hdr.msg_controllen = sizeof (b->control[i]);
+  }
+
+  int n = recvmmsg (sockfd, mmh, OL_BATCH, MSG_DONTWAIT, NULL);
+  if (n < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      log_errno ("recvmmsg()");
+    n = 0;
+  }
+
+  size_t counts[OL_NCLASSES] = { 0 };
+  for (int i = 0; i < n; i++) {
+    size_t len = mmh[i].msg_len;
+
+    /* Short messages read as if zero padded */
+    memset ((uint8_t *) &b->msgs[i] + len, 0, sizeof (b->msgs[i]) - len);
+    b->lens[i] = len;
+    b->hdrs[i] = mmh[i].msg_hdr;
+    b->classes[i] = ol_classify (&b->msgs[i], len);
+    counts[b->classes[i]]++;
+    ol_rx (ol, &b->hdrs[i]);
+  }
+
+  /* Counting sort by class, keeping arrival order within a class */
+  size_t next[OL_NCLASSES];
+  size_t pos = 0;
+  for (int c = 0; c < OL_NCLASSES; c++) {
+    next[c] = pos;
+    pos += counts[c];
+  }
+  for (int i = 0; i < n; i++)
+    b->order[next[b->classes[i]]++] = i;
+
+  b->count = n;
+  ol->nbatches++;
+
+  return n;
+}
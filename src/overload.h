@@ -0,0 +1,91 @@
+#ifndef OVERLOAD_H_INCLUDED
+#define OVERLOAD_H_INCLUDED
+
+/* Overload handling
+ *
+ * The kernel drops datagrams at random once the receive queue of a
+ * socket is full, so a flood of DISCOVERs from booting clients would
+ * crowd out the renewals of clients that are already bound. The
+ * socket reports its drop count (SO_RXQ_OVFL) and queue fill
+ * (SO_MEMINFO). When the queue fills up or drops show up, the server
+ * switches to draining the queue in batches. It serves renewals first
+ * and other requests next, and sheds DISCOVERs while the queue stays
+ * backed up.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "dhcp.h"
+
+#define OL_BATCH 64
+
+/* Priority classes, served in this order */
+enum ol_class {
+  OL_RENEW,
+  OL_REQUEST,
+  OL_DISCOVER,
+  OL_NCLASSES,
+};
+
+/* Messages read in one batch */
+struct ol_batch {
+  struct dhcp_msg msgs[OL_BATCH];
+  size_t lens[OL_BATCH];
+  struct msghdr hdrs[OL_BATCH];
+  struct iovec iovs[OL_BATCH];
+  char control[OL_BATCH][256];
+  uint8_t classes[OL_BATCH];
+
+  /* Indices of the messages in priority order */
+  uint8_t order[OL_BATCH];
+
+  /* Number of messages */
+  size_t count;
+};
+
+struct overload {
+  /* Draining in batches */
+  int active;
+
+  /* Last drop count reported by the kernel */
+  uint32_t kernel_drops;
+
+  /* Drops seen since the last update */
+  int dropping;
+
+  /* Monotonic time (ms) since which the queue is calm */
+  int64_t calm_since;
+
+  /* Number of datagrams dropped by the kernel */
+  size_t ndropped;
+
+  /* Number of DISCOVERs shed */
+  size_t nshed;
+
+  /* Number of batches read */
+  size_t nbatches;
+
+  /* Number of times overload mode was entered */
+  size_t nentered;
+};
+
+/* Initialize state and enable drop counts on a socket */
+int ol_init (struct overload *ol, int sockfd);
+
+/* Account for the drop count of a received message */
+void ol_rx (struct overload *ol, const struct msghdr *mh);
+
+/* Check the receive queue and enter or leave overload mode */
+void ol_update (struct overload *ol, int sockfd);
+
+/* Whether the receive queue is still backed up */
+int ol_backlogged (int sockfd);
+
+/* Read a batch of messages and order them by priority, returns
+ * the number of messages read */
+size_t ol_recv (struct overload *ol, int sockfd, struct ol_batch *b);
+
+#endif
@@ -0,0 +1,218 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "probe.h"
+#include "clock.h"
+#include "log.h"
+
+/* Verified addresses older than this are probed again */
+static const int64_t ready_max_age = 30 * 1000;
+
+static uint16_t
+icmp_checksum (const void *buf, size_t len)
+{
+  const uint8_t *bytes = buf;
+  uint32_t sum = 0;
+
+  for (size_t i = 0; i + 1 < len; i += 2)
+    sum += (bytes[i] << 8) | bytes[i + 1];
+
+  if (len & 1)
+    sum += bytes[len - 1] << 8;
+
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+
+  return htons (~sum & 0xffff);
+}
+
+static void
+probe_send (struct prober *pr, in_addr_t addr)
+{
+  struct icmphdr hdr;
+  memset (&hdr, 0, sizeof (hdr));
+  hdr.type = ICMP_ECHO;
+  hdr.un.echo.id = htons (pr->ident);
+  hdr.un.echo.sequence = htons (pr->seq++);
+  hdr.checksum = icmp_checksum (&hdr, sizeof (hdr));
+
+  struct sockaddr_in dst = {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = addr,
+  };
+
+  if (sendto (pr->sockfd, &hdr, sizeof (hdr), MSG_DONTWAIT,
+              (struct sockaddr *) &dst, sizeof (dst)) < 0)
+    log_errno ("Failed to send probe");
+}
+
+static void
+probe_push_pending (struct prober *pr, in_addr_t addr, int64_t now)
+{
+  size_t i = (pr->pending_head + pr->npending) % pr->depth;
+  pr->pending[i].in_addr = addr;
+  pr->pending[i].deadline = now + pr->timeout;
+  pr->npending++;
+
+  probe_send (pr, addr);
+}
+
+int
+probe_init (struct prober *pr, const char *interface,
+            size_t depth, int64_t timeout)
+{
+  memset (pr, 0, sizeof (*pr));
+  pr->sockfd = -1;
+
+  if (depth == 0)
+    return 0;
+
+  if ((pr->sockfd = socket (AF_INET, SOCK_RAW, IPPROTO_ICMP)) < 0) {
+    log_errno ("Failed to open probe socket");
+    return -1;
+  }
+
+  if (setsockopt (pr->sockfd, SOL_SOCKET, SO_BINDTODEVICE,
+                  interface, strlen (interface)) < 0) {
+    log_errno ("Failed to bind probe socket to device %s", interface);
+    close (pr->sockfd);
+    return -1;
+  }
+
+  pr->ident = getpid () & 0xffff;
+  pr->depth = depth;
+  pr->timeout = timeout;
+  pr->pending = calloc (depth, sizeof (*pr->pending));
+  pr->ready = calloc (depth, sizeof (*pr->ready));
+
+  return 0;
+}
+
+void
+probe_fill (struct prober *pr, struct addr_space *as)
+{
+  if (pr->sockfd < 0)
+    return;
+
+  int64_t now = clock_ms ();
+  in_addr_t addr;
+
+  while (pr->npending + pr->nready < pr->depth
+         && as_alloc (as, &addr) == 0)
+    probe_push_pending (pr, addr, now);
+}
+
+void
+probe_recv (struct prober *pr, struct lease_queue *lq, time_t hold_until)
+{
+  uint8_t buf[128];
+  ssize_t len;
+
+  while ((len = recv (pr->sockfd, buf, sizeof (buf), MSG_DONTWAIT)) > 0) {
+    struct iphdr *ip = (struct iphdr *) buf;
+    size_t hlen = ip->ihl * 4;
+
+    if ((size_t) len < hlen + sizeof (struct icmphdr))
+      continue;
+
+    struct icmphdr *icmp = (struct icmphdr *) (buf + hlen);
+    if (icmp->type != ICMP_ECHOREPLY || ntohs (icmp->un.echo.id) != pr->ident)
+      continue;
+
+    for (size_t k = 0; k < pr->npending; k++) {
+      struct probe *probe = &pr->pending[(pr->pending_head + k) % pr->depth];
+      if (probe->in_addr != ip->saddr)
+        continue;
+
+      /* Keep the address out of the pool for a lease time */
+      struct lease lease;
+      memset (&lease, 0, sizeof (lease));
+      lease.in_addr = probe->in_addr;
+      lease.expire = hold_until;
+      lq_add (lq, &lease);
+
+      struct in_addr in_addr = { .s_addr = probe->in_addr };
+      log_error ("Address conflict: %s is in use", inet_ntoa (in_addr));
+
+      /* Leave a tombstone, dropped when the probe times out */
+      probe->in_addr = 0;
+      pr->nconflicts++;
+      break;
+    }
+  }
+
+  if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    log_errno ("Failed to receive probe reply");
+}
+
+void
+probe_expire (struct prober *pr)
+{
+  if (pr->sockfd < 0)
+    return;
+
+  int64_t now = clock_ms ();
+
+  while (pr->npending > 0) {
+    struct probe *probe = &pr->pending[pr->pending_head];
+    if (probe->deadline > now)
+      break;
+
+    if (probe->in_addr != 0) {
+      size_t i = (pr->ready_head + pr->nready) % pr->depth;
+      pr->ready[i].in_addr = probe->in_addr;
+      pr->ready[i].deadline = now;
+      pr->nready++;
+    }
+
+    pr->pending_head = (pr->pending_head + 1) % pr->depth;
+    pr->npending--;
+  }
+}
+
+int
+probe_take (struct prober *pr, in_addr_t *addr, int64_t now)
+{
+  while (pr->nready > 0) {
+    struct probe *probe = &pr->ready[pr->ready_head];
+    pr->ready_head = (pr->ready_head + 1) % pr->depth;
+    pr->nready--;
+
+    /* Verified too long ago, probe again */
+    if (now - probe->deadline > ready_max_age) {
+      probe_push_pending (pr, probe->in_addr, now);
+      continue;
+    }
+
+    *addr = probe->in_addr;
+    return 0;
+  }
+
+  return -1;
+}
+
+int64_t
+probe_deadline (struct prober *pr)
+{
+  if (pr->npending == 0)
+    return -1;
+
+  return pr->pending[pr->pending_head].deadline;
+}
+
+void
+probe_deinit (struct prober *pr)
+{
+  if (pr->sockfd >= 0)
+    close (pr->sockfd);
+
+  free (pr->pending);
+  free (pr->ready);
+}
@@ -0,0 +1,83 @@
+#ifndef PROBE_H_INCLUDED
+#define PROBE_H_INCLUDED
+
+/* Address conflict probing
+ *
+ * Addresses are taken from the address space ahead of demand and
+ * probed with an ICMP echo request. Addresses that stay silent for
+ * the probe timeout are moved to a queue of verified addresses that
+ * can be offered right away. Addresses that answer are quarantined
+ * in the lease queue under the null hardware address.
+ */
+
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "addr_space.h"
+#include "lease_queue.h"
+
+struct probe {
+  /* Probed address */
+  in_addr_t in_addr;
+
+  /* Monotonic time (ms) at which the probe times out, or when
+   * in the ready queue, at which the address was verified */
+  int64_t deadline;
+};
+
+struct prober {
+  /* Raw ICMP socket, -1 if probing is disabled */
+  int sockfd;
+
+  /* ICMP echo identifier and next sequence number */
+  uint16_t ident;
+  uint16_t seq;
+
+  /* Number of addresses to keep probed or verified */
+  size_t depth;
+
+  /* Time to wait for an echo reply, in ms */
+  int64_t timeout;
+
+  /* Probes in flight, ordered by deadline */
+  struct probe *pending;
+  size_t pending_head;
+  size_t npending;
+
+  /* Verified addresses, ordered by verification time */
+  struct probe *ready;
+  size_t ready_head;
+  size_t nready;
+
+  /* Number of conflicts detected */
+  size_t nconflicts;
+};
+
+/* Initialize prober, a depth of zero disables probing */
+int probe_init (struct prober *pr, const char *interface,
+                size_t depth, int64_t timeout);
+
+/* Start probing addresses until depth addresses are in flight
+ * or verified */
+void probe_fill (struct prober *pr, struct addr_space *as);
+
+/* Read echo replies and quarantine conflicting addresses */
+void probe_recv (struct prober *pr, struct lease_queue *lq,
+                 time_t hold_until);
+
+/* Move timed out probes to the ready queue */
+void probe_expire (struct prober *pr);
+
+/* Take a verified address at monotonic time now (ms), returns -1
+ * if none is ready */
+int probe_take (struct prober *pr, in_addr_t *addr, int64_t now);
+
+/* Monotonic time (ms) at which the next probe times out,
+ * -1 if none */
+int64_t probe_deadline (struct prober *pr);
+
+/* Dispose of prober */
+void probe_deinit (struct prober *pr);
+
+#endif
@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "rcache.h"
+#include "hash.h"
+
+static size_t
+rc_slot (struct rcache *rc, const struct ether_addr *ether, uint32_t xid,
+         uint8_t type)
+{
+  uint32_t hash = hash_ether (ether) ^ xid ^ type;
+  hash *= 0x9e3779b1;
+  return (hash >> 16 ^ hash) & (rc->size - 1);
+}
+
+void
+rc_init (struct rcache *rc, size_t size, int64_t window)
+{
+  rc->size = 0;
+  rc->entries = NULL;
+  rc->window = window;
+  rc->pending = NULL;
+  rc->nlookups = 0;
+  rc->nhits = 0;
+
+  if (size == 0)
+    return;
+
+  rc->size = 1;
+  while (rc->size < size)
+    rc->size *= 2;
+
+  rc->entries = calloc (rc->size, sizeof (*rc->entries));
+  if (rc->entries == NULL)
+    rc->size = 0;
+}
+
+const struct rc_entry *
+rc_lookup (struct rcache *rc, const struct dhcp_msg *msg, uint8_t type,
+           int64_t now)
+{
+  const struct ether_addr *ether = (const struct ether_addr *) msg->chaddr;
+
+  rc->pending = NULL;
+  if (rc->size == 0)
+    return NULL;
+
+  rc->nlookups++;
+
+  struct rc_entry *entry = &rc->entries[rc_slot (rc, ether, msg->xid, type)];
+  if (entry->expire > now
+      && entry->xid == msg->xid && entry->type == type
+      && memcmp (&entry->ether_addr, ether, sizeof (*ether)) == 0) {
+    rc->nhits++;
+    return entry;
+  }
+
+  rc->pending = entry;
+  rc->pending_ether = *ether;
+  rc->pending_xid = msg->xid;
+  rc->pending_type = type;
+
+  return NULL;
+}
+
+void
+rc_put (struct rcache *rc, const struct dhcp_msg *reply, uint8_t reply_type,
+        const struct sockaddr_in *addr, int64_t now)
+{
+  struct rc_entry *entry = rc->pending;
+
+  if (entry == NULL)
+    return;
+
+  entry->ether_addr = rc->pending_ether;
+  entry->xid = rc->pending_xid;
+  entry->type = rc->pending_type;
+  entry->addr = *addr;
+  entry->reply_type = reply_type;
+  entry->reply = *reply;
+  entry->expire = now + rc->window;
+  rc->pending = NULL;
+}
+
+void
+rc_deinit (struct rcache *rc)
+{
+  free (rc->entries);
+}
@@ -0,0 +1,79 @@
+#ifndef RCACHE_H_INCLUDED
+#define RCACHE_H_INCLUDED
+
+/* Retransmission cache
+ *
+ * Remembers the replies sent to recent messages, keyed by hardware
+ * address, transaction id and message type. A retransmitted message
+ * is answered with the cached reply, without touching the address
+ * pool or the lease table again. The cache is a direct-mapped table,
+ * a newer reply simply replaces whatever occupied its slot.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <netinet/ether.h>
+
+#include "dhcp.h"
+
+struct rc_entry {
+  /* Hardware address, transaction id and type of the message */
+  struct ether_addr ether_addr;
+  uint32_t xid;
+  uint8_t type;
+
+  /* Monotonic time (ms) after which the entry is stale,
+   * 0 if the slot is empty */
+  int64_t expire;
+
+  /* Destination, type and contents of the reply */
+  struct sockaddr_in addr;
+  uint8_t reply_type;
+  struct dhcp_msg reply;
+};
+
+struct rcache {
+  /* Table of replies */
+  struct rc_entry *entries;
+
+  /* Number of slots, a power of two */
+  size_t size;
+
+  /* Time (ms) a reply is kept */
+  int64_t window;
+
+  /* Slot and key of the last message that missed, the slot is
+   * NULL if there is none */
+  struct rc_entry *pending;
+  struct ether_addr pending_ether;
+  uint32_t pending_xid;
+  uint8_t pending_type;
+
+  /* Number of lookups */
+  size_t nlookups;
+
+  /* Number of retransmissions answered from the cache */
+  size_t nhits;
+};
+
+/* Initialize cache with at least size slots that keep replies for
+ * window ms, a size of 0 disables it */
+void rc_init (struct rcache *rc, size_t size, int64_t window);
+
+/* Look up the reply to a message at monotonic time now (ms).
+ * Returns NULL on a miss, and the next rc_put stores the reply to
+ * the message. */
+const struct rc_entry *rc_lookup (struct rcache *rc,
+                                  const struct dhcp_msg *msg,
+                                  uint8_t type, int64_t now);
+
+/* Remember the reply to the message that last missed */
+void rc_put (struct rcache *rc, const struct dhcp_msg *reply,
+             uint8_t reply_type, const struct sockaddr_in *addr,
+             int64_t now);
+
+/* Dispose of cache */
+void rc_deinit (struct rcache *rc);
+
+#endif
@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "reserv.h"
+#include "core.h"
+#include "hash.h"
+#include "log.h"
+
+static size_t
+home_ether (const struct reserv *rv, const struct ether_addr *ether)
+{
+  return hash_ether (ether) & (rv->index_size - 1);
+}
+
+static size_t
+home_addr (const struct reserv *rv, in_addr_t addr)
+{
+  return hash_bytes (&addr, sizeof (addr)) & (rv->index_size - 1);
+}
+
+/* Home slot of host i in one of the indexes */
+static size_t
+home_of (const struct reserv *rv, const uint32_t *index, uint32_t i)
+{
+  if (index == rv->by_ether)
+    return home_ether (rv, &rv->hosts[i].ether_addr);
+  return home_addr (rv, rv->hosts[i].in_addr);
+}
+
+static void
+index_insert (struct reserv *rv, uint32_t *index, uint32_t i)
+{
+  size_t mask = rv->index_size - 1;
+  size_t s = home_of (rv, index, i);
+
+  while (index[s] != 0)
+    s = (s + 1) & mask;
+  index[s] = i + 1;
+}
+
+/* Slot holding host i in an index */
+static size_t
+index_slot (const struct reserv *rv, const uint32_t *index, uint32_t i)
+{
+  size_t mask = rv->index_size - 1;
+  size_t s = home_of (rv, index, i);
+
+  while (index[s] != i + 1)
+    s = (s + 1) & mask;
+  return s;
+}
+
+/* Remove host i from an index, shifting back later entries of the
+ * probe sequence into the hole */
+static void
+index_delete (struct reserv *rv, uint32_t *index, uint32_t i)
+{
+  size_t mask = rv->index_size - 1;
+  size_t hole = index_slot (rv, index, i);
+
+  index[hole] = 0;
+
+  for (size_t s = (hole + 1) & mask; index[s] != 0; s = (s + 1) & mask) {
+    size_t home = home_of (rv, index, index[s] - 1);
+
+    /* Entries whose home lies cyclically in (hole, s] stay */
+    if (((s - home) & mask) < ((s - hole) & mask))
+      continue;
+
+    index[hole] = index[s];
+    index[s] = 0;
+    hole = s;
+  }
+}
+
+/* Double the room for hosts and rebuild the indexes */
+static int
+grow (struct reserv *rv)
+{
+  size_t capac = rv->capac ? rv->capac * 2 : 1024;
+  size_t index_size = 1;
+  while (index_size < 2 * capac)
+    index_size *= 2;
+
+  struct static_conf *hosts = realloc (rv->hosts, sizeof (*hosts) * capac);
+  if (hosts == NULL)
+    return -1;
+  rv->hosts = hosts;
+
+  uint32_t *by_ether = calloc (index_size, sizeof (*by_ether));
+  uint32_t *by_addr = calloc (index_size, sizeof (*by_addr));
+  if (by_ether == NULL || by_addr == NULL) {
+    free (by_ether);
+    free (by_addr);
+    return -1;
+  }
+
+  free (rv->by_ether);
+  free (rv->by_addr);
+  rv->by_ether = by_ether;
+  rv->by_addr = by_addr;
+  rv->index_size = index_size;
+  rv->capac = capac;
+
+  for (size_t i = 0; i < rv->nhosts; i++) {
+    index_insert (rv, rv->by_ether, i);
+    index_insert (rv, rv->by_addr, i);
+  }
+
+  return 0;
+}
+
+/* Reserve an address for a host, in place of any it had */
+static int
+put (struct reserv *rv, const struct static_conf *host)
+{
+  const struct static_conf *old = rv_find (rv, &host->ether_addr);
+
+  if (old) {
+    uint32_t i = old - rv->hosts;
+    index_delete (rv, rv->by_addr, i);
+    rv->hosts[i] = *host;
+    index_insert (rv, rv->by_addr, i);
+    return 0;
+  }
+
+  if (rv->nhosts == rv->capac && grow (rv) < 0)
+    return -1;
+
+  uint32_t i = rv->nhosts++;
+  rv->hosts[i] = *host;
+  index_insert (rv, rv->by_ether, i);
+  index_insert (rv, rv->by_addr, i);
+  return 0;
+}
+
+/* Drop the reservation of a host */
+static void
+del (struct reserv *rv, const struct ether_addr *ether)
+{
+  const struct static_conf *host = rv_find (rv, ether);
+  if (host == NULL)
+    return;
+
+  uint32_t i = host - rv->hosts;
+  uint32_t last = rv->nhosts - 1;
+
+  index_delete (rv, rv->by_ether, i);
+  index_delete (rv, rv->by_addr, i);
+
+  /* Move the last host into the gap */
+  if (i != last) {
+    rv->by_ether[index_slot (rv, rv->by_ether, last)] = i + 1;
+    rv->by_addr[index_slot (rv, rv->by_addr, last)] = i + 1;
+    rv->hosts[i] = rv->hosts[last];
+  }
+
+  rv->nhosts--;
+}
+
+/* Reason an address cannot be reserved for a host, NULL if it can */
+static const char *
+check_addr (struct reserv *rv, const struct static_conf *host,
+            struct dhcp_core *const *cores, size_t ncores)
+{
+  const struct static_conf *owner = rv_find_addr (rv, host->in_addr);
+  if (owner && memcmp (&owner->ether_addr, &host->ether_addr,
+                       sizeof (host->ether_addr)) != 0)
+    return "address is reserved for another host";
+
+  for (size_t i = 0; i < ncores; i++) {
+    const struct dhcp_core *core = cores[i];
+    in_addr_t mask = core->iface->subnet_mask;
+
+    if ((host->in_addr & mask) != (core->server_addr & mask))
+      continue;
+
+    if (host->in_addr == core->server_addr)
+      return "address is the server address";
+    if (core_in_pool (core, host->in_addr))
+      return "address is in a dynamic pool";
+    return NULL;
+  }
+
+  return "address is not on the subnet of any interface";
+}
+
+int
+rv_init (struct reserv *rv, const struct conf *conf, size_t max_batch)
+{
+  memset (rv, 0, sizeof (*rv));
+  rv->max_batch = max_batch;
+  rv->undo = malloc (sizeof (*rv->undo) * max_batch);
+
+  if (rv->undo == NULL || grow (rv) < 0) {
+    log_error ("Out of memory for reservations");
+    return -1;
+  }
+
+  /* The first configuration of a hardware address takes precedence */
+  for (size_t i = 0; i < conf->nstatic_confs; i++) {
+    const struct static_conf *host = &conf->static_confs[i];
+    if (rv_find (rv, &host->ether_addr) == NULL && put (rv, host) < 0) {
+      log_error ("Out of memory for reservations");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+const struct static_conf *
+rv_find (const struct reserv *rv, const struct ether_addr *ether)
+{
+  size_t mask = rv->index_size - 1;
+
+  for (size_t s = home_ether (rv, ether); rv->by_ether[s] != 0;
+       s = (s + 1) & mask) {
+    const struct static_conf *host = &rv->hosts[rv->by_ether[s] - 1];
+    if (memcmp (&host->ether_addr, ether, sizeof (*ether)) == 0)
+      return host;
+  }
+
+  return NULL;
+}
+
+const struct static_conf *
+rv_find_addr (const struct reserv *rv, in_addr_t addr)
+{
+  size_t mask = rv->index_size - 1;
+
+  for (size_t s = home_addr (rv, addr); rv->by_addr[s] != 0;
+       s = (s + 1) & mask) {
+    const struct static_conf *host = &rv->hosts[rv->by_addr[s] - 1];
+    if (host->in_addr == addr)
+      return host;
+  }
+
+  return NULL;
+}
+
+/* Put every host back as it was, latest change first. The table
+ * never holds more hosts than it did on the way, so this does not
+ * need to grow it. */
+static void
+undo (struct reserv *rv)
+{
+  while (rv->nundo > 0) {
+    const struct rv_undo *u = &rv->undo[--rv->nundo];
+    if (u->reserved)
+      put (rv, &u->host);
+    else
+      del (rv, &u->ether);
+  }
+}
+
+int
+rv_apply (struct reserv *rv, const struct rv_op *ops, size_t nops,
+          struct dhcp_core *const *cores, size_t ncores,
+          char *err, size_t err_size)
+{
+  const char *reason = NULL;
+  size_t k;
+
+  if (nops > rv->max_batch) {
+    snprintf (err, err_size, "%zu: too many changes in batch",
+              rv->max_batch + 1);
+    rv->nrejected++;
+    return -1;
+  }
+
+  rv->nundo = 0;
+  for (k = 0; k < nops && reason == NULL; k++) {
+    const struct rv_op *op = &ops[k];
+    const struct static_conf *old = rv_find (rv, &op->host.ether_addr);
+    struct rv_undo *undo = &rv->undo[rv->nundo];
+
+    undo->ether = op->host.ether_addr;
+    undo->reserved = old != NULL;
+    if (old)
+      undo->host = *old;
+
+    if (op->type == RV_ADD && old) {
+      reason = "host is already reserved";
+    } else if (op->type != RV_ADD && old == NULL) {
+      reason = "host is not reserved";
+    } else if (op->type == RV_REMOVE) {
+      del (rv, &op->host.ether_addr);
+      rv->nundo++;
+    } else if ((reason = check_addr (rv, &op->host, cores, ncores)) == NULL) {
+      if (put (rv, &op->host) < 0)
+        reason = "out of memory";
+      else
+        rv->nundo++;
+    }
+  }
+
+  if (reason) {
+    undo (rv);
+    snprintf (err, err_size, "%zu: %s", k, reason);
+    rv->nrejected++;
+    return -1;
+  }
+
+  return 0;
+}
+
+void
+rv_commit (struct reserv *rv, struct dhcp_core *const *cores, size_t ncores,
+           time_t now)
+{
+  /* Hosts leased an address that is no longer theirs lose it */
+  for (size_t i = 0; i < rv->nundo; i++) {
+    const struct static_conf *host = rv_find (rv, &rv->undo[i].ether);
+    for (size_t c = 0; c < ncores; c++)
+      core_revoke (cores[c], &rv->undo[i].ether, host ? host->in_addr : 0,
+                   now);
+  }
+
+  rv->nbatches++;
+  rv->nchanges += rv->nundo;
+  rv->nundo = 0;
+}
+
+void
+rv_rollback (struct reserv *rv)
+{
+  undo (rv);
+  rv->nrejected++;
+}
+
+int
+rv_copy (struct reserv *copy, const struct reserv *rv)
+{
+  memset (copy, 0, sizeof (*copy));
+  copy->hosts = malloc (sizeof (*copy->hosts) * (rv->nhosts + 1));
+  copy->by_ether = malloc (sizeof (*copy->by_ether) * rv->index_size);
+
+  if (copy->hosts == NULL || copy->by_ether == NULL) {
+    rv_deinit (copy);
+    return -1;
+  }
+
+  memcpy (copy->hosts, rv->hosts, sizeof (*copy->hosts) * rv->nhosts);
+  memcpy (copy->by_ether, rv->by_ether,
+          sizeof (*copy->by_ether) * rv->index_size);
+  copy->nhosts = rv->nhosts;
+  copy->capac = rv->nhosts;
+  copy->index_size = rv->index_size;
+  return 0;
+}
+
+void
+rv_deinit (struct reserv *rv)
+{
+  free (rv->hosts);
+  free (rv->by_ether);
+  free (rv->by_addr);
+  free (rv->undo);
+  memset (rv, 0, sizeof (*rv));
+}
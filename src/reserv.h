@@ -0,0 +1,111 @@
+#ifndef RESERV_H_INCLUDED
+#define RESERV_H_INCLUDED
+
+/* Reservations
+ *
+ * Static hosts that can be added, changed and removed while the
+ * server runs. The table starts out with the static hosts of the
+ * configuration and from then on stands in for them: the engine
+ * looks hosts up here instead of in the configuration.
+ *
+ * Changes come in batches, which are applied as a whole or not at
+ * all. Every change is checked against the table as left by the
+ * changes before it: reserved addresses must be on the subnet of an
+ * interface, outside of its dynamic pools and not reserved for
+ * another host. A batch that passes is held pending until it is
+ * either committed or rolled back, so that it can still be withdrawn
+ * when it cannot be recorded. Once it is committed, hosts that hold a
+ * lease on an address other than the one now reserved for them lose
+ * it, and have to come back for their new address.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/ether.h>
+
+#include "conf.h"
+
+struct dhcp_core;
+
+enum rv_op_type {
+  RV_ADD = 1,
+  RV_MODIFY,
+  RV_REMOVE,
+};
+
+struct rv_op {
+  uint8_t type;
+
+  /* Host and, unless it is removed, its reservation */
+  struct static_conf host;
+};
+
+/* State of a host before the batch being applied changed it */
+struct rv_undo {
+  struct ether_addr ether;
+  int reserved;
+  struct static_conf host;
+};
+
+struct reserv {
+  /* Reserved hosts, in no particular order */
+  struct static_conf *hosts;
+  size_t nhosts;
+  size_t capac;
+
+  /* Hash indexes of hosts by hardware address and by address.
+   * Slots hold an index into hosts plus one, or 0 if empty. */
+  uint32_t *by_ether;
+  uint32_t *by_addr;
+  size_t index_size;
+
+  /* Changes of the pending batch, to roll it back */
+  struct rv_undo *undo;
+  size_t nundo;
+  size_t max_batch;
+
+  /* Counters */
+  size_t nbatches;
+  size_t nchanges;
+  size_t nrejected;
+};
+
+/* Initialize with the static hosts of a configuration, for batches
+ * of up to max_batch changes */
+int rv_init (struct reserv *rv, const struct conf *conf, size_t max_batch);
+
+/* Find the reservation of a host */
+const struct static_conf *rv_find (const struct reserv *rv,
+                                   const struct ether_addr *ether);
+
+/* Find the reservation of an address */
+const struct static_conf *rv_find_addr (const struct reserv *rv,
+                                        in_addr_t addr);
+
+/* Apply a batch of changes, checking them against the engines of the
+ * interfaces, and leave it pending. If a change is refused nothing is
+ * applied, and the number of the change and the reason are written to
+ * err. */
+int rv_apply (struct reserv *rv, const struct rv_op *ops, size_t nops,
+              struct dhcp_core *const *cores, size_t ncores,
+              char *err, size_t err_size);
+
+/* Commit the pending batch at monotonic time now (s), revoking the
+ * leases it took away from the engines */
+void rv_commit (struct reserv *rv, struct dhcp_core *const *cores,
+                size_t ncores, time_t now);
+
+/* Put every host the pending batch changed back as it was */
+void rv_rollback (struct reserv *rv);
+
+/* Copy the hosts of reservations and their index by hardware
+ * address, enough to rv_find in the copy while the original keeps
+ * changing */
+int rv_copy (struct reserv *copy, const struct reserv *rv);
+
+/* Dispose of reservations */
+void rv_deinit (struct reserv *rv);
+
+#endif
@@ -0,0 +1,779 @@
+/* Replay of captured traffic
+ *
+ * Reads a pcap capture, picks out the UDP datagrams sent to the
+ * server port and feeds them to the server in capture order. By
+ * default they go straight to the protocol engine, on the virtual
+ * time of the capture, so that a run is deterministic. With -i they
+ * are sent over an interface instead, to a server running on its
+ * other side, waiting for the reply to each before the next.
+ *
+ * Every reply is checked for consistency with its request, and the
+ * outcome of each message can be written to a decision log. Logs of
+ * two builds replayed on the same capture are compared with -c.
+ *
+ * Usage: dhcp-replay [-i iface] [-x speed] [-a server] [-w wait]
+ *                    [-o log] capture [conf]
+ *        dhcp-replay -c log log
+ *
+ *   -i  send over this interface instead of running in process
+ *   -x  replay at speed times the captured rate, 0 for as fast as
+ *       possible (0)
+ *   -a  server identifier, by default the first one in the capture
+ *   -w  time to wait for a reply over the interface, in ms (50)
+ *   -o  write the decision log to this file
+ *   -c  compare two decision logs
+ *
+ * Captures are read in the classic pcap format, with Ethernet, Linux
+ * cooked or raw IPv4 framing. In process, the settings of the first
+ * interface in the configuration are used.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/ether.h>
+
+#include "../dhcp.h"
+#include "../conf.h"
+#include "../core.h"
+#include "../log.h"
+#include "../alloc.h"
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAPNG_MAGIC 0x0a0d0d0a
+
+/* Link types */
+enum {
+  LINK_ETHERNET = 1,
+  LINK_RAW = 101,
+  LINK_LINUX_SLL = 113,
+  LINK_IPV4 = 228,
+};
+
+/* Message types up to DHCPINFORM, 0 for messages without one */
+#define NTYPES 9
+
+/* Differences and invalid replies printed in full */
+#define MAX_SHOWN 20
+
+struct replay_msg {
+  /* Capture time in ns since the first message */
+  int64_t t;
+
+  /* Payload length */
+  size_t len;
+
+  struct dhcp_msg msg;
+};
+
+/* Outcome of one message */
+struct decision {
+  uint8_t type;
+  uint8_t reply_type;
+  in_addr_t yiaddr;
+  uint32_t lease_time;
+};
+
+static struct replay_msg *msgs;
+static size_t nmsgs;
+
+static const char *conf_path = "./dhcp-server.conf";
+static const char *ifname;
+static double speed;
+static in_addr_t server_addr;
+static int wait_ms = 50;
+
+/* Latency of each message, -1 if it got no reply */
+static int64_t *latencies;
+
+static size_t ninvalid;
+
+static uint16_t
+rd16 (const uint8_t *p, int swap)
+{
+  uint16_t v;
+  memcpy (&v, p, sizeof (v));
+  return swap ? __builtin_bswap16 (v) : v;
+}
+
+static uint32_t
+rd32 (const uint8_t *p, int swap)
+{
+  uint32_t v;
+  memcpy (&v, p, sizeof (v));
+  return swap ? __builtin_bswap32 (v) : v;
+}
+
+static int64_t
+wall_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Read a whole file */
+static uint8_t *
+read_file (const char *path, size_t *size)
+{
+  FILE *f = fopen (path, "rb");
+  if (f == NULL) {
+    log_errno ("Failed to open %s", path);
+    return NULL;
+  }
+
+  uint8_t *buf = NULL;
+  size_t capac = 0;
+  *size = 0;
+
+  for (;;) {
+    if (*size == capac) {
+      capac = capac ? 2 * capac : 1 << 20;
+      uint8_t *tmp = realloc (buf, capac);
+      if (tmp == NULL) {
+        log_error ("Out of memory reading %s", path);
+        free (buf);
+        fclose (f);
+        return NULL;
+      }
+      buf = tmp;
+    }
+
+    size_t n = fread (buf + *size, 1, capac - *size, f);
+    if (n == 0)
+      break;
+    *size += n;
+  }
+
+  if (ferror (f)) {
+    log_errno ("Failed to read %s", path);
+    free (buf);
+    buf = NULL;
+  }
+
+  fclose (f);
+  return buf;
+}
+
+/* Append the payload of a captured frame if it is a datagram to the
+ * server port */
+static int
+add_frame (const uint8_t *p, size_t caplen, uint32_t link, int64_t t)
+{
+  size_t off;
+  uint16_t proto;
+
+  switch (link) {
+  case LINK_ETHERNET:
+    if (caplen < 14)
+      return 0;
+    proto = rd16 (p + 12, 0);
+    off = 14;
+    /* VLAN tags */
+    while ((proto == htons (0x8100) || proto == htons (0x88a8))
+           && caplen >= off + 4) {
+      proto = rd16 (p + off + 2, 0);
+      off += 4;
+    }
+    if (proto != htons (0x0800))
+      return 0;
+    break;
+  case LINK_LINUX_SLL:
+    if (caplen < 16 || rd16 (p + 14, 0) != htons (0x0800))
+      return 0;
+    off = 16;
+    break;
+  case LINK_RAW:
+  case LINK_IPV4:
+    off = 0;
+    break;
+  default:
+    return 0;
+  }
+
+  /* IPv4, unfragmented UDP */
+  if (caplen < off + 20 || p[off] >> 4 != 4 || p[off + 9] != 17)
+    return 0;
+  if (rd16 (p + off + 6, 0) & htons (0x3fff))
+    return 0;
+  off += (p[off] & 0xf) * 4;
+
+  if (caplen < off + 8 || rd16 (p + off + 2, 0) != htons (DHCP_PORT_SERVER))
+    return 0;
+
+  size_t len = ntohs (rd16 (p + off + 4, 0));
+  off += 8;
+  if (len < 8)
+    return 0;
+  len -= 8;
+  if (len > caplen - off)
+    len = caplen - off;
+  if (len > sizeof (struct dhcp_msg))
+    len = sizeof (struct dhcp_msg);
+
+  static size_t capac;
+  if (nmsgs == capac) {
+    capac = capac ? 2 * capac : 1024;
+    struct replay_msg *tmp = realloc (msgs, sizeof (*msgs) * capac);
+    if (tmp == NULL) {
+      log_error ("Out of memory for messages");
+      return -1;
+    }
+    msgs = tmp;
+  }
+
+  /* Short messages read as if zero padded */
+  struct replay_msg *rm = &msgs[nmsgs++];
+  memset (&rm->msg, 0, sizeof (rm->msg));
+  memcpy (&rm->msg, p + off, len);
+  rm->len = len;
+  rm->t = t;
+
+  return 0;
+}
+
+/* Load the datagrams to the server port from a capture */
+static int
+load_pcap (const char *path)
+{
+  size_t size;
+  uint8_t *buf = read_file (path, &size);
+  if (buf == NULL)
+    return -1;
+
+  if (size < 24) {
+    log_error ("%s: Not a pcap file", path);
+    free (buf);
+    return -1;
+  }
+
+  uint32_t magic = rd32 (buf, 0);
+  int swap = 0;
+  int64_t frac_ns = 1000;
+
+  if (magic == PCAPNG_MAGIC) {
+    log_error ("%s: pcapng is not supported, convert the capture with "
+               "editcap -F pcap", path);
+    free (buf);
+    return -1;
+  } else if (magic == __builtin_bswap32 (PCAP_MAGIC_US)
+             || magic == __builtin_bswap32 (PCAP_MAGIC_NS)) {
+    swap = 1;
+    magic = __builtin_bswap32 (magic);
+  }
+
+  if (magic == PCAP_MAGIC_NS) {
+    frac_ns = 1;
+  } else if (magic != PCAP_MAGIC_US) {
+    log_error ("%s: Not a pcap file", path);
+    free (buf);
+    return -1;
+  }
+
+  uint32_t link = rd32 (buf + 20, swap) & 0xffff;
+  int64_t first = -1;
+  size_t nframes = 0;
+
+  for (size_t off = 24; off + 16 <= size; nframes++) {
+    int64_t t = (int64_t) rd32 (buf + off, swap) * 1000000000
+                + rd32 (buf + off + 4, swap) * frac_ns;
+    size_t caplen = rd32 (buf + off + 8, swap);
+
+    off += 16;
+    if (caplen > size - off) {
+      log_error ("%s: Truncated after %zu frames", path, nframes);
+      break;
+    }
+
+    if (first < 0)
+      first = t;
+    if (add_frame (buf + off, caplen, link, t - first) < 0) {
+      free (buf);
+      return -1;
+    }
+    off += caplen;
+  }
+
+  free (buf);
+  log_info ("%s: %zu of %zu frames sent to port %d", path, nmsgs, nframes,
+            DHCP_PORT_SERVER);
+  return 0;
+}
+
+/* Find an option in a message, returns -1 if absent */
+static int
+find_opt (const struct dhcp_msg *msg, uint8_t tag, struct dhcp_opt *opt)
+{
+  struct dhcp_oit it = dhcp_oit_init ((struct dhcp_msg *) msg);
+  if (dhcp_eat_magic_cookie (&it) < 0)
+    return -1;
+
+  while (!it.done) {
+    if (dhcp_opt_take (opt, &it) < 0)
+      return -1;
+    if (opt->tag == tag)
+      return 0;
+  }
+
+  return -1;
+}
+
+static uint8_t
+msg_type (const struct dhcp_msg *msg)
+{
+  struct dhcp_opt opt;
+
+  if (find_opt (msg, DHCP_OPT_DHCP_MESSAGE_TYPE, &opt) < 0 || opt.len < 1)
+    return 0;
+
+  return opt.buf[0];
+}
+
+/* Check a reply against its request, returns what is wrong with it
+ * or NULL */
+static const char *
+check_reply (const struct dhcp_msg *msg, const struct dhcp_msg *reply,
+             const struct iface_conf *ic, struct decision *d)
+{
+  struct dhcp_opt opt;
+
+  if (reply->op != DHCP_OP_BOOTREPLY)
+    return "not a BOOTREPLY";
+  if (reply->xid != msg->xid
+      || memcmp (reply->chaddr, msg->chaddr, sizeof (msg->chaddr)) != 0)
+    return "transaction or hardware address changed";
+  if (d->reply_type == 0)
+    return "no message type";
+  if (find_opt (reply, DHCP_OPT_SERVER_IDENTIFIER, &opt) < 0)
+    return "no server identifier";
+
+  switch (d->type) {
+  case DHCP_MSG_TYPE_DHCPDISCOVER:
+    if (d->reply_type == DHCP_MSG_TYPE_DHCPACK
+        && find_opt (reply, DHCP_OPT_RAPID_COMMIT, &opt) < 0)
+      return "ACK to DISCOVER without rapid commit";
+    if (d->reply_type != DHCP_MSG_TYPE_DHCPOFFER
+        && d->reply_type != DHCP_MSG_TYPE_DHCPACK)
+      return "unexpected reply type";
+    break;
+  case DHCP_MSG_TYPE_DHCPREQUEST:
+    if (d->reply_type != DHCP_MSG_TYPE_DHCPACK
+        && d->reply_type != DHCP_MSG_TYPE_DHCPNAK)
+      return "unexpected reply type";
+    break;
+  }
+
+  if (d->reply_type == DHCP_MSG_TYPE_DHCPNAK)
+    return d->yiaddr != 0 ? "NAK with an address" : NULL;
+
+  if (d->yiaddr == 0)
+    return "no address";
+  if (d->lease_time == 0)
+    return "no lease time";
+
+  /* Only known when running in process */
+  if (ic && (d->yiaddr & ic->subnet_mask) != (ic->range_lo & ic->subnet_mask))
+    return "address outside the subnet";
+
+  return NULL;
+}
+
+/* Fill in the decision from a reply */
+static void
+decide (const struct dhcp_msg *reply, struct decision *d)
+{
+  struct dhcp_opt opt;
+
+  d->reply_type = msg_type (reply);
+  d->yiaddr = reply->yiaddr;
+  d->lease_time = 0;
+  if (find_opt (reply, DHCP_OPT_IP_ADDRESS_LEASE_TIME, &opt) == 0
+      && opt.len == 4) {
+    memcpy (&d->lease_time, opt.buf, 4);
+    d->lease_time = ntohl (d->lease_time);
+  }
+}
+
+static void
+invalid (size_t i, const struct decision *d, const char *reason)
+{
+  if (ninvalid++ < MAX_SHOWN)
+    log_error ("#%zu %s: invalid %s: %s", i, dhcp_msg_type_str (d->type),
+               dhcp_msg_type_str (d->reply_type), reason);
+}
+
+static void
+log_decision (FILE *f, size_t i, const struct replay_msg *rm,
+              const struct decision *d)
+{
+  struct in_addr in_addr = { .s_addr = d->yiaddr };
+
+  fprintf (f, "%zu %08x %s %s", i, ntohl (rm->msg.xid),
+           ether_ntoa ((const struct ether_addr *) rm->msg.chaddr),
+           d->type ? dhcp_msg_type_str (d->type) : "-");
+  if (d->reply_type)
+    fprintf (f, " %s %s %u\n", dhcp_msg_type_str (d->reply_type),
+             inet_ntoa (in_addr), d->lease_time);
+  else
+    fprintf (f, " -\n");
+}
+
+/* Sleep until message i is due */
+static void
+pace (size_t i, int64_t start)
+{
+  if (speed <= 0)
+    return;
+
+  int64_t due = start + (int64_t) (msgs[i].t / speed);
+  struct timespec ts = {
+    .tv_sec = due / 1000000000,
+    .tv_nsec = due % 1000000000,
+  };
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+/* Run the messages through the protocol engine, on the virtual time
+ * of the capture */
+static int
+replay_core (FILE *out)
+{
+  static struct conf conf;
+  static struct dhcp_core core;
+  static struct dhcp_msg reply_msg;
+  static struct core_reply reply = { .msg = &reply_msg };
+
+  conf_defaults (&conf);
+  if (conf_parse (conf_path, &conf) < 0)
+    return -1;
+
+  const struct iface_conf *ic = &conf.ifaces[0];
+  if (server_addr == 0)
+    server_addr = htonl (ntohl (ic->range_lo) - 1);
+
+  /* Start the virtual clock well clear of zero */
+  int64_t epoch = 1000000;
+  if (core_init (&core, &conf, ic, server_addr, "dhcp-replay", epoch) < 0)
+    return -1;
+
+  log_quiet (1);
+  int64_t start = wall_ns ();
+  long nallocs = 0;
+
+  for (size_t i = 0; i < nmsgs; i++) {
+    struct replay_msg *rm = &msgs[i];
+    int64_t now = epoch + rm->t / 1000000;
+    struct decision d = { .type = msg_type (&rm->msg) };
+
+    pace (i, start);
+
+    long allocs = alloc_calls ();
+    core_expire (&core, now / 1000);
+    int64_t t0 = wall_ns ();
+    int have_reply = core_handle (&core, &rm->msg, rm->len, now, &reply);
+    latencies[i] = wall_ns () - t0;
+    nallocs += alloc_calls () - allocs;
+
+    if (have_reply) {
+      decide (reply.msg, &d);
+      const char *reason = check_reply (&rm->msg, reply.msg, ic, &d);
+      if (reason)
+        invalid (i, &d, reason);
+    } else {
+      latencies[i] = -1;
+    }
+
+    if (out)
+      log_decision (out, i, rm, &d);
+  }
+
+  log_quiet (0);
+  core_deinit (&core);
+
+  /* The engine must not touch the heap once it is set up */
+  if (nallocs > 0) {
+    log_error ("%ld heap calls while handling messages", nallocs);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Send the messages over an interface, one at a time */
+static int
+replay_socket (FILE *out)
+{
+  int enable = 1;
+  int fd = socket (AF_INET, SOCK_DGRAM, 0);
+
+  if (fd < 0
+      || setsockopt (fd, SOL_SOCKET, SO_BINDTODEVICE,
+                     ifname, strlen (ifname)) < 0
+      || setsockopt (fd, SOL_SOCKET, SO_BROADCAST,
+                     &enable, sizeof (enable)) < 0
+      || setsockopt (fd, SOL_SOCKET, SO_REUSEADDR,
+                     &enable, sizeof (enable)) < 0) {
+    log_errno ("Failed to set up socket on %s", ifname);
+    return -1;
+  }
+
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port = htons (DHCP_PORT_CLIENT),
+    .sin_addr.s_addr = INADDR_ANY,
+  };
+  if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0) {
+    log_errno ("Failed to bind client port");
+    return -1;
+  }
+
+  addr.sin_port = htons (DHCP_PORT_SERVER);
+  addr.sin_addr.s_addr = INADDR_BROADCAST;
+
+  int64_t start = wall_ns ();
+
+  for (size_t i = 0; i < nmsgs; i++) {
+    struct replay_msg *rm = &msgs[i];
+    struct decision d = { .type = msg_type (&rm->msg) };
+    struct dhcp_msg reply;
+
+    pace (i, start);
+
+    int64_t t0 = wall_ns ();
+    latencies[i] = -1;
+    if (sendto (fd, &rm->msg, rm->len, 0, (struct sockaddr *) &addr,
+                sizeof (addr)) < 0) {
+      log_errno ("sendto()");
+      return -1;
+    }
+
+    /* Wait for the reply, skipping those to other clients */
+    int64_t deadline = t0 + (int64_t) wait_ms * 1000000;
+    for (int64_t now = t0; now < deadline; now = wall_ns ()) {
+      struct pollfd pfd = { .fd = fd, .events = POLLIN };
+      if (poll (&pfd, 1, (deadline - now + 999999) / 1000000) <= 0)
+        break;
+
+      memset (&reply, 0, sizeof (reply));
+      ssize_t len = recv (fd, &reply, sizeof (reply), MSG_DONTWAIT);
+      if (len < (ssize_t) offsetof (struct dhcp_msg, options)
+          || reply.xid != rm->msg.xid
+          || memcmp (reply.chaddr, rm->msg.chaddr, sizeof (reply.chaddr)))
+        continue;
+
+      latencies[i] = wall_ns () - t0;
+      decide (&reply, &d);
+      const char *reason = check_reply (&rm->msg, &reply, NULL, &d);
+      if (reason)
+        invalid (i, &d, reason);
+      break;
+    }
+
+    if (out)
+      log_decision (out, i, rm, &d);
+  }
+
+  close (fd);
+  return 0;
+}
+
+static int
+cmp_int64 (const void *a, const void *b)
+{
+  int64_t x = *(const int64_t *) a;
+  int64_t y = *(const int64_t *) b;
+  return (x > y) - (x < y);
+}
+
+static void
+report (int64_t wall)
+{
+  int64_t *sorted = malloc (sizeof (*sorted) * (nmsgs + 1));
+  size_t nreplies = 0;
+
+  if (sorted == NULL) {
+    log_error ("Out of memory for report");
+    return;
+  }
+
+  for (size_t i = 0; i < nmsgs; i++)
+    nreplies += latencies[i] >= 0;
+
+  printf ("%zu messages in %.3fs (%.0f/s), %zu replies, %zu invalid\n",
+          nmsgs, wall / 1e9, wall > 0 ? nmsgs * 1e9 / wall : 0.0,
+          nreplies, ninvalid);
+  printf ("%-14s %9s %9s %10s %10s %10s %10s\n", "type", "messages",
+          "replies", "mean (us)", "p50 (us)", "p99 (us)", "max (us)");
+
+  for (int type = 0; type < NTYPES; type++) {
+    size_t n = 0, count = 0;
+    int64_t sum = 0;
+
+    for (size_t i = 0; i < nmsgs; i++) {
+      uint8_t t = msg_type (&msgs[i].msg);
+      if ((t < NTYPES ? t : 0) != type)
+        continue;
+      count++;
+      if (latencies[i] >= 0) {
+        sorted[n++] = latencies[i];
+        sum += latencies[i];
+      }
+    }
+
+    if (count == 0)
+      continue;
+
+    const char *name = type ? dhcp_msg_type_str (type) : "-";
+    if (n == 0) {
+      printf ("%-14s %9zu %9d\n", name, count, 0);
+      continue;
+    }
+
+    qsort (sorted, n, sizeof (*sorted), cmp_int64);
+    printf ("%-14s %9zu %9zu %10.2f %10.2f %10.2f %10.2f\n", name, count, n,
+            sum / 1e3 / n, sorted[n / 2] / 1e3, sorted[n * 99 / 100] / 1e3,
+            sorted[n - 1] / 1e3);
+  }
+
+  free (sorted);
+}
+
+/* Compare two decision logs line by line */
+static int
+compare (const char *path_a, const char *path_b)
+{
+  FILE *a = fopen (path_a, "r");
+  FILE *b = fopen (path_b, "r");
+  char line_a[256], line_b[256];
+  size_t nlines = 0, ndiffs = 0;
+
+  if (a == NULL || b == NULL) {
+    log_errno ("Failed to open decision log");
+    return -1;
+  }
+
+  for (;;) {
+    char *ra = fgets (line_a, sizeof (line_a), a);
+    char *rb = fgets (line_b, sizeof (line_b), b);
+
+    if (ra == NULL || rb == NULL) {
+      if (ra || rb) {
+        printf ("%s ends after %zu messages\n", ra ? path_b : path_a, nlines);
+        ndiffs++;
+      }
+      break;
+    }
+
+    nlines++;
+    if (strcmp (line_a, line_b) == 0)
+      continue;
+
+    if (ndiffs++ < MAX_SHOWN)
+      printf ("< %s> %s", line_a, line_b);
+  }
+
+  fclose (a);
+  fclose (b);
+
+  printf ("%zu messages, %zu decisions differ\n", nlines, ndiffs);
+  return ndiffs > 0;
+}
+
+/* Use the server identifier clients in the capture asked for */
+static in_addr_t
+capture_server (void)
+{
+  struct dhcp_opt opt;
+
+  for (size_t i = 0; i < nmsgs; i++)
+    if (find_opt (&msgs[i].msg, DHCP_OPT_SERVER_IDENTIFIER, &opt) == 0
+        && opt.len == 4) {
+      in_addr_t addr;
+      memcpy (&addr, opt.buf, 4);
+      return addr;
+    }
+
+  return 0;
+}
+
+static void
+usage (const char *prog)
+{
+  fprintf (stderr, "Usage: %s [-i iface] [-x speed] [-a server] [-w wait] "
+           "[-o log] capture [conf]\n"
+           "       %s -c log log\n", prog, prog);
+  exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *out_path = NULL;
+  int compare_logs = 0;
+  int c;
+
+  while ((c = getopt (argc, argv, "i:x:a:w:o:c")) != -1) {
+    switch (c) {
+    case 'i': ifname = optarg; break;
+    case 'x': speed = atof (optarg); break;
+    case 'a':
+      if (inet_pton (AF_INET, optarg, &server_addr) != 1)
+        usage (argv[0]);
+      break;
+    case 'w': wait_ms = atoi (optarg); break;
+    case 'o': out_path = optarg; break;
+    case 'c': compare_logs = 1; break;
+    default: usage (argv[0]);
+    }
+  }
+
+  if (compare_logs) {
+    if (argc - optind != 2)
+      usage (argv[0]);
+    int ret = compare (argv[optind], argv[optind + 1]);
+    exit (ret < 0 ? EXIT_FAILURE : ret);
+  }
+
+  if (optind >= argc || argc - optind > 2 || speed < 0 || wait_ms <= 0)
+    usage (argv[0]);
+  if (argc - optind == 2)
+    conf_path = argv[optind + 1];
+
+  if (load_pcap (argv[optind]) < 0)
+    exit (EXIT_FAILURE);
+
+  latencies = calloc (nmsgs + 1, sizeof (*latencies));
+  if (latencies == NULL) {
+    log_error ("Out of memory for latencies");
+    exit (EXIT_FAILURE);
+  }
+
+  if (server_addr == 0)
+    server_addr = capture_server ();
+
+  FILE *out = NULL;
+  if (out_path && (out = fopen (out_path, "w")) == NULL) {
+    log_errno ("Failed to open %s", out_path);
+    exit (EXIT_FAILURE);
+  }
+
+  int64_t start = wall_ns ();
+  if ((ifname ? replay_socket (out) : replay_core (out)) < 0)
+    exit (EXIT_FAILURE);
+  int64_t wall = wall_ns () - start;
+
+  if (out)
+    fclose (out);
+
+  report (wall);
+  return 0;
+}
@@ -0,0 +1,540 @@
+/* Discrete event simulation of the server
+ *
+ * Drives the protocol engine of the server on virtual time, without
+ * any socket: messages are handed to the engine directly and its
+ * replies are read back, and the clock only advances from one event
+ * to the next. A scripted population of clients arrives, binds,
+ * renews at T1, reboots and departs without releasing its lease, so
+ * that weeks of lease churn run in minutes. Leases expire from the
+ * same deadlines that arm the timer of the server.
+ *
+ * Usage: dhcp-sim [-n clients] [-d days] [-s stay] [-b reboots]
+ *                 [-i interval] [-S seed] [conf]
+ *
+ *   -n  average number of clients present (100000)
+ *   -d  simulated days (7)
+ *   -s  average time a client stays, in hours (24)
+ *   -b  reboots per client and day (0.5)
+ *   -i  report interval, in hours (24)
+ *   -S  random seed
+ *
+ * Lease time, range and the other settings are read from the
+ * configuration file, only its first interface is simulated.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "../dhcp.h"
+#include "../conf.h"
+#include "../core.h"
+#include "../log.h"
+#include "../alloc.h"
+
+/* Kinds of events */
+enum {
+  SIM_ARRIVE,
+  SIM_RENEW,
+  SIM_REBOOT,
+  SIM_TIMER,
+};
+
+/* Operations whose cost is measured */
+enum {
+  OP_DISCOVER,
+  OP_REQUEST,
+  OP_RENEW,
+  OP_REBOOT,
+  OP_EXPIRE,
+  OP_MAX,
+};
+
+static const char *op_names[OP_MAX] = {
+  "discover", "request", "renew", "reboot", "expire",
+};
+
+struct sim_event {
+  /* Virtual time (ms) */
+  int64_t t;
+
+  /* Client the event belongs to */
+  uint32_t id;
+
+  uint8_t kind;
+};
+
+struct sim_client {
+  /* Bound address, 0 if not bound */
+  in_addr_t addr;
+
+  /* Virtual time (ms) the client leaves */
+  int64_t leave;
+
+  uint32_t xid;
+
+  /* The client is on the network */
+  uint8_t present;
+};
+
+/* Min-heap of pending events */
+static struct sim_event *events;
+static size_t nevents;
+static size_t events_capac;
+
+/* Population and its parameters */
+static struct sim_client *clients;
+static size_t nclients;
+static double stay_ms;
+static double reboot_ms;
+
+static struct conf conf;
+static const char *conf_path = "./dhcp-server.conf";
+
+/* Last reply of the server */
+static struct dhcp_msg reply_msg;
+static struct core_reply reply = { .msg = &reply_msg };
+
+/* Per interval statistics */
+static size_t op_count[OP_MAX];
+static int64_t op_ns[OP_MAX];
+static size_t max_burst;
+static size_t nexpired;
+static size_t nnooffer;
+static size_t nnaks;
+
+/* Heap calls made by the engine, only counted in builds with
+ * DHCP_ALLOC_COUNT */
+static long nallocs;
+
+static void
+push_event (int64_t t, uint32_t id, uint8_t kind)
+{
+  if (nevents == events_capac) {
+    events_capac = events_capac ? 2 * events_capac : 1024;
+    events = realloc (events, sizeof (*events) * events_capac);
+    if (events == NULL) {
+      log_error ("Out of memory for events");
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  size_t ci = nevents++;
+  events[ci] = (struct sim_event) { .t = t, .id = id, .kind = kind };
+
+  while (ci > 0) {
+    size_t pi = (ci - 1) / 2;
+    if (events[pi].t <= events[ci].t)
+      break;
+    struct sim_event tmp = events[pi];
+    events[pi] = events[ci];
+    events[ci] = tmp;
+    ci = pi;
+  }
+}
+
+static struct sim_event
+pop_event (void)
+{
+  struct sim_event top = events[0];
+  events[0] = events[--nevents];
+
+  size_t pi = 0;
+  for (;;) {
+    size_t mi = pi;
+    size_t li = 2 * pi + 1;
+    size_t ri = li + 1;
+
+    if (li < nevents && events[li].t < events[mi].t)
+      mi = li;
+    if (ri < nevents && events[ri].t < events[mi].t)
+      mi = ri;
+    if (mi == pi)
+      break;
+
+    struct sim_event tmp = events[pi];
+    events[pi] = events[mi];
+    events[mi] = tmp;
+    pi = mi;
+  }
+
+  return top;
+}
+
+/* Exponentially distributed delay with the given mean */
+static int64_t
+exp_delay (double mean)
+{
+  return (int64_t) (-log (1.0 - drand48 ()) * mean) + 1;
+}
+
+static int64_t
+wall_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Send a message from a client and run the server on it. Returns
+ * the type of the reply, or 0 if there is none. */
+static int
+exchange (struct dhcp_core *core, int64_t now, uint32_t id, int op,
+          uint8_t type,
+          in_addr_t ciaddr, in_addr_t req_addr, in_addr_t server_id,
+          in_addr_t *yiaddr, uint32_t *lease_time)
+{
+  struct sim_client *c = &clients[id];
+  struct dhcp_msg msg;
+  memset (&msg, 0, sizeof (msg));
+
+  msg.op = DHCP_OP_BOOTREQUEST;
+  msg.htype = 1;
+  msg.hlen = ETHER_ADDR_LEN;
+  msg.xid = c->xid;
+  msg.ciaddr = ciaddr;
+  msg.chaddr[0] = 0x02;
+  memcpy (msg.chaddr + 2, &id, sizeof (id));
+
+  struct dhcp_opt opt;
+  struct dhcp_oit it = dhcp_oit_init (&msg);
+  dhcp_add_magic_cookie (&it);
+
+  opt.tag = DHCP_OPT_DHCP_MESSAGE_TYPE;
+  opt.len = 1;
+  opt.buf[0] = type;
+  dhcp_opt_add (&opt, &it);
+
+  if (req_addr) {
+    opt.tag = DHCP_OPT_REQUESTED_IP_ADDRESS;
+    opt.len = 4;
+    memcpy (opt.buf, &req_addr, 4);
+    dhcp_opt_add (&opt, &it);
+  }
+
+  if (server_id) {
+    opt.tag = DHCP_OPT_SERVER_IDENTIFIER;
+    opt.len = 4;
+    memcpy (opt.buf, &server_id, 4);
+    dhcp_opt_add (&opt, &it);
+  }
+
+  opt.tag = DHCP_OPT_END_OPTION;
+  dhcp_opt_add (&opt, &it);
+
+  long allocs = alloc_calls ();
+  int64_t start = wall_ns ();
+  int have_reply = core_handle (core, &msg, sizeof (msg), now, &reply);
+  op_ns[op] += wall_ns () - start;
+  op_count[op]++;
+  nallocs += alloc_calls () - allocs;
+
+  if (!have_reply)
+    return 0;
+
+  int reply_type = 0;
+  it = dhcp_oit_init (reply.msg);
+  if (dhcp_eat_magic_cookie (&it) < 0)
+    return 0;
+
+  while (!it.done && dhcp_opt_take (&opt, &it) == 0) {
+    if (opt.tag == DHCP_OPT_DHCP_MESSAGE_TYPE)
+      reply_type = opt.buf[0];
+    if (opt.tag == DHCP_OPT_IP_ADDRESS_LEASE_TIME && lease_time) {
+      memcpy (lease_time, opt.buf, 4);
+      *lease_time = ntohl (*lease_time);
+    }
+  }
+
+  *yiaddr = reply.msg->yiaddr;
+  return reply_type;
+}
+
+/* Schedule the next event of a bound client */
+static void
+schedule (uint32_t id, int64_t now, uint32_t lease_time)
+{
+  int64_t renew = now + (int64_t) lease_time * 1000 / 2;
+  int64_t reboot = reboot_ms > 0 ? now + exp_delay (reboot_ms) : INT64_MAX;
+
+  if (reboot < renew)
+    push_event (reboot, id, SIM_REBOOT);
+  else
+    push_event (renew, id, SIM_RENEW);
+}
+
+/* Go through DISCOVER/OFFER/REQUEST/ACK */
+static void
+bind_client (struct dhcp_core *core, uint32_t id, int64_t now)
+{
+  struct sim_client *c = &clients[id];
+  in_addr_t addr;
+  uint32_t lease_time = 0;
+
+  c->addr = 0;
+  c->xid++;
+
+  if (exchange (core, now, id, OP_DISCOVER, DHCP_MSG_TYPE_DHCPDISCOVER,
+                0, 0, 0, &addr, NULL) != DHCP_MSG_TYPE_DHCPOFFER) {
+    nnooffer++;
+    c->present = 0;
+    return;
+  }
+
+  if (exchange (core, now, id, OP_REQUEST, DHCP_MSG_TYPE_DHCPREQUEST,
+                0, addr, core->server_addr, &addr,
+                &lease_time) != DHCP_MSG_TYPE_DHCPACK) {
+    nnaks++;
+    c->present = 0;
+    return;
+  }
+
+  c->addr = addr;
+  schedule (id, now, lease_time);
+}
+
+static void
+on_arrive (struct dhcp_core *core, int64_t now)
+{
+  push_event (now + exp_delay (stay_ms / nclients), 0, SIM_ARRIVE);
+
+  /* Returning clients keep their hardware address */
+  uint32_t id = lrand48 () % (2 * nclients);
+  struct sim_client *c = &clients[id];
+  if (c->present)
+    return;
+
+  c->present = 1;
+  c->leave = now + exp_delay (stay_ms);
+  bind_client (core, id, now);
+}
+
+static void
+on_renew (struct dhcp_core *core, uint32_t id, int64_t now, int reboot)
+{
+  struct sim_client *c = &clients[id];
+  in_addr_t addr;
+  uint32_t lease_time = 0;
+
+  /* Departed clients leave their lease to expire */
+  if (now >= c->leave) {
+    c->present = 0;
+    return;
+  }
+
+  int type;
+  c->xid++;
+  if (reboot)
+    type = exchange (core, now, id, OP_REBOOT, DHCP_MSG_TYPE_DHCPREQUEST,
+                     0, c->addr, 0, &addr, &lease_time);
+  else
+    type = exchange (core, now, id, OP_RENEW, DHCP_MSG_TYPE_DHCPREQUEST,
+                     c->addr, 0, 0, &addr, &lease_time);
+
+  if (type == DHCP_MSG_TYPE_DHCPACK)
+    schedule (id, now, lease_time);
+  else
+    bind_client (core, id, now);
+}
+
+/* Count free addresses below the allocation frontier in runs */
+static void
+fragmentation (struct addr_space *as, size_t *nruns, size_t *longest)
+{
+  size_t limit = ntohl (as->next) - ntohl (as->lo);
+  size_t run = 0;
+
+  *nruns = 0;
+  *longest = 0;
+
+  for (size_t i = 0; i < limit; i++) {
+    if (as->free_bits[i / 64] >> (i % 64) & 1) {
+      if (run++ == 0)
+        (*nruns)++;
+      if (run > *longest)
+        *longest = run;
+    } else {
+      run = 0;
+    }
+  }
+}
+
+static size_t
+rss_kb (void)
+{
+  long pages = 0;
+  FILE *f = fopen ("/proc/self/statm", "r");
+
+  if (f) {
+    if (fscanf (f, "%*s %ld", &pages) != 1)
+      pages = 0;
+    fclose (f);
+  }
+
+  return pages * (sysconf (_SC_PAGESIZE) / 1024);
+}
+
+static void
+report (struct dhcp_core *core, int64_t now, int64_t start, int64_t wall_start)
+{
+  size_t nruns, longest;
+  fragmentation (&core->aspace, &nruns, &longest);
+
+  printf ("%7.1fh %9zu %9zu/%-9zu %8zu %8zu %6zu %8zu %9zu %7.1fs",
+          (now - start) / 3600000.0, core->leaseq.nleases,
+          as_used (&core->aspace), as_size (&core->aspace),
+          nruns, longest, max_burst, nnooffer, rss_kb (),
+          (wall_ns () - wall_start) / 1e9);
+
+  for (int op = 0; op < OP_MAX; op++) {
+    printf (" %s %zu/%.0fns", op_names[op], op_count[op],
+            op_count[op] ? (double) op_ns[op] / op_count[op] : 0.0);
+    op_count[op] = 0;
+    op_ns[op] = 0;
+  }
+  printf ("\n");
+  fflush (stdout);
+
+  max_burst = 0;
+  nnooffer = 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  double days = 7;
+  double stay_hours = 24;
+  double reboots = 0.5;
+  double interval_hours = 24;
+  long seed = 1;
+  int c;
+
+  nclients = 100000;
+
+  while ((c = getopt (argc, argv, "n:d:s:b:i:S:")) != -1) {
+    switch (c) {
+    case 'n': nclients = strtoul (optarg, NULL, 10); break;
+    case 'd': days = atof (optarg); break;
+    case 's': stay_hours = atof (optarg); break;
+    case 'b': reboots = atof (optarg); break;
+    case 'i': interval_hours = atof (optarg); break;
+    case 'S': seed = atol (optarg); break;
+    default:
+      fprintf (stderr, "Usage: %s [-n clients] [-d days] [-s stay] "
+               "[-b reboots] [-i interval] [-S seed] [conf]\n", argv[0]);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (optind < argc)
+    conf_path = argv[optind];
+
+  if (nclients == 0 || days <= 0 || stay_hours <= 0 || interval_hours <= 0) {
+    log_error ("Invalid simulation parameters");
+    exit (EXIT_FAILURE);
+  }
+
+  conf_defaults (&conf);
+  if (conf_parse (conf_path, &conf) < 0)
+    exit (EXIT_FAILURE);
+
+  srand48 (seed);
+  stay_ms = stay_hours * 3600000;
+  reboot_ms = reboots > 0 ? 86400000 / reboots : 0;
+
+  clients = calloc (2 * nclients, sizeof (*clients));
+  if (clients == NULL) {
+    log_error ("Out of memory for clients");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Start the virtual clock well clear of zero */
+  int64_t start = 1000000;
+  int64_t end = start + (int64_t) (days * 86400000);
+  int64_t interval = interval_hours * 3600000;
+  int64_t next_report = start + interval;
+  int64_t armed = -1;
+
+  /* The server sits just below its range */
+  static struct dhcp_core sim_core;
+  struct dhcp_core *core = &sim_core;
+  const struct iface_conf *ic = &conf.ifaces[0];
+  if (core_init (core, &conf, ic, htonl (ntohl (ic->range_lo) - 1),
+                 "dhcp-sim", start) < 0)
+    exit (EXIT_FAILURE);
+
+  log_quiet (1);
+
+  printf ("%8s %9s %19s %8s %8s %6s %8s %9s %8s\n", "time", "leases",
+          "pool used", "holes", "longest", "burst", "no offer", "rss (kB)",
+          "wall");
+
+  int64_t wall_start = wall_ns ();
+  push_event (start, 0, SIM_ARRIVE);
+
+  while (nevents > 0) {
+    struct sim_event ev = pop_event ();
+    if (ev.t >= end)
+      break;
+
+    while (ev.t >= next_report) {
+      report (core, next_report, start, wall_start);
+      next_report += interval;
+    }
+
+    /* Every wakeup of the event loop starts with expiry */
+    size_t before = core->leaseq.nleases;
+    long allocs = alloc_calls ();
+    int64_t t0 = wall_ns ();
+    core_expire (core, ev.t / 1000);
+    nallocs += alloc_calls () - allocs;
+    size_t expired = before - core->leaseq.nleases;
+    if (expired > 0) {
+      op_ns[OP_EXPIRE] += wall_ns () - t0;
+      op_count[OP_EXPIRE] += expired;
+      nexpired += expired;
+      if (expired > max_burst)
+        max_burst = expired;
+    }
+
+    switch (ev.kind) {
+    case SIM_ARRIVE:
+      on_arrive (core, ev.t);
+      break;
+    case SIM_RENEW:
+      on_renew (core, ev.id, ev.t, 0);
+      break;
+    case SIM_REBOOT:
+      on_renew (core, ev.id, ev.t, 1);
+      break;
+    case SIM_TIMER:
+      if (ev.t == armed)
+        armed = -1;
+      break;
+    }
+
+    /* Arm the timer like the server does */
+    int64_t deadline = core_deadline (core);
+    if (deadline >= 0 && deadline != armed) {
+      push_event (deadline, 0, SIM_TIMER);
+      armed = deadline;
+    }
+  }
+
+  report (core, end, start, wall_start);
+  printf ("%zu leases expired, %zu NAKs\n", nexpired, nnaks);
+
+  /* The engine must not touch the heap once it is set up */
+  if (alloc_calls () >= 0) {
+    printf ("%ld heap calls while handling messages\n", nallocs);
+    if (nallocs > 0)
+      return EXIT_FAILURE;
+  }
+
+  return 0;
+}
@@ -0,0 +1,406 @@
+/* Lease history queries
+ *
+ * Answers who held an address, or which addresses a host held,
+ * during a period of time, from the lease history the server keeps.
+ * Only the segments of the period are opened, and of those only the
+ * blocks their index lists for the address or hardware address are
+ * read.
+ *
+ * Usage: dhcp-history [-d dir] [-a address] [-m hwaddr]
+ *                     [-t time | -f from -u until] [-w window]
+ *
+ *   -d  history directory (./history)
+ *   -a  address to look up
+ *   -m  hardware address to look up
+ *   -t  point in time, the same as -f time -u time
+ *   -f  start of the period, by default the start of the history
+ *   -u  end of the period, by default now
+ *   -w  longest lease time, how far before the period a lease that
+ *       overlaps it may have started (7d)
+ *
+ * Times are local, as "YYYY-MM-DD HH:MM[:SS]" or "YYYY-MM-DD", or
+ * seconds since the epoch as "@seconds". Durations take a suffix of
+ * s, m, h or d.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <netinet/ether.h>
+
+#include "../history.h"
+#include "../log.h"
+
+#define MAX_SEGMENTS 4096
+
+static const char *event_names[] = {
+  [HIST_BIND] = "bind",
+  [HIST_RENEW] = "renew",
+  [HIST_EXPIRE] = "expire",
+};
+
+/* Query */
+static const char *dir = "history";
+static int have_addr;
+static in_addr_t addr;
+static int have_ether;
+static struct ether_addr ether;
+static int64_t from = INT64_MIN;
+static int64_t until = INT64_MAX;
+static int64_t window = 7 * 86400;
+
+/* Statistics */
+static size_t nmatches;
+static size_t nsegments;
+static size_t nbuilt;
+static size_t nblocks;
+static size_t nblocks_read;
+
+static double
+now_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int
+parse_datetime (const char *str, int64_t *t)
+{
+  struct tm tm;
+  const char *end;
+
+  if (str[0] == '@') {
+    char *num_end;
+    *t = strtoll (str + 1, &num_end, 10);
+    return *num_end == '\0' && num_end != str + 1 ? 0 : -1;
+  }
+
+  memset (&tm, 0, sizeof (tm));
+  if ((end = strptime (str, "%Y-%m-%d %H:%M:%S", &tm)) == NULL
+      || *end != '\0') {
+    memset (&tm, 0, sizeof (tm));
+    if ((end = strptime (str, "%Y-%m-%d %H:%M", &tm)) == NULL
+        || *end != '\0') {
+      memset (&tm, 0, sizeof (tm));
+      if ((end = strptime (str, "%Y-%m-%d", &tm)) == NULL || *end != '\0')
+        return -1;
+    }
+  }
+
+  tm.tm_isdst = -1;
+  *t = mktime (&tm);
+  return 0;
+}
+
+static int
+parse_duration (const char *str, int64_t *t)
+{
+  char *end;
+  long long n = strtoll (str, &end, 10);
+
+  if (end == str || n < 0)
+    return -1;
+
+  switch (*end) {
+  case '\0':
+  case 's': *t = n; break;
+  case 'm': *t = n * 60; break;
+  case 'h': *t = n * 3600; break;
+  case 'd': *t = n * 86400; break;
+  default: return -1;
+  }
+
+  return end[0] == '\0' || end[1] == '\0' ? 0 : -1;
+}
+
+/* Day of a segment file name, -1 if it is not one */
+static int64_t
+segment_day (const char *name)
+{
+  struct tm tm;
+  const char *end;
+
+  memset (&tm, 0, sizeof (tm));
+  if ((end = strptime (name, "%Y%m%d", &tm)) == NULL
+      || strcmp (end, ".hist") != 0)
+    return -1;
+
+  return timegm (&tm) / 86400;
+}
+
+static int
+compare_days (const void *a, const void *b)
+{
+  int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+static void
+print_record (const struct hist_record *rec)
+{
+  char start[32], end[32], addr_str[INET_ADDRSTRLEN];
+  struct in_addr in_addr = { .s_addr = rec->in_addr };
+  time_t t;
+  struct tm tm;
+
+  t = rec->start;
+  strftime (start, sizeof (start), "%Y-%m-%d %H:%M:%S",
+            localtime_r (&t, &tm));
+  t = rec->end;
+  strftime (end, sizeof (end), "%Y-%m-%d %H:%M:%S", localtime_r (&t, &tm));
+  inet_ntop (AF_INET, &in_addr, addr_str, sizeof (addr_str));
+
+  printf ("%s  %s  %-6s  %-15s  %s\n", start, end,
+          rec->event <= HIST_EXPIRE && event_names[rec->event]
+            ? event_names[rec->event] : "?",
+          addr_str, ether_ntoa (&rec->ether));
+}
+
+/* Blocks listing a key, from the entries sorted by key and block */
+static size_t
+find_ip_blocks (const struct hist_index *idx, uint32_t key, uint32_t *blocks)
+{
+  size_t lo = 0, hi = idx->nips, n = 0;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (idx->ips[mid].in_addr < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (; lo < idx->nips && idx->ips[lo].in_addr == key; lo++)
+    blocks[n++] = idx->ips[lo].block;
+
+  return n;
+}
+
+static size_t
+find_mac_blocks (const struct hist_index *idx, const struct ether_addr *key,
+                 uint32_t *blocks)
+{
+  size_t lo = 0, hi = idx->nmacs, n = 0;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (memcmp (idx->macs[mid].ether, key, ETHER_ADDR_LEN) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (; lo < idx->nmacs
+         && memcmp (idx->macs[lo].ether, key, ETHER_ADDR_LEN) == 0; lo++)
+    blocks[n++] = idx->macs[lo].block;
+
+  return n;
+}
+
+/* Intersect two sorted block lists into the first */
+static size_t
+intersect (uint32_t *a, size_t na, const uint32_t *b, size_t nb)
+{
+  size_t i = 0, j = 0, n = 0;
+
+  while (i < na && j < nb) {
+    if (a[i] < b[j])
+      i++;
+    else if (a[i] > b[j])
+      j++;
+    else {
+      a[n++] = a[i];
+      i++;
+      j++;
+    }
+  }
+
+  return n;
+}
+
+static int
+query_segment (int64_t day)
+{
+  static struct hist_record records[HIST_BLOCK];
+  char path[4096];
+  struct hist_index idx;
+  struct stat st;
+
+  hist_path (path, sizeof (path), dir, day, ".hist");
+  int fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || fstat (fd, &st) < 0) {
+    log_errno ("Failed to open %s", path);
+    if (fd >= 0)
+      close (fd);
+    return -1;
+  }
+
+  /* The segment being written has no index yet */
+  hist_path (path, sizeof (path), dir, day, ".idx");
+  if (hist_index_load (path, st.st_size, &idx) < 0) {
+    if (hist_index_build (fd, &idx) < 0) {
+      close (fd);
+      return -1;
+    }
+    nbuilt++;
+  }
+
+  nsegments++;
+  nblocks += idx.nblocks;
+
+  uint32_t *blocks = malloc (sizeof (*blocks) * (idx.nblocks + 1));
+  uint32_t *other = malloc (sizeof (*other) * (idx.nblocks + 1));
+  if (blocks == NULL || other == NULL) {
+    log_error ("Out of memory");
+    free (blocks);
+    free (other);
+    hist_index_free (&idx);
+    close (fd);
+    return -1;
+  }
+
+  size_t n;
+  if (have_addr) {
+    n = find_ip_blocks (&idx, ntohl (addr), blocks);
+    if (have_ether)
+      n = intersect (blocks, n, other, find_mac_blocks (&idx, &ether, other));
+  } else if (have_ether) {
+    n = find_mac_blocks (&idx, &ether, blocks);
+  } else {
+    for (n = 0; n < idx.nblocks; n++)
+      blocks[n] = n;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    const struct hist_block *block = &idx.blocks[blocks[i]];
+
+    if (block->t_max < from || block->t_min > until)
+      continue;
+
+    ssize_t count = hist_read_block (fd, block, records);
+    if (count < 0) {
+      log_error ("Corrupt block at %llu of segment %s",
+                 (unsigned long long) block->offset, path);
+      continue;
+    }
+    nblocks_read++;
+
+    for (ssize_t j = 0; j < count; j++) {
+      const struct hist_record *rec = &records[j];
+
+      if ((have_addr && rec->in_addr != addr)
+          || (have_ether && memcmp (&rec->ether, &ether, sizeof (ether)) != 0)
+          || rec->start > until || rec->end < from)
+        continue;
+
+      print_record (rec);
+      nmatches++;
+    }
+  }
+
+  free (blocks);
+  free (other);
+  hist_index_free (&idx);
+  close (fd);
+  return 0;
+}
+
+static void
+usage (const char *prog)
+{
+  fprintf (stderr, "Usage: %s [-d dir] [-a address] [-m hwaddr] "
+           "[-t time | -f from -u until] [-w window]\n", prog);
+  exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char **argv)
+{
+  static int64_t days[MAX_SEGMENTS];
+  size_t ndays = 0;
+  struct ether_addr *e;
+  int c;
+
+  while ((c = getopt (argc, argv, "d:a:m:t:f:u:w:")) != -1) {
+    switch (c) {
+    case 'd': dir = optarg; break;
+    case 'a':
+      if (inet_pton (AF_INET, optarg, &addr) != 1)
+        usage (argv[0]);
+      have_addr = 1;
+      break;
+    case 'm':
+      if ((e = ether_aton (optarg)) == NULL)
+        usage (argv[0]);
+      ether = *e;
+      have_ether = 1;
+      break;
+    case 't':
+      if (parse_datetime (optarg, &from) < 0)
+        usage (argv[0]);
+      until = from;
+      break;
+    case 'f':
+      if (parse_datetime (optarg, &from) < 0)
+        usage (argv[0]);
+      break;
+    case 'u':
+      if (parse_datetime (optarg, &until) < 0)
+        usage (argv[0]);
+      break;
+    case 'w':
+      if (parse_duration (optarg, &window) < 0)
+        usage (argv[0]);
+      break;
+    default: usage (argv[0]);
+    }
+  }
+
+  if (optind != argc || from > until)
+    usage (argv[0]);
+
+  double start = now_ms ();
+
+  /* Leases that overlap the period started at most a window before
+   * it. They are recorded in the segment of the day they are written
+   * on, which may be the day after they started since the server
+   * holds records back for up to a minute to fill blocks. */
+  int64_t first_day = from == INT64_MIN ? INT64_MIN
+                                        : (from - window) / 86400;
+  int64_t last_day = until == INT64_MAX ? INT64_MAX : until / 86400 + 1;
+
+  DIR *d = opendir (dir);
+  if (d == NULL) {
+    log_errno ("Failed to open %s", dir);
+    exit (EXIT_FAILURE);
+  }
+
+  struct dirent *ent;
+  while ((ent = readdir (d)) != NULL && ndays < MAX_SEGMENTS) {
+    int64_t day = segment_day (ent->d_name);
+    if (day >= 0 && day >= first_day && day <= last_day)
+      days[ndays++] = day;
+  }
+  closedir (d);
+
+  qsort (days, ndays, sizeof (*days), compare_days);
+
+  for (size_t i = 0; i < ndays; i++)
+    query_segment (days[i]);
+
+  fprintf (stderr, "%zu records, %zu of %zu blocks read from %zu segments "
+           "(%zu without index) in %.2f ms\n", nmatches, nblocks_read,
+           nblocks, nsegments, nbuilt, now_ms () - start);
+  return 0;
+}
@@ -0,0 +1,224 @@
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
+#include "trace.h"
+#include "dhcp.h"
+#include "log.h"
+
+static const char *stage_names[TRACE_NSTAGES] = {
+  [TRACE_STAGE_QUEUE] = "queue",
+  [TRACE_STAGE_PROCESS] = "process",
+  [TRACE_STAGE_SEND] = "send",
+};
+
+static int64_t
+realtime_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_REALTIME, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+trace_record (struct trace *tr, enum trace_stage stage, int64_t ns)
+{
+  int bucket = 0;
+
+  while (ns > 1 && bucket < TRACE_NBUCKETS - 1) {
+    ns >>= 1;
+    bucket++;
+  }
+
+  tr->hist[stage][bucket]++;
+}
+
+/* Get the software timestamp from a control message, 0 if none */
+static int64_t
+cmsg_timestamp (struct msghdr *mh)
+{
+  for (struct cmsghdr *cm = CMSG_FIRSTHDR (mh); cm; cm = CMSG_NXTHDR (mh, cm)) {
+    if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_TIMESTAMPING)
+      continue;
+
+    struct scm_timestamping ts;
+    memcpy (&ts, CMSG_DATA (cm), sizeof (ts));
+    return (int64_t) ts.ts[0].tv_sec * 1000000000 + ts.ts[0].tv_nsec;
+  }
+
+  return 0;
+}
+
+int
+trace_init (struct trace *tr, int sockfd, const char *path,
+            unsigned sample)
+{
+  memset (tr, 0, sizeof (*tr));
+  tr->sockfd = sockfd;
+
+  int flags = SOF_TIMESTAMPING_RX_SOFTWARE
+              | SOF_TIMESTAMPING_TX_SOFTWARE
+              | SOF_TIMESTAMPING_SOFTWARE
+              | SOF_TIMESTAMPING_OPT_ID
+              | SOF_TIMESTAMPING_OPT_TSONLY;
+
+  if (setsockopt (sockfd, SOL_SOCKET, SO_TIMESTAMPING,
+                  &flags, sizeof (flags)) < 0) {
+    log_errno ("Failed to enable timestamping");
+    return -1;
+  }
+
+  if (path) {
+    if ((tr->file = fopen (path, "a")) == NULL) {
+      log_errno ("Failed to open trace file %s", path);
+      return -1;
+    }
+
+    /* Other interfaces append to the same file */
+    setvbuf (tr->file, NULL, _IOLBF, 0);
+    tr->sample = sample ? sample : 1;
+  }
+
+  tr->enabled = 1;
+  return 0;
+}
+
+void
+trace_rx (struct trace *tr, struct msghdr *mh)
+{
+  if (!tr->enabled)
+    return;
+
+  memset (&tr->cur, 0, sizeof (tr->cur));
+  tr->cur.start = realtime_ns ();
+  tr->cur.rx = cmsg_timestamp (mh);
+
+  if (tr->cur.rx)
+    trace_record (tr, TRACE_STAGE_QUEUE, tr->cur.start - tr->cur.rx);
+}
+
+void
+trace_send (struct trace *tr, uint32_t xid, uint8_t type)
+{
+  if (!tr->enabled)
+    return;
+
+  tr->cur.xid = xid;
+  tr->cur.type = type;
+  tr->cur.sent = realtime_ns ();
+}
+
+void
+trace_sent (struct trace *tr)
+{
+  if (!tr->enabled)
+    return;
+
+  trace_record (tr, TRACE_STAGE_PROCESS, tr->cur.sent - tr->cur.start);
+
+  /* The kernel numbers transmitted packets from zero */
+  tr->cur.key = tr->next_key++;
+  tr->pending[tr->cur.key % TRACE_PENDING] = tr->cur;
+}
+
+void
+trace_skip (struct trace *tr)
+{
+  if (!tr->enabled)
+    return;
+
+  tr->next_key++;
+}
+
+void
+trace_errqueue (struct trace *tr)
+{
+  char control[256];
+  struct msghdr mh;
+
+  if (!tr->enabled)
+    return;
+
+  for (;;) {
+    memset (&mh, 0, sizeof (mh));
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof (control);
+
+    if (recvmsg (tr->sockfd, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        log_errno ("Failed to read error queue");
+      return;
+    }
+
+    int64_t ts = cmsg_timestamp (&mh);
+    struct sock_extended_err *ee = NULL;
+
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR (&mh); cm; cm = CMSG_NXTHDR (&mh, cm))
+      if (cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_RECVERR)
+        ee = (struct sock_extended_err *) CMSG_DATA (cm);
+
+    if (ts == 0 || ee == NULL || ee->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+      continue;
+
+    struct trace_tx *tx = &tr->pending[ee->ee_data % TRACE_PENDING];
+    if (tx->key != ee->ee_data || tx->sent == 0)
+      continue;
+
+    trace_record (tr, TRACE_STAGE_SEND, ts - tx->sent);
+
+    if (tr->file && tr->nsampled++ % tr->sample == 0)
+      fprintf (tr->file, "%08x %s queue=%lld process=%lld send=%lld\n",
+               tx->xid, dhcp_msg_type_str (tx->type),
+               tx->rx ? (long long) (tx->start - tx->rx) : -1LL,
+               (long long) (tx->sent - tx->start),
+               (long long) (ts - tx->sent));
+
+    tx->sent = 0;
+  }
+}
+
+/* Upper bound of the bucket containing a percentile */
+static int64_t
+trace_percentile (const uint64_t *hist, double p)
+{
+  uint64_t total = 0, sum = 0;
+
+  for (int i = 0; i < TRACE_NBUCKETS; i++)
+    total += hist[i];
+
+  for (int i = 0; i < TRACE_NBUCKETS; i++) {
+    sum += hist[i];
+    if (sum >= p * total)
+      return (int64_t) 2 << i;
+  }
+
+  return 0;
+}
+
+void
+trace_dump (struct trace *tr)
+{
+  if (!tr->enabled)
+    return;
+
+  for (int s = 0; s < TRACE_NSTAGES; s++)
+    log_info ("latency %s: p50 < %.1fus, p99 < %.1fus, max < %.1fus",
+              stage_names[s],
+              trace_percentile (tr->hist[s], 0.5) / 1000.0,
+              trace_percentile (tr->hist[s], 0.99) / 1000.0,
+              trace_percentile (tr->hist[s], 1.0) / 1000.0);
+
+  if (tr->file)
+    fflush (tr->file);
+}
+
+void
+trace_deinit (struct trace *tr)
+{
+  if (tr->file)
+    fclose (tr->file);
+}
@@ -0,0 +1,97 @@
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+/* Transaction latency tracing
+ *
+ * Uses software receive and transmit timestamps from the kernel
+ * (SO_TIMESTAMPING) to split the latency of each transaction into
+ * three stages:
+ *
+ *   queue    kernel receive timestamp -> start of processing
+ *   process  start of processing -> reply handed to sendto
+ *   send     reply handed to sendto -> kernel transmit timestamp
+ *
+ * Every stage has a histogram with power of two buckets. A sample of
+ * transactions can also be written to a trace file.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define TRACE_NBUCKETS 40
+#define TRACE_PENDING 64
+
+enum trace_stage {
+  TRACE_STAGE_QUEUE,
+  TRACE_STAGE_PROCESS,
+  TRACE_STAGE_SEND,
+  TRACE_NSTAGES,
+};
+
+struct trace_tx {
+  /* Transmit timestamp key */
+  uint32_t key;
+
+  /* Transaction id and reply type */
+  uint32_t xid;
+  uint8_t type;
+
+  /* Stage start times, in ns */
+  int64_t rx;
+  int64_t start;
+  int64_t sent;
+};
+
+struct trace {
+  /* Nonzero if timestamping is enabled */
+  int enabled;
+
+  /* Socket being traced */
+  int sockfd;
+
+  /* Histograms, bucket i counts latencies in [2^i, 2^(i+1)) ns */
+  uint64_t hist[TRACE_NSTAGES][TRACE_NBUCKETS];
+
+  /* Current transaction */
+  struct trace_tx cur;
+
+  /* Replies waiting for their transmit timestamp */
+  struct trace_tx pending[TRACE_PENDING];
+
+  /* Key of the next transmitted packet */
+  uint32_t next_key;
+
+  /* Trace file and sampling rate, 1 in sample transactions */
+  FILE *file;
+  unsigned sample;
+  unsigned nsampled;
+};
+
+/* Enable timestamping on a socket, writing sampled transactions
+ * to path if it is not NULL */
+int trace_init (struct trace *tr, int sockfd, const char *path,
+                unsigned sample);
+
+/* Start a transaction from a received message */
+void trace_rx (struct trace *tr, struct msghdr *mh);
+
+/* A reply is about to be sent */
+void trace_send (struct trace *tr, uint32_t xid, uint8_t type);
+
+/* The reply was sent */
+void trace_sent (struct trace *tr);
+
+/* A reply that is not traced was sent, taking up a key all the same */
+void trace_skip (struct trace *tr);
+
+/* Read transmit timestamps from the socket error queue */
+void trace_errqueue (struct trace *tr);
+
+/* Log percentiles of each stage */
+void trace_dump (struct trace *tr);
+
+/* Dispose of trace state */
+void trace_deinit (struct trace *tr);
+
+#endif
@@ -0,0 +1,492 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#include "xdp.h"
+#include "log.h"
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+/* Entries in each ring */
+#define RING_SIZE (XDP_NFRAMES / 2)
+
+/* Headroom in front of every frame, which puts the DHCP message
+ * behind the Ethernet, IP and UDP headers on a 4 byte boundary */
+#define FRAME_HEADROOM 2
+
+/* Ethernet, IPv4 and UDP headers in front of the message */
+#define HDR_LEN (ETHER_HDR_LEN + sizeof (struct iphdr) \
+                 + sizeof (struct udphdr))
+
+/* Receive queues the socket map has room for */
+#define MAX_QUEUES 64
+
+#define INSN(c, d, s, o, i) \
+  ((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s), \
+                       .off = (o), .imm = (i) })
+
+static int
+bpf (int cmd, union bpf_attr *attr)
+{
+  return syscall (__NR_bpf, cmd, attr, sizeof (*attr));
+}
+
+/* Load the program redirecting DHCP frames to the sockets in map_fd */
+static int
+load_prog (int map_fd)
+{
+  /* Frames that are not redirected go on to the kernel stack. Jump
+   * offsets count from the next instruction to "pass" at 23. */
+  const struct bpf_insn prog[] = {
+    /* r6 = ctx, r2 = data, r3 = data_end */
+    INSN (BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0),
+    INSN (BPF_LDX | BPF_MEM | BPF_W, 2, 1, offsetof (struct xdp_md, data), 0),
+    INSN (BPF_LDX | BPF_MEM | BPF_W, 3, 1,
+          offsetof (struct xdp_md, data_end), 0),
+
+    /* Room for the Ethernet, IPv4 and UDP headers */
+    INSN (BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0),
+    INSN (BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, HDR_LEN),
+    INSN (BPF_JMP | BPF_JGT | BPF_X, 4, 3, 17, 0),
+
+    /* IPv4 without options */
+    INSN (BPF_LDX | BPF_MEM | BPF_H, 5, 2, 12, 0),
+    INSN (BPF_JMP | BPF_JNE | BPF_K, 5, 0, 15, htons (ETHERTYPE_IP)),
+    INSN (BPF_LDX | BPF_MEM | BPF_B, 5, 2, 14, 0),
+    INSN (BPF_JMP | BPF_JNE | BPF_K, 5, 0, 13, 0x45),
+
+    /* Unfragmented UDP */
+    INSN (BPF_LDX | BPF_MEM | BPF_B, 5, 2, 23, 0),
+    INSN (BPF_JMP | BPF_JNE | BPF_K, 5, 0, 11, IPPROTO_UDP),
+    INSN (BPF_LDX | BPF_MEM | BPF_H, 5, 2, 20, 0),
+    INSN (BPF_ALU64 | BPF_AND | BPF_K, 5, 0, 0, htons (IP_MF | IP_OFFMASK)),
+    INSN (BPF_JMP | BPF_JNE | BPF_K, 5, 0, 8, 0),
+
+    /* To the server port */
+    INSN (BPF_LDX | BPF_MEM | BPF_H, 5, 2, 36, 0),
+    INSN (BPF_JMP | BPF_JNE | BPF_K, 5, 0, 6, htons (DHCP_PORT_SERVER)),
+
+    /* Redirect to the socket of the receive queue, if there is one */
+    INSN (BPF_LDX | BPF_MEM | BPF_W, 2, 6,
+          offsetof (struct xdp_md, rx_queue_index), 0),
+    INSN (BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, map_fd),
+    INSN (0, 0, 0, 0, 0),
+    INSN (BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS),
+    INSN (BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+    INSN (BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+
+    /* pass: */
+    INSN (BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS),
+    INSN (BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+  };
+  static char verifier_log[4096];
+  union bpf_attr attr;
+
+  memset (&attr, 0, sizeof (attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.expected_attach_type = BPF_XDP;
+  attr.insns = (uintptr_t) prog;
+  attr.insn_cnt = sizeof (prog) / sizeof (*prog);
+  attr.license = (uintptr_t) "GPL";
+  attr.log_buf = (uintptr_t) verifier_log;
+  attr.log_size = sizeof (verifier_log);
+  attr.log_level = 1;
+
+  int fd = bpf (BPF_PROG_LOAD, &attr);
+  if (fd < 0)
+    log_errno ("Failed to load XDP program: %s", verifier_log);
+
+  return fd;
+}
+
+/* Map a ring of the socket */
+static int
+map_ring (int fd, struct xdp_ring *ring, const struct xdp_ring_offset *off,
+          size_t desc_size, uint64_t pgoff)
+{
+  size_t len = off->desc + RING_SIZE * desc_size;
+  uint8_t *map = mmap (NULL, len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, pgoff);
+  if (map == MAP_FAILED) {
+    log_errno ("Failed to map AF_XDP ring");
+    return -1;
+  }
+
+  ring->producer = (uint32_t *) (map + off->producer);
+  ring->consumer = (uint32_t *) (map + off->consumer);
+  ring->descs = map + off->desc;
+  ring->size = RING_SIZE;
+  return 0;
+}
+
+/* Entries the other side has produced on a ring we consume */
+static uint32_t
+ring_avail (const struct xdp_ring *ring)
+{
+  return __atomic_load_n (ring->producer, __ATOMIC_ACQUIRE) - *ring->consumer;
+}
+
+/* Entries free on a ring we produce */
+static uint32_t
+ring_free (const struct xdp_ring *ring)
+{
+  return ring->size - (*ring->producer
+                       - __atomic_load_n (ring->consumer, __ATOMIC_ACQUIRE));
+}
+
+static void
+ring_produce (struct xdp_ring *ring, uint32_t n)
+{
+  __atomic_store_n (ring->producer, *ring->producer + n, __ATOMIC_RELEASE);
+}
+
+static void
+ring_consume (struct xdp_ring *ring, uint32_t n)
+{
+  __atomic_store_n (ring->consumer, *ring->consumer + n, __ATOMIC_RELEASE);
+}
+
+static int
+get_ether (const char *ifname, uint8_t *ether)
+{
+  struct ifreq ifr;
+  int fd = socket (AF_INET, SOCK_DGRAM, 0);
+
+  memset (&ifr, 0, sizeof (ifr));
+  strncpy (ifr.ifr_name, ifname, sizeof (ifr.ifr_name) - 1);
+
+  if (fd < 0 || ioctl (fd, SIOCGIFHWADDR, &ifr) < 0) {
+    log_errno ("Failed to get hardware address of %s", ifname);
+    if (fd >= 0)
+      close (fd);
+    return -1;
+  }
+
+  memcpy (ether, ifr.ifr_hwaddr.sa_data, ETHER_ADDR_LEN);
+  close (fd);
+  return 0;
+}
+
+int
+xdp_open (struct xdp_port *xp, const char *ifname, int native)
+{
+  memset (xp, 0, sizeof (*xp));
+  xp->fd = -1;
+
+  unsigned int ifindex = if_nametoindex (ifname);
+  if (ifindex == 0) {
+    log_errno ("Unknown interface %s", ifname);
+    return -1;
+  }
+
+  if (get_ether (ifname, xp->ether) < 0)
+    return -1;
+
+  xp->umem = mmap (NULL, XDP_NFRAMES * XDP_FRAME_SIZE,
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (xp->umem == MAP_FAILED) {
+    log_errno ("Failed to allocate AF_XDP frames");
+    return -1;
+  }
+
+  if ((xp->fd = socket (AF_XDP, SOCK_RAW, 0)) < 0) {
+    log_errno ("Failed to open AF_XDP socket");
+    return -1;
+  }
+
+  struct xdp_umem_reg reg;
+  memset (&reg, 0, sizeof (reg));
+  reg.addr = (uintptr_t) xp->umem;
+  reg.len = XDP_NFRAMES * XDP_FRAME_SIZE;
+  reg.chunk_size = XDP_FRAME_SIZE;
+  reg.headroom = FRAME_HEADROOM;
+
+  int ring_size = RING_SIZE;
+  if (setsockopt (xp->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof (reg)) < 0
+      || setsockopt (xp->fd, SOL_XDP, XDP_UMEM_FILL_RING,
+                     &ring_size, sizeof (ring_size)) < 0
+      || setsockopt (xp->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING,
+                     &ring_size, sizeof (ring_size)) < 0
+      || setsockopt (xp->fd, SOL_XDP, XDP_RX_RING,
+                     &ring_size, sizeof (ring_size)) < 0
+      || setsockopt (xp->fd, SOL_XDP, XDP_TX_RING,
+                     &ring_size, sizeof (ring_size)) < 0) {
+    log_errno ("Failed to set up AF_XDP rings");
+    return -1;
+  }
+
+  struct xdp_mmap_offsets off;
+  socklen_t optlen = sizeof (off);
+  if (getsockopt (xp->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0) {
+    log_errno ("Failed to get AF_XDP ring offsets");
+    return -1;
+  }
+
+  if (map_ring (xp->fd, &xp->fill, &off.fr, sizeof (uint64_t),
+                XDP_UMEM_PGOFF_FILL_RING) < 0
+      || map_ring (xp->fd, &xp->comp, &off.cr, sizeof (uint64_t),
+                   XDP_UMEM_PGOFF_COMPLETION_RING) < 0
+      || map_ring (xp->fd, &xp->rx, &off.rx, sizeof (struct xdp_desc),
+                   XDP_PGOFF_RX_RING) < 0
+      || map_ring (xp->fd, &xp->tx, &off.tx, sizeof (struct xdp_desc),
+                   XDP_PGOFF_TX_RING) < 0)
+    return -1;
+
+  /* The first half of the frames is for receiving, the rest is
+   * kept for replies */
+  uint64_t *fill = xp->fill.descs;
+  for (size_t i = 0; i < RING_SIZE; i++)
+    fill[i] = i * XDP_FRAME_SIZE;
+  ring_produce (&xp->fill, RING_SIZE);
+
+  for (size_t i = RING_SIZE; i < XDP_NFRAMES; i++)
+    xp->tx_free[xp->ntx_free++] = i * XDP_FRAME_SIZE;
+
+  /* Generic mode can only copy frames */
+  struct sockaddr_xdp sxdp;
+  memset (&sxdp, 0, sizeof (sxdp));
+  sxdp.sxdp_family = AF_XDP;
+  sxdp.sxdp_ifindex = ifindex;
+  sxdp.sxdp_queue_id = 0;
+  sxdp.sxdp_flags = native ? 0 : XDP_COPY;
+
+  if (bind (xp->fd, (struct sockaddr *) &sxdp, sizeof (sxdp)) < 0) {
+    log_errno ("Failed to bind AF_XDP socket to %s", ifname);
+    return -1;
+  }
+
+  union bpf_attr attr;
+  memset (&attr, 0, sizeof (attr));
+  attr.map_type = BPF_MAP_TYPE_XSKMAP;
+  attr.key_size = sizeof (uint32_t);
+  attr.value_size = sizeof (uint32_t);
+  attr.max_entries = MAX_QUEUES;
+
+  if ((xp->map_fd = bpf (BPF_MAP_CREATE, &attr)) < 0) {
+    log_errno ("Failed to create AF_XDP socket map");
+    return -1;
+  }
+
+  uint32_t queue = 0;
+  memset (&attr, 0, sizeof (attr));
+  attr.map_fd = xp->map_fd;
+  attr.key = (uintptr_t) &queue;
+  attr.value = (uintptr_t) &xp->fd;
+  attr.flags = BPF_ANY;
+
+  if (bpf (BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+    log_errno ("Failed to add AF_XDP socket to map");
+    return -1;
+  }
+
+  if ((xp->prog_fd = load_prog (xp->map_fd)) < 0)
+    return -1;
+
+  /* The program stays attached for as long as the link is open */
+  memset (&attr, 0, sizeof (attr));
+  attr.link_create.prog_fd = xp->prog_fd;
+  attr.link_create.target_ifindex = ifindex;
+  attr.link_create.attach_type = BPF_XDP;
+  attr.link_create.flags = native ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+
+  if ((xp->link_fd = bpf (BPF_LINK_CREATE, &attr)) < 0) {
+    log_errno ("Failed to attach XDP program to %s", ifname);
+    return -1;
+  }
+
+  log_info ("%s: AF_XDP datapath in %s mode", ifname,
+            native ? "native" : "generic");
+  return 0;
+}
+
+/* Put a frame back on the fill ring. There are never more receive
+ * frames than fill ring entries. */
+static void
+refill (struct xdp_port *xp, uint64_t addr)
+{
+  uint64_t *fill = xp->fill.descs;
+
+  fill[*xp->fill.producer & (xp->fill.size - 1)] = addr;
+  ring_produce (&xp->fill, 1);
+}
+
+size_t
+xdp_recv (struct xdp_port *xp, struct xdp_frame *frames, size_t n)
+{
+  const struct xdp_desc *descs = xp->rx.descs;
+  uint32_t avail = ring_avail (&xp->rx);
+  size_t count = 0;
+
+  if (avail > n)
+    avail = n;
+
+  for (uint32_t i = 0; i < avail; i++) {
+    const struct xdp_desc *desc =
+      &descs[(*xp->rx.consumer + i) & (xp->rx.size - 1)];
+    uint8_t *pkt = xp->umem + desc->addr;
+
+    /* The program only redirects UDP to the server port, the
+     * lengths are left to check */
+    const struct udphdr *udp =
+      (struct udphdr *) (pkt + ETHER_HDR_LEN + sizeof (struct iphdr));
+    size_t len = ntohs (udp->len);
+    if (desc->len < HDR_LEN || len < sizeof (*udp)
+        || len > desc->len - HDR_LEN + sizeof (*udp)) {
+      refill (xp, desc->addr);
+      continue;
+    }
+    len -= sizeof (*udp);
+
+    /* Messages are read as a whole struct dhcp_msg, which fits in
+     * the frame behind the packet */
+    struct dhcp_msg *msg = (struct dhcp_msg *) (pkt + HDR_LEN);
+    if (len < sizeof (*msg))
+      memset ((uint8_t *) msg + len, 0, sizeof (*msg) - len);
+    else
+      len = sizeof (*msg);
+
+    struct xdp_frame *frame = &frames[count++];
+    frame->addr = desc->addr;
+    frame->msg = msg;
+    frame->len = len;
+    frame->src_ether = pkt + ETHER_ADDR_LEN;
+  }
+
+  ring_consume (&xp->rx, avail);
+  xp->nreceived += count;
+  return count;
+}
+
+void
+xdp_release (struct xdp_port *xp, const struct xdp_frame *frames, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    refill (xp, frames[i].addr);
+}
+
+/* Take back frames the kernel has sent */
+static void
+reclaim (struct xdp_port *xp)
+{
+  const uint64_t *comp = xp->comp.descs;
+  uint32_t avail = ring_avail (&xp->comp);
+
+  for (uint32_t i = 0; i < avail; i++) {
+    uint64_t addr = comp[(*xp->comp.consumer + i) & (xp->comp.size - 1)];
+    xp->tx_free[xp->ntx_free++] = addr & ~(uint64_t) (XDP_FRAME_SIZE - 1);
+  }
+
+  ring_consume (&xp->comp, avail);
+}
+
+struct dhcp_msg *
+xdp_tx_buf (struct xdp_port *xp)
+{
+  if (xp->ntx_free == 0)
+    reclaim (xp);
+  if (xp->ntx_free == 0)
+    return NULL;
+
+  uint64_t addr = xp->tx_free[xp->ntx_free - 1] + FRAME_HEADROOM;
+  return (struct dhcp_msg *) (xp->umem + addr + HDR_LEN);
+}
+
+/* Internet checksum of an IPv4 header */
+static uint16_t
+ip_checksum (const struct iphdr *ip)
+{
+  const uint8_t *p = (const uint8_t *) ip;
+  uint32_t sum = 0;
+
+  for (size_t i = 0; i < sizeof (*ip); i += 2)
+    sum += p[i] << 8 | p[i + 1];
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+
+  return htons (~sum);
+}
+
+int
+xdp_send (struct xdp_port *xp, struct dhcp_msg *msg, in_addr_t src,
+          const struct sockaddr_in *dst, const uint8_t *dst_ether)
+{
+  static const uint8_t broadcast[ETHER_ADDR_LEN] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+  };
+
+  if (ring_free (&xp->tx) == 0) {
+    xp->ndropped++;
+    return -1;
+  }
+
+  uint8_t *pkt = (uint8_t *) msg - HDR_LEN;
+  size_t len = HDR_LEN + sizeof (*msg);
+
+  struct ether_header *eth = (struct ether_header *) pkt;
+  if (dst->sin_addr.s_addr == INADDR_BROADCAST)
+    dst_ether = broadcast;
+  memcpy (eth->ether_dhost, dst_ether, ETHER_ADDR_LEN);
+  memcpy (eth->ether_shost, xp->ether, ETHER_ADDR_LEN);
+  eth->ether_type = htons (ETHERTYPE_IP);
+
+  struct iphdr *ip = (struct iphdr *) (pkt + ETHER_HDR_LEN);
+  memset (ip, 0, sizeof (*ip));
+  ip->version = 4;
+  ip->ihl = sizeof (*ip) / 4;
+  ip->tot_len = htons (len - ETHER_HDR_LEN);
+  ip->ttl = 64;
+  ip->protocol = IPPROTO_UDP;
+  ip->saddr = src;
+  ip->daddr = dst->sin_addr.s_addr;
+  ip->check = ip_checksum (ip);
+
+  /* The UDP checksum is optional over IPv4 */
+  struct udphdr *udp = (struct udphdr *) (ip + 1);
+  udp->source = htons (DHCP_PORT_SERVER);
+  udp->dest = dst->sin_port;
+  udp->len = htons (len - ETHER_HDR_LEN - sizeof (*ip));
+  udp->check = 0;
+
+  struct xdp_desc *descs = xp->tx.descs;
+  struct xdp_desc *desc = &descs[*xp->tx.producer & (xp->tx.size - 1)];
+  desc->addr = pkt - xp->umem;
+  desc->len = len;
+  desc->options = 0;
+  ring_produce (&xp->tx, 1);
+
+  xp->ntx_free--;
+  xp->nsent++;
+  return 0;
+}
+
+void
+xdp_flush (struct xdp_port *xp)
+{
+  /* Copy mode only sends when asked to */
+  if (ring_free (&xp->tx) < xp->tx.size
+      && sendto (xp->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0
+      && errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+    log_errno ("Failed to send AF_XDP frames");
+
+  reclaim (xp);
+}
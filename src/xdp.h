@@ -0,0 +1,109 @@
+#ifndef XDP_H_INCLUDED
+#define XDP_H_INCLUDED
+
+/* AF_XDP datapath
+ *
+ * A small XDP program attached to the interface redirects IPv4
+ * frames to UDP port 67 without IP options or fragmentation into an
+ * AF_XDP socket, everything else goes on to the kernel stack. The
+ * server reads the DHCP message in place in the receive frame and
+ * builds its reply straight into a transmit frame, so that neither
+ * is copied between the kernel and the server.
+ *
+ * Only the first receive queue of the interface is served, frames
+ * arriving on other queues are left to the kernel stack as well.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <netinet/ether.h>
+
+#include "dhcp.h"
+
+/* Frames in the shared buffer area, half of them for receiving
+ * and half for sending */
+#define XDP_NFRAMES 2048
+#define XDP_FRAME_SIZE 2048
+
+/* Frames handled per receive */
+#define XDP_BATCH 64
+
+/* Ring shared with the kernel */
+struct xdp_ring {
+  uint32_t *producer;
+  uint32_t *consumer;
+  void *descs;
+  uint32_t size;
+};
+
+/* Received DHCP message */
+struct xdp_frame {
+  /* Address of the frame in the buffer area */
+  uint64_t addr;
+
+  /* Message in the frame, zero padded past len */
+  struct dhcp_msg *msg;
+  size_t len;
+
+  /* Hardware address it was sent from */
+  const uint8_t *src_ether;
+};
+
+struct xdp_port {
+  /* AF_XDP socket, -1 if not in use */
+  int fd;
+
+  /* XDP program, its socket map and its attachment */
+  int prog_fd;
+  int map_fd;
+  int link_fd;
+
+  /* Hardware address of the interface */
+  uint8_t ether[ETHER_ADDR_LEN];
+
+  /* Shared buffer area */
+  uint8_t *umem;
+
+  /* Fill and completion rings of the buffer area and the receive
+   * and transmit rings of the socket */
+  struct xdp_ring fill;
+  struct xdp_ring comp;
+  struct xdp_ring rx;
+  struct xdp_ring tx;
+
+  /* Transmit frames not in use */
+  uint64_t tx_free[XDP_NFRAMES / 2];
+  size_t ntx_free;
+
+  /* Counters */
+  size_t nreceived;
+  size_t nsent;
+  size_t ndropped;
+};
+
+/* Set up a socket on the first queue of an interface and attach the
+ * XDP program in driver mode if native, or else in generic mode */
+int xdp_open (struct xdp_port *xp, const char *ifname, int native);
+
+/* Take up to n DHCP messages from the receive ring. The frames stay
+ * with the caller until they are released. */
+size_t xdp_recv (struct xdp_port *xp, struct xdp_frame *frames, size_t n);
+
+/* Give received frames back to the kernel */
+void xdp_release (struct xdp_port *xp, const struct xdp_frame *frames,
+                  size_t n);
+
+/* Message of the next free transmit frame, to build a reply in.
+ * Returns NULL if every transmit frame is in flight. */
+struct dhcp_msg *xdp_tx_buf (struct xdp_port *xp);
+
+/* Queue the reply built in msg, which must come from xdp_tx_buf,
+ * from src to dst. Unicast replies go to dst_ether. */
+int xdp_send (struct xdp_port *xp, struct dhcp_msg *msg, in_addr_t src,
+              const struct sockaddr_in *dst, const uint8_t *dst_ether);
+
+/* Have the kernel send queued replies and take back sent frames */
+void xdp_flush (struct xdp_port *xp);
+
+#endif